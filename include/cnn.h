@@ -8,37 +8,47 @@
 #define MINI_CNN_H
 
 #include <vector>
+#include <memory>
 #include <cmath>
 #include <algorithm>
 #include <random>
+#include <numeric>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <istream>
 #include <assert.h>
 
 #include "linalg.h"
 #include "geometric.h"  // for the multi dimensional iterators
+#include "sgemm.h"     // all the matrix products go through this, madd() and dot() come from simd.h with it
+#include "vmath.h"     // vexp(), vtanh() and vsigmoid(), a vector at a time
 
-#include <immintrin.h>
-static bool simd_enable=true;
-
+// f() is one value,  map() is f() over a whole array which is what the layers use
 struct Sigmoid
 {
 	static float f(float t) { return 1.0f / (1 + exp(-t)); }
 	static float df(float f_t) { return f_t*(1 - f_t); }
+	static void map(const float *x, float *y, int n) { vsigmoid(x, y, n); }
 };
 struct TanH
 {
-	static float f(float t) { auto e = std::exp(2 * t); return (e - 1) / (e + 1); }      // { return std::tanh(t); }  // even compiling with sse and fast math, tanh is slow , but there is a sse2 optimized fast path for exp()
+	static float f(float t) { auto e = std::exp(2 * t); return (e - 1) / (e + 1); }      // { return std::tanh(t); }  // even compiling with sse and fast math, tanh is slow, so map() uses vmath.h
 	static float df(float f_t) { return 1.0f - f_t*f_t; }
+	static void map(const float *x, float *y, int n) { vtanh(x, y, n); }
 };
 struct ReLU
 {
 	static float f(float t) { return std::max(0.0f, t); }
 	static float df(float f_t) { return (f_t > 0.0f) ? 1.0f : 0.0f; }
+	static void map(const float *x, float *y, int n) { std::transform(x, x + n, y, f); }
 };
 struct LeakyReLU
 {
 	static float f(float t) { return std::max(0.01f*t, t); }
 	static float df(float f_t) { return (f_t > 0.0f) ? 1.0f : 0.01f; }
+	static void map(const float *x, float *y, int n) { std::transform(x, x + n, y, f); }
 };
 
 int2 make_packed_stride(const int2 & dims) { return {1, dims.x}; }
@@ -93,43 +103,84 @@ template<class T> void madd(const tensorview<T,3> & d, const tensorview<const T,
 }
 template<class T> void madd(const tensorview<T,3> & d, const tensorview<T,3> & a, T s) { return madd(d, tensorview<const T,3>(a), s); }
 
-inline void loadvb(std::istream &s,      std::vector<float> &a) { s.read ((char*)a.data(), a.size()*sizeof(float)); }
-inline void savevb(std::ostream &s,const std::vector<float> &a) { s.write((char*)a.data(), a.size()*sizeof(float)); }
+template<class V> void loadvb(std::istream &s,      V &a) { s.read ((char*)a.data(), a.size()*sizeof(float)); }
+template<class V> void savevb(std::ostream &s,const V &a) { s.write((char*)a.data(), a.size()*sizeof(float)); }
 
 struct CNN
 {
+	// A batch of n samples is just the n inputs (or outputs or errors) packed one after the other.
+	// Layers see it as a 2d view, dims.x is the size of one sample and dims.y is n.
+	// Layers write into views the caller already sized, CNN keeps every layer's output and error buffers (see Plan()).
+	typedef tensorview<float, 2>       batch;
+	typedef tensorview<const float, 2> cbatch;
+	static batch  make_batch(      std::vector<float> &v, int n) { return {v.data(), {(int)v.size() / n, n}}; }
+	static cbatch make_batch(const std::vector<float> &v, int n) { return {v.data(), {(int)v.size() / n, n}}; }
+	template<class T> static T *row(const tensorview<T, 2> &b, int s) { return b.data + s*b.stride.y; }
+	template<class T> static tensorview<T, 3> sample(const tensorview<T, 2> &b, int s, int3 dims) { return {row(b, s), dims}; }
+	static std::vector<float> sample(const std::vector<float> &v, int n, int i) { size_t s = v.size() / n; return std::vector<float>(v.begin() + s*i, v.begin() + s*(i + 1)); }
+
+	// A layer's weights or biases.  Usually the layer's own, but they can alias floats something else keeps alive instead,
+	// like a model file CNNMap() (see cnnfile.h) mapped copy on write, so processes running the same model share one copy.
+	struct Weights
+	{
+		std::vector<float> own;
+		float *alias = nullptr;
+		size_t n;
+		Weights(size_t n = 0, float v = 0.0f) : own(n, v), n(n) {}
+		Weights(float *p, size_t n) : alias(p), n(n) {}  // the n floats at p, eg in a mapped file (cnnfile.h),  allocates nothing
+		float       *data()       { return alias ? alias : own.data(); }
+		const float *data() const { return alias ? alias : own.data(); }
+		size_t size() const { return n; }
+		float &operator[](size_t i)       { return data()[i]; }
+		float  operator[](size_t i) const { return data()[i]; }
+		float       *begin()       { return data(); }
+		float       *end()         { return data() + n; }
+		const float *begin() const { return data(); }
+		const float *end()   const { return data() + n; }
+	};
 	struct LBase
 	{
-		virtual std::vector<float> forward(const std::vector<float> & x) = 0;
-		virtual std::vector<float> backward(const std::vector<float> & X, const std::vector<float> & Y, const std::vector<float> & E) = 0;
-		virtual void update(const std::vector<float> & X, const std::vector<float> & Y, const std::vector<float> & E, float alpha) {}
+		virtual ~LBase() {}
+		virtual int insize() const = 0;   // floats per sample
+		virtual int outsize() const = 0;
+		virtual void forward(const cbatch & X, const batch & Y) = 0;
+		virtual void backward(const cbatch & X, const cbatch & Y, const cbatch & E, const batch & D) = 0;  // assumes E is up to date
+		virtual void update(const cbatch & X, const cbatch & Y, const cbatch & E, float alpha) {}  // steps the weights down the batch's gradient right away
+		virtual int  params() const { return 0; }  // size of the gradient, weights then biases
+		virtual void gradient(const cbatch & X, const cbatch & Y, const cbatch & E, float *g) {}  // adds the batch's gradient into g
+		virtual void descend(const float *g, float alpha) {}  // steps the weights down gradient g
 		virtual void loada(std::istream & s)       {}
 		virtual void savea(std::ostream & s) const {}
 		virtual void loadb(std::istream & s)       {}
 		virtual void saveb(std::ostream & s) const {}
 		virtual void init(std::default_random_engine &rng) {};
+		virtual bool pointwise() const { return false; }  // each output depends only on the same input, so forward() works in place on any part of a batch
 	};
 	struct LAvgPool final : public LBase  // 2x2
 	{
 		int3 indims;
 		LAvgPool(int3 indims) : indims(indims) {}
 		int3 outdims() const { return {indims.x/2, indims.y/2, indims.z}; }
-		std::vector<float> forward(const std::vector<float> &input) override
+		int insize()  const override { return indims.x*indims.y*indims.z; }
+		int outsize() const override { return outdims().x*outdims().y*outdims().z; }
+		void forward(const cbatch &X, const batch &Y) override
 		{
-			std::vector<float> out(outdims().x*outdims().y*outdims().z);
-			auto in = make_tensorview(input, indims); auto ot = make_tensorview(out, outdims());
-			for(auto i: vol_iteration(outdims()))
-				ot[i] = (in[{i.x*2+0,i.y*2+0,i.z}]+in[{i.x*2+1,i.y*2+0,i.z}]+in[{i.x*2+0,i.y*2+1,i.z}]+in[{i.x*2+1,i.y*2+1,i.z}])/4.0f; 
-			return out;
+			for (int s = 0; s < X.dims.y; s++)
+			{
+				auto in = sample(X, s, indims); auto ot = sample(Y, s, outdims());
+				for(auto i: vol_iteration(outdims()))
+					ot[i] = (in[{i.x*2+0,i.y*2+0,i.z}]+in[{i.x*2+1,i.y*2+0,i.z}]+in[{i.x*2+0,i.y*2+1,i.z}]+in[{i.x*2+1,i.y*2+1,i.z}])/4.0f; 
+			}
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E)  override  // assumes E is up to date
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D)  override  // assumes E is up to date
 		{
-			std::vector<float> D(indims.x*indims.y* indims.z);
-			auto d = make_tensorview(D,indims);
-			auto er = make_tensorview(E, outdims());
-			for (auto i : vol_iteration(indims))
-				d[i] = er[int3(i.x / 2, i.y / 2, i.z)] / 4.0f;
-			return D;
+			for (int s = 0; s < X.dims.y; s++)
+			{
+				auto d  = sample(D, s, indims);
+				auto er = sample(E, s, outdims());
+				for (auto i : vol_iteration(indims))
+					d[i] = er[int3(i.x / 2, i.y / 2, i.z)] / 4.0f;
+			}
 		}
 	};
 	struct LMaxPool final : public LBase  // 2x2  
@@ -137,29 +188,34 @@ struct CNN
 		int3 indims;
 		LMaxPool(int3 indims) : indims(indims) {}
 		int3 outdims() const { return {indims.x/2, indims.y/2, indims.z}; }
-		std::vector<float> forward(const std::vector<float> &input) override
+		int insize()  const override { return indims.x*indims.y*indims.z; }
+		int outsize() const override { return outdims().x*outdims().y*outdims().z; }
+		void forward(const cbatch &X, const batch &Y) override
 		{
-			std::vector<float> out(outdims().x*outdims().y*outdims().z);
-			auto in = make_tensorview(input, indims); auto ot = make_tensorview(out, outdims());
-			for (auto i : vol_iteration(outdims()))
-				ot[i] = std::max(std::max(std::max(in[{i.x * 2 + 0, i.y * 2 + 0, i.z}], in[{i.x * 2 + 1, i.y * 2 + 0, i.z}]), in[{i.x * 2 + 0, i.y * 2 + 1, i.z}]), in[{i.x * 2 + 1, i.y * 2 + 1, i.z}]);
-			return out;
+			for (int s = 0; s < X.dims.y; s++)
+			{
+				auto in = sample(X, s, indims); auto ot = sample(Y, s, outdims());
+				for (auto i : vol_iteration(outdims()))
+					ot[i] = std::max(std::max(std::max(in[{i.x * 2 + 0, i.y * 2 + 0, i.z}], in[{i.x * 2 + 1, i.y * 2 + 0, i.z}]), in[{i.x * 2 + 0, i.y * 2 + 1, i.z}]), in[{i.x * 2 + 1, i.y * 2 + 1, i.z}]);
+			}
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E)  override  // assumes E is up to date
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D)  override  // assumes E is up to date
 		{
-			std::vector<float> D(indims.x*indims.y*indims.z);
-			auto d  = make_tensorview(D, indims);
-			auto in = make_tensorview(X, indims);
-			auto er = make_tensorview(E, outdims());
-			for (auto i : vol_iteration(outdims()))
+			for (int s = 0; s < X.dims.y; s++)
 			{
-				int3 offset(i.x * 2, i.y * 2, i.z), mx = offset;
-				for (auto v : vol_iteration({ 2,2,1 }))
-					if (in[offset + v] > in[mx])
-						mx = offset + v;
-				d[mx] = er[i];
+				auto d  = sample(D, s, indims);
+				auto in = sample(X, s, indims);
+				auto er = sample(E, s, outdims());
+				std::fill(d.data, d.data + insize(), 0.0f);
+				for (auto i : vol_iteration(outdims()))
+				{
+					int3 offset(i.x * 2, i.y * 2, i.z), mx = offset;
+					for (auto v : vol_iteration({ 2,2,1 }))
+						if (in[offset + v] > in[mx])
+							mx = offset + v;
+					d[mx] = er[i];
+				}
 			}
-			return D;
 		}
 	};
 	struct LConv final : public LBase
@@ -167,87 +223,89 @@ struct CNN
 		int3 indims;
 		int4 dims;
 		int3 outdims;
-		std::vector<float> W;
-		std::vector<float> B;
-		tensorview<float,4> weights() { return make_tensorview(W, dims); }
+		Weights W;
+		Weights B;
+		tensorview<float,4> weights() { return {W.data(), dims}; }
 
 		LConv(int3 indims, int4 dims, int3 outdims) : indims(indims), dims(dims), outdims(outdims), W(dims.x*dims.y*dims.z*dims.w), B(dims.w, 0.0f) {}
+		LConv(int3 indims, int4 dims, int3 outdims, float *w, float *b) : indims(indims), dims(dims), outdims(outdims), W(w, dims.x*dims.y*dims.z*dims.w), B(b, dims.w) {}  // weights and biases left where they are
+		int insize()  const override { return indims.x*indims.y*indims.z; }
+		int outsize() const override { return outdims.x*outdims.y*outdims.z; }
+
+		int K() const { return dims.x*dims.y*dims.z; }  // weights per output channel
+		int P() const { return outdims.x*outdims.y; }   // output pixels per channel
+
+		// im2col:  row x+dx*(y+dy*iz) of col holds input channel iz shifted by (x,y), so the convolution is W (outdims.z x K) times col (K x P).
+		// Or just output rows y0 to y1, then col is K x (y1-y0)*outdims.x.
+		void im2col(const float *in, float *col, int y0, int y1) const
+		{
+			int n = (y1 - y0)*outdims.x;
+			for (int iz = 0; iz < dims.z; iz++) for (int y = 0; y < dims.y; y++) for (int x = 0; x < dims.x; x++, col += n)
+				for (int oy = y0; oy < y1; oy++)
+					std::copy(in + x + indims.x*(oy + y + indims.y*iz), in + x + indims.x*(oy + y + indims.y*iz) + outdims.x, col + (oy - y0)*outdims.x);
+		}
+		void im2col(const float *in, float *col) const { im2col(in, col, 0, outdims.y); }
+		void col2im(const float *col, float *in) const  // the transpose, adds each row back into where it came from
+		{
+			for (int iz = 0; iz < dims.z; iz++) for (int y = 0; y < dims.y; y++) for (int x = 0; x < dims.x; x++, col += P())
+				for (int oy = 0; oy < outdims.y; oy++)
+					madd(in + x + indims.x*(oy + y + indims.y*iz), col + oy*outdims.x, 1.0f, outdims.x);
+		}
+		float *scratch() const  // room for one im2col matrix, only grows the first time through
+		{
+			static thread_local std::vector<float> col;
+			col.resize(std::max(col.size(), (size_t)(K()*P())));
+			return col.data();
+		}
 
-		std::vector<float> forward(const std::vector<float> &input) override
-		{
-			std::vector<float> output(outdims.x*outdims.y*outdims.z);
-			auto in = make_tensorview(input, indims);
-			auto ot = make_tensorview(output, outdims);
-			auto wt = weights();
-			// following two lines work elegantly but a bit slow:
-			//for (auto i : vol_iteration(outdims))
-			//	ot[i] = dot(in.subview({ i.x,i.y,0 }, wt.dims.xyz()), wt[i.z]) + B[i.z];
-
-			// following implementation with conv kernal loop on the outside so far beats tinycnn's perf
-			// this removes any instruction stalls in the addition, and provides a larger range to the innermost loop.  eg 320 instead of 5 probably enables better throughput
-			if (0)for (auto v : vol_iteration(outdims))
-				ot[v] = B[v.z];
-			for (int z = 0; z < outdims.z; z++)
-				for (int y = 0; y < outdims.y; y++)
-					for (int x = 0; x < outdims.x; x++)
-						ot[{x, y, z}] = B[z];
-			for (auto p : rect_iteration(dims.xy()))
+		void forward(const cbatch &X, const batch &Y) override
+		{
+			float *col = scratch();
+			for (int s = 0; s < X.dims.y; s++)
 			{
-				for (int iz = 0; iz < indims.z; iz ++) for (int oz = 0; oz < outdims.z; oz++)
-				{
-					float w = wt[{p.x, p.y, iz, oz}];
-					float *op = ot.data + oz*ot.stride.z;
-					for (int y = 0; y < outdims.y; y++)// , ip += in.stride.y - outdims.x*in.stride.x)
-					{
-						const float *ip = in.data + dot(p, in.stride.xy()) + iz*in.stride.z + in.stride.y*y;
-						if (simd_enable)
-						{
-							int x_ = 0;
-							__m128 wwww = _mm_load_ps1(&w);
-
-							//_mm_store_ps()
-							for (; ((uintptr_t)(op)& 15) && x_ < outdims.x; x_++)
-								*op++ += *ip++ *w;
-							__m128 *y = (__m128*)(op);
-							for (; x_ < outdims.x - 3; x_ += 4, ip += 4, y++,op+=4)
-								*y = _mm_add_ps(*y, _mm_mul_ps(_mm_loadu_ps(ip), wwww));
-							for (; x_ < outdims.x; x_++)
-							{
-								*op++ += *ip++ *w;
-							}
-
-						}
-						else for (int x_ = 0; x_ < outdims.x; x_++)
-						{
-							*op++ += *ip++ *w;
-						}
-					}
-				}
+				float *ot = row(Y, s);
+				for (int z = 0; z < outdims.z; z++)
+					std::fill(ot + z*P(), ot + (z + 1)*P(), B[z]);
+				im2col(row(X, s), col);
+				sgemm(false, false, outdims.z, P(), K(), 1.0f, W.data(), K(), col, P(), 1.0f, ot, P());
 			}
-			return output;
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E) override  // assumes E is up to date
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D) override  // assumes E is up to date
 		{
-			std::vector<float> D(indims.x*indims.y*indims.z);
-			auto dt = make_tensorview(D, indims);
-			auto in = make_tensorview(X, indims);
-			auto er = make_tensorview(E, outdims);
-			auto wt = weights();
-			for(auto i : vol_iteration(outdims))
-				madd(dt.subview({ i.x,i.y,0 }, wt.dims.xyz()), wt[i.z], er[i]);
-			return D;
+			float *col = scratch();
+			for (int s = 0; s < X.dims.y; s++)
+			{
+				sgemm(true, false, K(), P(), outdims.z, 1.0f, W.data(), K(), row(E, s), P(), 0.0f, col, P());  // W^T E
+				std::fill(row(D, s), row(D, s) + insize(), 0.0f);
+				col2im(col, row(D, s));
+			}
 		}
-		void update(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E, float alpha) override
+		void accumulate(float *w, float *b, const cbatch &X, const cbatch &E, float alpha)  // w += alpha E col^T,  b += alpha E summed over pixels
 		{
-			auto in = make_tensorview(X, indims);
-			auto er = make_tensorview(E, outdims);
-			auto wt = weights();
-			for (auto i : vol_iteration(outdims))
+			float *col = scratch();
+			for (int s = 0; s < X.dims.y; s++)
 			{
-				madd(wt[i.z], in.subview({ i.x,i.y,0 }, wt.dims.xyz()), -alpha*er[i]);  // W -= X * E * alpha;
-				B[i.z] -= er[i] * alpha;
+				const float *e = row(E, s);
+				im2col(row(X, s), col);
+				sgemm(false, true, outdims.z, K(), P(), alpha, e, P(), col, P(), 1.0f, w, K());
+				for (int z = 0; z < outdims.z; z++)
+					b[z] += alpha * std::accumulate(e + z*P(), e + (z + 1)*P(), 0.0f);
 			}
 		}
+		void update(const cbatch &X, const cbatch &Y, const cbatch &E, float alpha) override
+		{
+			accumulate(W.data(), B.data(), X, E, -alpha);  // W -= X * E * alpha;
+		}
+		int  params() const override { return (int)(W.size() + B.size()); }
+		void gradient(const cbatch &X, const cbatch &Y, const cbatch &E, float *g) override
+		{
+			accumulate(g, g + W.size(), X, E, 1.0f);
+		}
+		void descend(const float *g, float alpha) override
+		{
+			madd(W.data(), g, -alpha, (int)W.size());
+			madd(B.data(), g + W.size(), -alpha, (int)B.size());
+		}
 		virtual void init(std::default_random_engine &rng) override
 		{
 			float range = sqrtf(6.0f / (dims.x*dims.y*dims.z + dims.x*dims.y*dims.w));  // fan_in + fan_out
@@ -262,50 +320,41 @@ struct CNN
 	struct LFull final : public LBase
 	{
 		int M, N;
-		std::vector<float> W;
-		std::vector<float> B;
+		Weights W;
+		Weights B;
 		LFull(int input_size, int output_size) : M(input_size), N(output_size), W(input_size  * output_size), B(output_size, 0.0f) {}
+		LFull(int input_size, int output_size, float *w, float *b) : M(input_size), N(output_size), W(w, input_size * output_size), B(b, output_size) {}  // weights and biases left where they are
+		int insize()  const override { return M; }
+		int outsize() const override { return N; }
 
-		std::vector<float> forward(const std::vector<float> &input) override
+		void forward(const cbatch &X, const batch &Y) override  // Y = X W + B with a row per sample
 		{
-			std::vector<float> Y = B;
-			assert(Y.size() == N);
-
-			const float *w = W.data();
-			if (simd_enable) for (int i = 0; i < M; i++)
-			{
-				__m128 ri = _mm_load_ps1(&input[i]);
-				int j = 0;
-				//_mm_store_ps()
-				for (; ((uintptr_t)(Y.data() + j) & 15) && j < (int)Y.size(); j++)
-					Y[j] += input[i] * *w++;//W[j + i*Y.size()];
-				__m128 *y = (__m128*)(Y.data() + j);
-				for (; j < (int)Y.size() - 3; j += 4, w += 4, y++)
-					*y = _mm_add_ps(*y, _mm_mul_ps(_mm_loadu_ps(w), ri));
-				for (; j < (int)Y.size(); j++)
-					Y[j] += input[i] * *w++;//W[j + i*Y.size()];
-			}
-			else for (int i = 0; i < M; i++)
-				for (unsigned int j = 0; j < Y.size(); j++)
-					Y[j] += input[i] * *w++;//W[j + i*Y.size()];
-
-			return Y;
+			assert(X.dims.x == M && Y.dims.x == N);
+			for (int s = 0; s < X.dims.y; s++)
+				std::copy(B.begin(), B.end(), row(Y, s));
+			sgemm(false, false, X.dims.y, N, M, 1.0f, X.data, X.stride.y, W.data(), N, 1.0f, Y.data, Y.stride.y);
+		}
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D) override  // D = E W^T,  assumes E is up to date
+		{
+			sgemm(false, true, E.dims.y, M, N, 1.0f, E.data, E.stride.y, W.data(), N, 0.0f, D.data, D.stride.y);
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E)  override  // assumes E is up to date
+		void update(const cbatch &X, const cbatch &Y, const cbatch &E, float alpha) override
 		{
-			std::vector<float> D(M, 0.0f);   // initialize to 0
-			for (int i = 0; i < M; i++)
-				for (unsigned int j = 0; j < Y.size(); j++)  // still need to A-B test the ordering of these two for loops,  instruction throughput vs locality of reference in this case
-					D[i] += W[j + i*Y.size()] * E[j];
-			return D;
+			for (int s = 0; s < E.dims.y; s++)
+				madd(B.data(), row(E, s), -alpha, N);
+			sgemm(true, false, M, N, X.dims.y, -alpha, X.data, X.stride.y, E.data, E.stride.y, 1.0f, W.data(), N);
 		}
-		void update(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E, float alpha) override
+		int  params() const override { return (int)(W.size() + B.size()); }
+		void gradient(const cbatch &X, const cbatch &Y, const cbatch &E, float *g) override
 		{
-			for (unsigned int j = 0; j < Y.size(); j++)
-				B[j] -= E[j] * alpha;
-			for (int i = 0; i < M; i++)
-				for(unsigned int j = 0; j < Y.size(); j++)
-					W[i*Y.size() + j] -= X[i] * E[j] * alpha;
+			for (int s = 0; s < E.dims.y; s++)
+				madd(g + W.size(), row(E, s), 1.0f, N);
+			sgemm(true, false, M, N, X.dims.y, 1.0f, X.data, X.stride.y, E.data, E.stride.y, 1.0f, g, N);  // X^T E
+		}
+		void descend(const float *g, float alpha) override
+		{
+			madd(W.data(), g, -alpha, (int)W.size());
+			madd(B.data(), g + W.size(), -alpha, (int)B.size());
 		}
 		virtual void init(std::default_random_engine &rng) override
 		{
@@ -320,111 +369,304 @@ struct CNN
 	};
 	template<class F> struct LActivation final : public LBase // F is the activation function
 	{
-		LActivation(int n) {}
-		std::vector<float> forward(const std::vector<float> &input) override
+		int n;
+		LActivation(int n) : n(n) {}
+		int insize()  const override { return n; }
+		int outsize() const override { return n; }
+		bool pointwise() const override { return true; }
+		void forward(const cbatch &X, const batch &Y) override  // elementwise, so a batch is no different
 		{
-			return Transform(input,F::f);
+			F::map(X.data, Y.data, X.dims.x*X.dims.y);
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E) override
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D) override
 		{
-			std::vector<float> D(Y.size());
-			std::transform(E.begin(), E.end(), Y.begin(), D.begin(), [](float g, float y) { return F::df(y) * g; });    // for example sigmoid would be d = e * y*(1-y)
-			return D;
+			std::transform(E.data, E.data + E.dims.x*E.dims.y, Y.data, D.data, [](float g, float y) { return F::df(y) * g; });    // for example sigmoid would be d = e * y*(1-y)
 		}
 	};
 	struct LSoftMax final : public LBase
 	{
-		LSoftMax(int n) {}
-		std::vector<float> forward(const std::vector<float> &input) override
+		int n;
+		LSoftMax(int n) : n(n) {}
+		int insize()  const override { return n; }
+		int outsize() const override { return n; }
+		void forward(const cbatch &X, const batch &Y) override
 		{
-			float sum = 0.0f;
-			auto out = Transform(input, [&sum](float x) {float y = std::expf(x); sum += y; return y; });
-			for (auto &y : out)
-				y /= sum;
-			return out;
+			for (int s = 0; s < X.dims.y; s++)
+			{
+				const float *x = row(X, s);
+				float *y = row(Y, s), sum = 0.0f;
+				vexp(x, y, n);
+				for (int i = 0; i < n; i++)
+					sum += y[i];
+				for (int i = 0; i < n; i++)
+					y[i] /= sum;
+			}
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E) override
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D) override
 		{
-			float dp = 0;  // sum or dot product of error with output  (note that changing one input upward pushes everybody else down) 
-			for (unsigned int i = 0; i < Y.size(); i++)
-				dp += E[i] * Y[i];
-			std::vector<float> D(Y.size());
-			std::transform(E.begin(), E.end(), Y.begin(), D.begin(), [dp](float e, float y) { return y*(e-dp); });    // yup, after cancelling and substituting the calculus derivatives you end up with just this
-			return D;
+			for (int s = 0; s < X.dims.y; s++)
+			{
+				const float *y = row(Y, s), *e = row(E, s);
+				float dp = dot(e, y, n);  // sum or dot product of error with output  (note that changing one input upward pushes everybody else down) 
+				std::transform(e, e + n, y, row(D, s), [dp](float e, float y) { return y*(e-dp); });    // yup, after cancelling and substituting the calculus derivatives you end up with just this
+			}
 		}
 
 	};
 	struct LCrossEntropy final : public LBase
 	{
-		size_t group_size;
-		LCrossEntropy(int n, size_t group_size=0) : group_size(group_size) {}
-		std::vector<float> forward(const std::vector<float> &input) override
-		{
-			if (!group_size)
-				group_size = input.size();
-			auto out = input;
-			for (size_t g = 0; g < input.size()/group_size; g++) {
-				auto start = out.begin() + g*group_size;
-				auto end = out.begin() + (g + 1)*group_size;
+		int n;
+		int group_size;
+		LCrossEntropy(int n, int group_size=0) : n(n), group_size(group_size ? group_size : n) {}
+		int insize()  const override { return n; }
+		int outsize() const override { return n; }
+		void forward(const cbatch &X, const batch &Y) override
+		{
+			std::copy(X.data, X.data + X.dims.x*X.dims.y, Y.data);
+			for (int g = 0; g < X.dims.x*X.dims.y/group_size; g++) {
+				auto start = Y.data + g*group_size;
+				auto end = start + group_size;
 				float sum = 0.0f;
 				const auto max_value = *std::max_element(start, end);
-				for (auto it = start; it != end; ++it) {
-					float y = std::exp(*it - max_value);
-					sum += y;
-					*it = y;
-				}
+				for (auto it = start; it != end; ++it)
+					*it -= max_value;
+				vexp(start, start, group_size);
+				for (auto it = start; it != end; ++it)
+					sum += *it;
 				for (auto it = start; it != end; ++it) {
 					*it /= sum;
 				}
 
 			}
-			return out;
 		}
-		std::vector<float> backward(const std::vector<float> &X, const std::vector<float> &Y, const std::vector<float> &E) override
+		void backward(const cbatch &X, const cbatch &Y, const cbatch &E, const batch &D) override
 		{
-			std::vector<float> D = E;
-			return D;
+			std::copy(E.data, E.data + E.dims.x*E.dims.y, D.data);
 		}
 
 	};
 	std::vector<LBase*> layers;
 
-	std::vector<float> Eval(const std::vector<float> &x)
+	struct Pass  // the buffers a forward and backward pass goes through, training on several threads gives each its own
 	{
-		std::vector<std::vector<float>> outputs;
-		for (auto &layer : layers)
-			outputs.push_back(layer->forward(outputs.size() ? outputs.back() : x));
-		return std::move(outputs.back());
-	}
+		std::vector<std::vector<float>> outputs, errors;  // each layer's output and the error there, sized by Plan()
+		std::vector<std::vector<float>> gradients;        // each layer's gradient, for batches, sized by the first Gradient()
+		int planned = 0;                                  // samples per batch the buffers are sized for
+		float sse = 0;                                    // sum of square error from the last Backward()
+	};
+	Pass pass;                  // what Eval() and Train() use
+	std::vector<Pass> workers;  // one per thread for TrainParallel() and TrainHogwild()
+	int threads = std::max(1, (int)std::thread::hardware_concurrency());
 
-	float Train(const std::vector<float> &x, const std::vector<float> &t, float alpha = 0.01f)
+	// Threads that stay up between batches.  Run(n,f) does f(0) on the calling thread and f(1..n-1) on the pool's,
+	// and returns once they're all done.  Starting a thread per shard per batch costs about as much as a small shard.
+	struct Pool
 	{
-		std::vector<std::vector<float>> outputs;
-		for (auto &layer : layers)
-			outputs.push_back(layer->forward(outputs.size() ? outputs.back() : x));
+		std::vector<std::thread> pool;
+		std::mutex m;
+		std::condition_variable go, done;
+		void (*call)(const void *f, int k) = nullptr;
+		const void *f = nullptr;
+		int jobs = 0, busy = 0, generation = 0;
+		bool quit = false;
+		void Worker(int k, int seen)
+		{
+			std::unique_lock<std::mutex> lock(m);
+			for (;;)
+			{
+				go.wait(lock, [&]() { return quit || generation != seen; });
+				if (quit)
+					return;
+				seen = generation;
+				if (k >= jobs)
+					continue;
+				lock.unlock();
+				call(f, k);
+				lock.lock();
+				if (--busy == 0)
+					done.notify_one();
+			}
+		}
+		template<class F> void Run(int n, const F &job)
+		{
+			if (n > 1)
+			{
+				std::lock_guard<std::mutex> lock(m);
+				while ((int)pool.size() < n - 1)
+					pool.emplace_back(&Pool::Worker, this, (int)pool.size() + 1, generation);
+				call = [](const void *f, int k) { (*(const F *)f)(k); };
+				f = &job;
+				jobs = n;
+				busy = n - 1;
+				generation++;
+			}
+			go.notify_all();
+			job(0);
+			std::unique_lock<std::mutex> lock(m);
+			done.wait(lock, [&]() { return busy == 0; });
+		}
+		~Pool()
+		{
+			{ std::lock_guard<std::mutex> lock(m); quit = true; }
+			go.notify_all();
+			for (auto &t : pool)
+				t.join();
+		}
+	};
+	std::unique_ptr<Pool> pool;  // made by the first TrainParallel() or TrainHogwild()
+	template<class F> void Run(int n, const F &job)
+	{
+		if (!pool)
+			pool.reset(new Pool);
+		pool->Run(n, job);
+	}
 
-		std::vector<std::vector<float>> errors(layers.size());
+	void Plan(Pass &p, int n)  // sizes every layer's buffers for batches of n,  nothing to do when they already are
+	{
+		if (n == p.planned && p.outputs.size() == layers.size())
+			return;
+		p.planned = n;
+		p.outputs.resize(layers.size());
+		p.errors.resize(layers.size());
+		for (unsigned int i = 0; i < layers.size(); i++)
+		{
+			assert(!i || layers[i]->insize() == layers[i-1]->outsize());
+			p.outputs[i].resize(layers[i]->outsize()*n);
+			p.errors[i].resize(layers[i]->outsize()*n);
+		}
+	}
+	cbatch input(const Pass &p, int i, const cbatch &X) const { return i ? output(p, i-1) : X; }  // what went into layer i
+	cbatch output(const Pass &p, int i) const { return make_batch(p.outputs[i], p.planned); }
+	cbatch error(const Pass &p, int i)  const { return make_batch(p.errors[i], p.planned); }
+	void Forward(Pass &p, const cbatch &X)
+	{
+		for (unsigned int i = 0; i < layers.size(); i++)
+			layers[i]->forward(input(p, i, X), make_batch(p.outputs[i], p.planned));
+	}
+	float Backward(Pass &p, const float *T)  // errors from the targets T back through every layer, returns the mean square error
+	{
+		auto &y = p.outputs.back(), &e = p.errors.back();
+		p.sse = 0;
+		for (unsigned int j = 0; j < e.size(); j++)
+			p.sse += (e[j] = y[j] - T[j]) * e[j];
+		for (unsigned int i = layers.size() - 1; i > 0; i--)
+			layers[i]->backward(output(p, i-1), output(p, i), error(p, i), make_batch(p.errors[i-1], p.planned));
+		return p.sse / e.size();
+	}
+	void Gradient(Pass &p, const cbatch &X)  // the batch's gradient into p.gradients
+	{
+		p.gradients.resize(layers.size());  // as big as the model, so only passes that train in batches get them
+		for (unsigned int i = 0; i < layers.size(); i++)
+		{
+			p.gradients[i].resize(layers[i]->params());
+			std::fill(p.gradients[i].begin(), p.gradients[i].end(), 0.0f);
+			layers[i]->gradient(input(p, i, X), output(p, i), error(p, i), p.gradients[i].data());
+		}
+	}
+	float Train(Pass &p, const float *x, const float *t, float alpha)
+	{
+		cbatch X(x, {layers[0]->insize(), 1});
+		Plan(p, 1);
+		Forward(p, X);
+		float mse = Backward(p, t);
+		for (int i = 0; i < (int)layers.size(); i++)
+			layers[i]->update(input(p, i, X), output(p, i), error(p, i), alpha);
+		return mse;
+	}
 
-		float mse = 0;                                             // mean square error 
-		errors.back().resize(outputs.back().size());
-		std::transform(outputs.back().begin(), outputs.back().end(), t.begin(), errors.back().begin(), [&mse](float y, float t)->float { float e = y - t; mse += e*e; return e; });
-		mse /= errors.back().size();
+	std::vector<float> Eval(const std::vector<float> &x)
+	{
+		return EvalBatch(x, 1);
+	}
+	std::vector<float> EvalBatch(const std::vector<float> &X, int n)  // n inputs packed one after the other, returns the n outputs the same way
+	{
+		Plan(pass, n);
+		Forward(pass, make_batch(X, n));
+		return pass.outputs.back();
+	}
 
-		for (unsigned int i = layers.size() - 1; i > 0; i--)
-			errors[i-1] = layers[i]->backward(outputs[i-1], outputs[i], errors[i]);
+	float Train(const std::vector<float> &x, const std::vector<float> &t, float alpha = 0.01f)  // after the first call this doesnt allocate anything
+	{
+		return Train(pass, x.data(), t.data(), alpha);
+	}
 
+	float TrainBatch(const std::vector<float> &X, const std::vector<float> &T, int n, float alpha = 0.01f)  // mini-batch, gradient gets averaged over the n samples for a single weight update
+	{
+		auto Xb = make_batch(X, n);
+		Plan(pass, n);
+		Forward(pass, Xb);
+		float mse = Backward(pass, T.data());
+		Gradient(pass, Xb);
 		for (int i = 0; i < (int)layers.size(); i++)
-			layers[i]->update(i ? outputs[i-1] : x, outputs[i], errors[i], alpha);
+			layers[i]->descend(pass.gradients[i].data(), alpha / n);
+		return mse;
+	}
+
+	// Same step as TrainBatch(), with the n samples split into a shard per thread.  Each thread runs its shard through
+	// its own buffers into its own gradient, then those get summed pairwise, pairs of pairs, and so on in a fixed order.
+	// So for a given number of threads the result doesnt depend on which finished first.
+	float TrainParallel(const std::vector<float> &X, const std::vector<float> &T, int n, float alpha = 0.01f)
+	{
+		int shards = std::max(1, std::min(threads, n));
+		int xs = (int)X.size() / n, ts = (int)T.size() / n;
+		workers.resize(std::max((int)workers.size(), shards));
+		auto shard = [&](int k) {
+			int s0 = n*k / shards, s1 = n*(k + 1) / shards;
+			cbatch Xk(X.data() + s0*xs, {xs, s1 - s0});
+			Plan(workers[k], s1 - s0);
+			Forward(workers[k], Xk);
+			Backward(workers[k], T.data() + s0*ts);
+			Gradient(workers[k], Xk);
+		};
+		Run(shards, shard);
+		float sse = 0;
+		for (int k = 0; k < shards; k++)
+			sse += workers[k].sse;
+		for (int stride = 1; stride < shards; stride *= 2)
+			for (int k = 0; k + stride < shards; k += 2 * stride)
+				for (unsigned int i = 0; i < layers.size(); i++)
+					madd(workers[k].gradients[i].data(), workers[k + stride].gradients[i].data(), 1.0f, (int)workers[k].gradients[i].size());
+		for (unsigned int i = 0; i < layers.size(); i++)
+			layers[i]->descend(workers[0].gradients[i].data(), alpha / n);
+		return sse / (ts*n);
+	}
 
-		static volatile bool trace_here = 0;
-		//		if (trace_here) printf("%f %f\n", t[0],y[0],e[0]);
-		return   mse;
+	// Hogwild:  plain per sample Train() over all the samples, with every thread updating the one set of weights
+	// and no locking whatsoever.  Updates are sparse enough relative to the weights that the occasional lost or
+	// stale one doesnt hurt convergence.  Fastest, but nothing about it is repeatable.  Returns the average mse.
+	float TrainHogwild(const std::vector<std::vector<float>> &X, const std::vector<std::vector<float>> &T, float alpha = 0.01f)
+	{
+		return Hogwild((int)X.size(), [&](int i) { return std::make_pair(X[i].data(), T[i].data()); }, alpha);
+	}
+	float TrainHogwild(const std::vector<float> &X, const std::vector<float> &T, int n, float alpha = 0.01f)  // n samples packed one after the other, as TrainBatch() takes them
+	{
+		int xs = (int)X.size() / n, ts = (int)T.size() / n;
+		return Hogwild(n, [&](int i) { return std::make_pair(X.data() + i*xs, T.data() + i*ts); }, alpha);
 	}
+	template<class S> float Hogwild(int n, S sample, float alpha)  // sample(i) gives the i'th input and target
+	{
+		workers.resize(std::max((int)workers.size(), threads));
+		std::atomic<int> next(0);
+		std::vector<float> mse(threads, 0.0f);
+		auto worker = [&](int k) {
+			float sum = 0;
+			for (int i; (i = next++) < n;)
+			{
+				auto xt = sample(i);
+				sum += Train(workers[k], xt.first, xt.second, alpha);
+			}
+			mse[k] = sum;
+		};
+		Run(threads, worker);
+		return std::accumulate(mse.begin(), mse.end(), 0.0f) / n;
+	}
+
 	void Init()
 	{
 		std::default_random_engine rng;
 		for (auto &layer : layers)
 			layer->init(rng);
+		Plan(pass, 1);
 	}
 
 	void loada(std::istream &s   )       { for (auto layer:layers) layer->loada(s); } 
@@ -445,6 +687,16 @@ struct CNN
 		Init();
 	}
 };
+
+// Network put together from another CNN's layers plus some new ones, as Quantize() and Fuse() return.
+// Only the layers in owned get deleted, the rest are still the source network's so it has to outlive this.
+struct CNNDerived
+{
+	CNN cnn{ std::vector<int>() };
+	std::vector<std::unique_ptr<CNN::LBase>> owned;
+	CNN::LBase *own(CNN::LBase *layer) { owned.emplace_back(layer); return layer; }
+};
+
 inline std::istream &operator >>(std::istream &in,       CNN::LConv &cl) { cl.loada(in); return in; }
 inline std::ostream &operator <<(std::ostream &ot, const CNN::LConv &cl) { cl.savea(ot); return ot; }
 inline std::istream &operator >>(std::istream &in,       CNN::LFull &cl) { cl.loada(in); return in; }
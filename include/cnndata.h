@@ -0,0 +1,140 @@
+//
+// cnndata   training data streamed straight out of mapped idx files
+//
+// Reading mnist the simple way means the whole file as bytes, all of it again as floats, and then a std::vector
+// per sample on top,  60000 small allocations and a couple hundred MB before the first step.  Here the idx files
+// (the mnist format:  a big endian header with the dims, then uint8 data) just get mapped, and samples only become
+// floats when they go into a batch.  A DatasetStream hands out batches in a new random order every epoch, filling
+// the next one on another thread while the current one trains.  Only the pages actually touched need be in memory,
+// so a dataset bigger than ram trains without any preprocessing.
+//
+
+#pragma once
+#ifndef CNN_DATA_H
+#define CNN_DATA_H
+
+#include <stdint.h>
+#include <numeric>
+#include <random>
+#include <future>
+#include "cnnfile.h"  // for the file mapping
+
+struct IdxFile
+{
+	std::unique_ptr<cnnfile_implementation::Mapping> mapping;
+	std::vector<int> dims;  // dims[0] is how many items
+	const uint8_t *data = NULL;
+	int count() const { return dims[0]; }
+	int size()  const { return std::accumulate(dims.begin() + 1, dims.end(), 1, std::multiplies<int>()); }  // bytes per item
+};
+
+inline std::unique_ptr<IdxFile> IdxMap(const char *filename)  // NULL if missing, not uint8 data, or shorter than its header says
+{
+	std::unique_ptr<IdxFile> idx(new IdxFile());
+	idx->mapping.reset(new cnnfile_implementation::Mapping());
+	auto &m = *idx->mapping;
+	if (!m.Open(filename) || m.size < 4) return NULL;
+	const uint8_t *p = (const uint8_t*)m.data;
+	int ndims = p[3];
+	if (p[0] || p[1] || p[2] != 0x08 || !ndims || m.size < 4 + 4 * (size_t)ndims) return NULL;
+	for (int i = 0; i < ndims; i++, p += 4)
+		idx->dims.push_back((p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7]);
+	idx->data = p + 4;
+	for (int d : idx->dims)
+		if (d <= 0) return NULL;
+	if (m.size < 4 + 4 * (size_t)ndims + (size_t)idx->count()*idx->size()) return NULL;
+	return idx;
+}
+
+struct Batch  // n samples packed one after the other, the way EvalBatch() and TrainParallel() take them
+{
+	std::vector<float> X, T;
+	int n = 0;
+};
+
+// An images file and its labels file.  Samples come out as floats 0..1, labels as one hot vectors of the classes.
+struct Dataset
+{
+	std::unique_ptr<IdxFile> images, labels;
+	int count, size, classes;
+
+	void fill(const int *index, int n, Batch &b) const  // the n samples index[0..n) into b, only grows b's buffers
+	{
+		b.n = n;
+		b.X.resize(n*size);
+		b.T.assign(n*classes, 0.0f);
+		for (int k = 0; k < n; k++)
+		{
+			const uint8_t *x = images->data + (size_t)index[k] * size;
+			std::transform(x, x + size, b.X.data() + k*size, [](uint8_t s) { return s / 255.0f; });
+			b.T[k*classes + labels->data[index[k]]] = 1.0f;
+		}
+	}
+};
+
+inline std::unique_ptr<Dataset> DatasetMap(const char *images, const char *labels, int classes = 10)  // NULL if either file wont map, the counts differ, or a label is past classes
+{
+	std::unique_ptr<Dataset> d(new Dataset());
+	d->images = IdxMap(images);
+	d->labels = IdxMap(labels);
+	if (!d->images || !d->labels || d->images->count() != d->labels->count() || d->labels->size() != 1) return NULL;
+	d->count = d->images->count();
+	d->size = d->images->size();
+	d->classes = classes;
+	for (int i = 0; i < d->count; i++)
+		if (d->labels->data[i] >= classes) return NULL;
+	return d;
+}
+
+// The batches of a dataset, in order or shuffled per epoch.  Two buffers go back and forth:  Next() hands out the
+// one that's been filled and starts filling the other on another thread.  What Next() returns stays good until the
+// following call.  After the first epoch the buffers are as big as they get, so filling them doesnt allocate.
+struct DatasetStream
+{
+	const Dataset &data;
+	int batch;
+	std::vector<int> order;  // the epoch's samples
+	int position = 0;        // how far into order the filling has got
+	Batch buffers[2];
+	int filling = 0;
+	std::future<void> pending;
+
+	DatasetStream(const Dataset &data, int batch) : data(data), batch(batch), order(data.count) { Epoch(); }
+	~DatasetStream() { wait(); }
+
+	void wait() { if (pending.valid()) pending.get(); }
+	void prefetch()
+	{
+		int n = (std::min)(batch, data.count - position);  // parenthesized in case windows.h came in earlier without NOMINMAX
+		if (n <= 0) return;
+		const int *index = order.data() + position;
+		Batch *b = &buffers[filling];
+		position += n;
+		pending = std::async(std::launch::async, [this, index, n, b]() { data.fill(index, n, *b); });
+	}
+	void Epoch()  // start over in order
+	{
+		wait();
+		std::iota(order.begin(), order.end(), 0);
+		position = 0;
+		prefetch();
+	}
+	template<class R> void Epoch(R &rng)  // start over in a new random order
+	{
+		wait();
+		std::shuffle(order.begin(), order.end(), rng);
+		position = 0;
+		prefetch();
+	}
+	const Batch *Next()  // NULL at the end of the epoch
+	{
+		if (!pending.valid()) return NULL;
+		pending.get();
+		Batch *b = &buffers[filling];
+		filling ^= 1;
+		prefetch();
+		return b;
+	}
+};
+
+#endif // CNN_DATA_H
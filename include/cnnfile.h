@@ -0,0 +1,244 @@
+//
+// cnnfile   self describing binary model files, mapped straight in
+//
+// CNN::saveb() is just the floats, so whoever loads it has to build the exact same layer list in code first.
+// CNNSave() writes the layer list too, every layer's type and dims, so CNNMap() can make the whole network from
+// the file alone.  The weights aren't read or copied either:  each LConv and LFull W and B alias the floats right
+// where they sit in the mapping, so startup is instant no matter the model size, and any number of processes
+// running the same model share the one copy in the page cache.  The mapping is copy on write, so training a
+// mapped network still works, it just gets private copies of whatever pages it changes.
+//
+// Layout is the header, then a CNNFileLayer per layer, then the weight and bias arrays, each at a 64 byte
+// aligned offset (cache lines, and any vector load).  All native little endian.
+// Bump CNNFILEVERSION whenever any of this changes, CNNMap() refuses other versions.
+//
+
+#pragma once
+#ifndef CNN_FILE_H
+#define CNN_FILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <memory>
+#ifdef _WIN32
+ #ifndef NOMINMAX
+  #define NOMINMAX             // else windows.h makes min and max macros,  and std::min and std::max stop compiling for whoever includes this
+ #endif
+ #ifndef WIN32_LEAN_AND_MEAN
+  #define WIN32_LEAN_AND_MEAN  // just the file mapping is needed
+ #endif
+ #include <windows.h>
+#else
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
+#include "cnn.h"
+
+#define CNNFILEVERSION (1)
+struct CNNFileHeader
+{
+	char     magic[4];    // "CNNF"
+	uint32_t version;
+	uint32_t layercount, reserved;
+	uint64_t layers;      // file offset of the CNNFileLayer array
+	uint64_t size;        // whole file, catches truncated copies
+};
+enum CNNFileLayerType { CNNF_CONV = 1, CNNF_FULL, CNNF_AVGPOOL, CNNF_MAXPOOL, CNNF_SIGMOID, CNNF_TANH, CNNF_RELU, CNNF_LEAKYRELU, CNNF_SOFTMAX, CNNF_CROSSENTROPY };
+struct CNNFileLayer
+{
+	uint32_t type;        // CNNFileLayerType
+	int32_t  dims[11];    // conv: indims, dims, outdims   full: M, N   pools: indims   activations, softmax: n   crossentropy: n, group_size
+	uint64_t weights, biases;          // file offsets of the floats, 0 if the layer has none
+	uint64_t weightcount, biascount;
+};
+static_assert(sizeof(CNNFileHeader) == 32 && sizeof(CNNFileLayer) == 80, "cnn file layout changed, bump CNNFILEVERSION");
+
+namespace cnnfile_implementation
+{
+	const uint64_t ALIGN = 64;
+	inline uint64_t align(uint64_t n) { return (n + ALIGN - 1) & ~(ALIGN - 1); }
+
+	// What goes in the table for a layer, false if it has no file representation (eg the fused and int8 inference layers)
+	inline bool describe(CNN::LBase *l, CNNFileLayer &f)
+	{
+		f = {};
+		if (auto c = dynamic_cast<CNN::LConv*>(l))
+		{
+			int d[] = { c->indims.x, c->indims.y, c->indims.z, c->dims.x, c->dims.y, c->dims.z, c->dims.w, c->outdims.x, c->outdims.y, c->outdims.z };
+			f.type = CNNF_CONV;
+			std::copy(d, d + 10, f.dims);
+		}
+		else if (auto c = dynamic_cast<CNN::LFull*>(l))               { f.type = CNNF_FULL;      f.dims[0] = c->M; f.dims[1] = c->N; }
+		else if (auto c = dynamic_cast<CNN::LAvgPool*>(l))            { f.type = CNNF_AVGPOOL;   f.dims[0] = c->indims.x; f.dims[1] = c->indims.y; f.dims[2] = c->indims.z; }
+		else if (auto c = dynamic_cast<CNN::LMaxPool*>(l))            { f.type = CNNF_MAXPOOL;   f.dims[0] = c->indims.x; f.dims[1] = c->indims.y; f.dims[2] = c->indims.z; }
+		else if (auto c = dynamic_cast<CNN::LActivation<Sigmoid>*>(l))   { f.type = CNNF_SIGMOID;   f.dims[0] = c->n; }
+		else if (auto c = dynamic_cast<CNN::LActivation<TanH>*>(l))      { f.type = CNNF_TANH;      f.dims[0] = c->n; }
+		else if (auto c = dynamic_cast<CNN::LActivation<ReLU>*>(l))      { f.type = CNNF_RELU;      f.dims[0] = c->n; }
+		else if (auto c = dynamic_cast<CNN::LActivation<LeakyReLU>*>(l)) { f.type = CNNF_LEAKYRELU; f.dims[0] = c->n; }
+		else if (auto c = dynamic_cast<CNN::LSoftMax*>(l))            { f.type = CNNF_SOFTMAX;   f.dims[0] = c->n; }
+		else if (auto c = dynamic_cast<CNN::LCrossEntropy*>(l))       { f.type = CNNF_CROSSENTROPY; f.dims[0] = c->n; f.dims[1] = c->group_size; }
+		else return false;
+		return true;
+	}
+	inline uint64_t product(const int32_t *d, int n)  // of n dims, stops at 2^32 so that 4 of them cant wrap either
+	{
+		uint64_t p = 1;
+		for (int i = 0; i < n; i++)
+			if ((p *= (uint64_t)d[i]) > ((uint64_t)1 << 32))
+				p = (uint64_t)1 << 32;
+		return p;
+	}
+	// The layer a table entry describes, its weights and biases pointing into the mapped file at data.
+	// NULL for a type this version doesnt know, nonsense dims, sizes past what an int holds, or floats that arent all in the file.
+	inline CNN::LBase *make(const CNNFileLayer &f, const CNNFileHeader &header, char *data)
+	{
+		const int32_t *d = f.dims;
+		for (int i = 0; i < 11; i++)
+			if (d[i] < 0) return NULL;
+		auto floats = [&](uint64_t offset, uint64_t count, uint64_t expected) -> float*  // checked before anything gets made
+		{
+			if (count != expected || offset % ALIGN || offset < header.layers || offset > header.size || expected > (header.size - offset) / sizeof(float)) return NULL;
+			return (float*)(data + offset);
+		};
+		const uint64_t MAXSIZE = INT32_MAX;
+		float *w, *b;
+		switch (f.type)
+		{
+			case CNNF_CONV:         if (d[5] != d[2] || d[6] != d[9] || d[7] != d[0] - d[3] + 1 || d[8] != d[1] - d[4] + 1) return NULL;  // the convolution would read past its input
+			                        if (product(d, 3) > MAXSIZE || product(d + 7, 3) > MAXSIZE || product(d + 3, 4) + d[6] > MAXSIZE) return NULL;
+			                        if (!(w = floats(f.weights, f.weightcount, product(d + 3, 4))) || !(b = floats(f.biases, f.biascount, d[6]))) return NULL;
+			                        return new CNN::LConv({ d[0], d[1], d[2] }, { d[3], d[4], d[5], d[6] }, { d[7], d[8], d[9] }, w, b);
+			case CNNF_FULL:         if (product(d, 2) + d[1] > MAXSIZE) return NULL;
+			                        if (!(w = floats(f.weights, f.weightcount, product(d, 2))) || !(b = floats(f.biases, f.biascount, d[1]))) return NULL;
+			                        return new CNN::LFull(d[0], d[1], w, b);
+			case CNNF_AVGPOOL:      return product(d, 3) > MAXSIZE ? NULL : new CNN::LAvgPool({ d[0], d[1], d[2] });
+			case CNNF_MAXPOOL:      return product(d, 3) > MAXSIZE ? NULL : new CNN::LMaxPool({ d[0], d[1], d[2] });
+			case CNNF_SIGMOID:      return new CNN::LActivation<Sigmoid>(d[0]);
+			case CNNF_TANH:         return new CNN::LActivation<TanH>(d[0]);
+			case CNNF_RELU:         return new CNN::LActivation<ReLU>(d[0]);
+			case CNNF_LEAKYRELU:    return new CNN::LActivation<LeakyReLU>(d[0]);
+			case CNNF_SOFTMAX:      return new CNN::LSoftMax(d[0]);
+			case CNNF_CROSSENTROPY: return d[1] ? new CNN::LCrossEntropy(d[0], d[1]) : NULL;
+			default:                return NULL;
+		}
+	}
+	inline std::pair<CNN::Weights*, CNN::Weights*> weights(CNN::LBase *l)  // W and B of the layers that have them
+	{
+		if (auto c = dynamic_cast<CNN::LConv*>(l)) return { &c->W, &c->B };
+		if (auto c = dynamic_cast<CNN::LFull*>(l)) return { &c->W, &c->B };
+		return { NULL, NULL };
+	}
+
+	struct Mapping  // the os file mapping, copy on write
+	{
+		char  *data = NULL;
+		size_t size = 0;
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE map  = NULL;
+		~Mapping() { if (data) UnmapViewOfFile(data); if (map) CloseHandle(map); if (file != INVALID_HANDLE_VALUE) CloseHandle(file); }
+		int Open(const char *filename)
+		{
+			file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			LARGE_INTEGER filesize;
+			if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &filesize) || !filesize.QuadPart) return 0;
+			size = (size_t)filesize.QuadPart;
+			map  = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+			data = map ? (char*)MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0) : NULL;
+			return data != NULL;
+		}
+#else
+		~Mapping() { if (data) munmap(data, size); }
+		int Open(const char *filename)
+		{
+			int fd = open(filename, O_RDONLY);
+			if (fd < 0) return 0;
+			struct stat st;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+			{
+				void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+				if (p != MAP_FAILED) { data = (char*)p; size = (size_t)st.st_size; }
+			}
+			close(fd);  // the mapping stays valid
+			return data != NULL;
+		}
+#endif
+	};
+}
+
+// A network whose weights live in a mapped model file, keep this around as long as cnn is in use
+struct CNNMapped
+{
+	CNN cnn{ std::vector<int>() };
+	std::unique_ptr<cnnfile_implementation::Mapping> mapping;
+	~CNNMapped() { for (auto l : cnn.layers) delete l; }  // they point into the mapping, so they go with it
+};
+
+inline int CNNSave(const CNN &cnn, const char *filename)  // returns 0 if some layer cant be saved or the file couldnt be written
+{
+	using namespace cnnfile_implementation;
+	CNNFileHeader header = {};
+	memcpy(header.magic, "CNNF", 4);
+	header.version    = CNNFILEVERSION;
+	header.layercount = (uint32_t)cnn.layers.size();
+	header.layers     = align(sizeof(header));
+	std::vector<CNNFileLayer> table(cnn.layers.size());
+	uint64_t offset = align(header.layers + table.size()*sizeof(CNNFileLayer));
+	for (unsigned int i = 0; i < cnn.layers.size(); i++)
+	{
+		if (!describe(cnn.layers[i], table[i]))
+			return 0;
+		auto wb = weights(cnn.layers[i]);
+		if (!wb.first) continue;
+		table[i].weights = offset;
+		table[i].weightcount = wb.first->size();
+		offset = align(offset + wb.first->size()*sizeof(float));
+		table[i].biases = offset;
+		table[i].biascount = wb.second->size();
+		offset = align(offset + wb.second->size()*sizeof(float));
+	}
+	header.size = offset;
+	std::vector<char> buf(header.size, 0);
+	memcpy(buf.data(), &header, sizeof(header));
+	memcpy(buf.data() + header.layers, table.data(), table.size()*sizeof(CNNFileLayer));
+	for (unsigned int i = 0; i < cnn.layers.size(); i++)
+	{
+		auto wb = weights(cnn.layers[i]);
+		if (!wb.first) continue;
+		memcpy(buf.data() + table[i].weights, wb.first->data(), wb.first->size()*sizeof(float));
+		memcpy(buf.data() + table[i].biases, wb.second->data(), wb.second->size()*sizeof(float));
+	}
+	FILE *fp = fopen(filename, "wb");
+	if (!fp) return 0;
+	size_t written = fwrite(buf.data(), 1, buf.size(), fp);
+	return (fclose(fp) == 0 && written == buf.size()) ? 1 : 0;
+}
+
+inline std::unique_ptr<CNNMapped> CNNMap(const char *filename)  // NULL if missing, truncated, inconsistent, or another CNNFILEVERSION
+{
+	using namespace cnnfile_implementation;
+	std::unique_ptr<Mapping> mapping(new Mapping());
+	if (!mapping->Open(filename) || mapping->size < sizeof(CNNFileHeader)) return NULL;
+	CNNFileHeader header;
+	memcpy(&header, mapping->data, sizeof(header));
+	if (memcmp(header.magic, "CNNF", 4) || header.version != CNNFILEVERSION || header.size != mapping->size || !header.layercount) return NULL;
+	if (header.layers % ALIGN || header.layers + (uint64_t)header.layercount*sizeof(CNNFileLayer) > header.size) return NULL;
+	std::unique_ptr<CNNMapped> m(new CNNMapped());
+	const CNNFileLayer *table = (const CNNFileLayer*)(mapping->data + header.layers);
+	for (uint32_t i = 0; i < header.layercount; i++)
+	{
+		const CNNFileLayer &f = table[i];
+		CNN::LBase *l = make(f, header, mapping->data);
+		if (!l) return NULL;
+		m->cnn.layers.push_back(l);
+		if (i && l->insize() != m->cnn.layers[i - 1]->outsize()) return NULL;
+	}
+	m->cnn.Plan(m->cnn.pass, 1);  // just the activations of one sample, gradients only come with batch training
+	m->mapping = std::move(mapping);
+	return m;
+}
+
+#endif // CNN_FILE_H
@@ -0,0 +1,122 @@
+//
+// cnnfuse   fused convolution layers for inference
+//
+// Layer by layer, a convolution followed by an activation and a pool or two writes out the whole convolution
+// output (24x24x16 floats in testcnn), reads it back for the activation, writes that, reads it again for each pool.
+// Fuse() makes an inference only copy of a network where each LConv and the pointwise layers and 2x2 pools right
+// after it are a single layer instead.  That one goes a band of output rows at a time:  im2col of just those rows,
+// the product, the activation in place, then the pools, so everything between the input and the much smaller
+// pooled output stays in L1.  Each band goes through the very same code as the separate layers (the same sgemm
+// sums, the same F::f, the same max or average), so the output is unchanged.
+//
+
+#pragma once
+#ifndef CNN_FUSE_H
+#define CNN_FUSE_H
+
+#include "cnn.h"
+
+struct LConvFused final : public CNN::LBase
+{
+	enum Stage { POINTWISE, MAXPOOL, AVGPOOL };
+	const CNN::LConv &conv;
+	std::vector<std::pair<Stage, CNN::LBase*>> stages;  // what comes after the convolution, in order
+	int3 outdims;    // after the pools
+	int scale = 1;   // conv output rows per output row
+	int rows = 1;    // conv output rows per band, a multiple of scale
+
+	static const int L1 = 32 * 1024;  // what a band's buffers should fit in
+
+	LConvFused(const CNN::LConv &conv) : conv(conv), outdims(conv.outdims) {}
+	void add(CNN::LBase *layer)
+	{
+		if (layer->pointwise())
+			return stages.push_back({ POINTWISE, layer });
+		stages.push_back({ dynamic_cast<CNN::LMaxPool*>(layer) ? MAXPOOL : AVGPOOL, layer });
+		outdims = { outdims.x / 2, outdims.y / 2, outdims.z };
+		scale *= 2;
+	}
+	void plan()  // as many rows as fit, im2col of them plus two buffers of convolution output
+	{
+		int3 c = conv.outdims;
+		rows = std::max(1, L1 / (c.x * (conv.K() + 2 * c.z) * (int)sizeof(float) * scale)) * scale;
+		rows = std::min(rows, outdims.y * scale);
+	}
+	static void maxpool(const float *in, float *out, int3 d)  // same as LMaxPool, only straight through the rows
+	{
+		for (int z = 0; z < d.z; z++) for (int y = 0; y < d.y / 2; y++)
+		{
+			const float *r0 = in + d.x*(2*y + d.y*z), *r1 = r0 + d.x;
+			for (int x = 0; x < d.x / 2; x++)
+				*out++ = std::max(std::max(std::max(r0[2*x], r0[2*x + 1]), r1[2*x]), r1[2*x + 1]);
+		}
+	}
+	int insize()  const override { return conv.insize(); }
+	int outsize() const override { return outdims.x*outdims.y*outdims.z; }
+
+	void forward(const CNN::cbatch &X, const CNN::batch &Y) override
+	{
+		int3 c = conv.outdims;
+		float *col = conv.scratch();
+		static thread_local std::vector<float> bands;
+		bands.resize(std::max(bands.size(), (size_t)(2 * c.z*rows*c.x)));
+		for (int s = 0; s < X.dims.y; s++)
+		{
+			for (int y0 = 0; y0 < outdims.y*scale; y0 += rows)
+			{
+				int h = std::min(rows, outdims.y*scale - y0), n = h*c.x;
+				float *a = bands.data(), *b = a + c.z*rows*c.x;
+				for (int z = 0; z < c.z; z++)
+					std::fill(a + z*n, a + (z + 1)*n, conv.B[z]);
+				conv.im2col(CNN::row(X, s), col, y0, y0 + h);
+				sgemm(false, false, c.z, n, conv.K(), 1.0f, conv.W.data(), conv.K(), col, n, 1.0f, a, n);
+				int3 d = { c.x, h, c.z };  // the band as it goes through the stages
+				for (auto &stage : stages)
+				{
+					CNN::cbatch in(a, { d.x*d.y*d.z, 1 });
+					if (stage.first == POINTWISE)
+					{
+						stage.second->forward(in, { a, { d.x*d.y*d.z, 1 } });
+						continue;
+					}
+					int3 p = { d.x / 2, d.y / 2, d.z };
+					if (stage.first == MAXPOOL)
+						maxpool(a, b, d);
+					else
+						CNN::LAvgPool(d).forward(in, { b, { p.x*p.y*p.z, 1 } });
+					std::swap(a, b);
+					d = p;
+				}
+				for (int z = 0; z < d.z; z++)
+					std::copy(a + z*d.x*d.y, a + (z + 1)*d.x*d.y, CNN::row(Y, s) + outdims.x*(y0 / scale + outdims.y*z));
+			}
+		}
+	}
+	void backward(const CNN::cbatch &X, const CNN::cbatch &Y, const CNN::cbatch &E, const CNN::batch &D) override { throw "fused layers are for inference only"; }
+};
+
+// Inference copy of cnn with each LConv fused with the pointwise and pooling layers that follow it.
+// Uses cnn's own weights, so retraining cnn carries over.  Other layers are cnn's own too, only the fused ones belong to the result.
+inline CNNDerived Fuse(CNN &cnn)
+{
+	CNNDerived fused;
+	for (unsigned int i = 0; i < cnn.layers.size();)
+	{
+		auto conv = dynamic_cast<CNN::LConv*>(cnn.layers[i++]);
+		if (!conv)
+		{
+			fused.cnn.layers.push_back(cnn.layers[i - 1]);
+			continue;
+		}
+		auto f = new LConvFused(*conv);
+		fused.own(f);
+		for (; i < cnn.layers.size() && (cnn.layers[i]->pointwise() || dynamic_cast<CNN::LMaxPool*>(cnn.layers[i]) || dynamic_cast<CNN::LAvgPool*>(cnn.layers[i])); i++)
+			f->add(cnn.layers[i]);
+		f->plan();
+		fused.cnn.layers.push_back(f);
+	}
+	fused.cnn.Plan(fused.cnn.pass, 1);
+	return fused;
+}
+
+#endif // CNN_FUSE_H
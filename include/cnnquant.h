@@ -0,0 +1,228 @@
+//
+// cnnquant   int8 inference for a trained CNN
+//
+// Quantize() makes an inference only copy of a network with the convolution and fully connected layers swapped
+// for int8 versions:  weights are int8 with a scale per output channel, each layer's input gets quantized on the
+// way in with a scale from the range seen over a calibration set, products accumulate in int32, and the result
+// goes back to float (times the two scales, plus the bias) for whatever layer is next.  The weights are 4x smaller.
+//
+// Inputs are unsigned, 0..127 with the zero point at 64.  Keeping to 7 bits means u8*s8 pairs summed by
+// maddubs can't saturate int16, so the sse4, avx2 and avx-512 vnni paths all get exactly the same int32 sums.
+//
+
+#pragma once
+#ifndef CNN_QUANT_H
+#define CNN_QUANT_H
+
+#include <stdint.h>
+#include <string.h>
+#include "cnn.h"
+
+namespace cnnquant_implementation
+{
+	const int KALIGN = 4;   // inputs go 4 at a time, rows get padded to a multiple of this
+	const int OALIGN = 16;  // output channels get padded to a multiple of this, an avx-512 register of int32 sums
+	const int ZERO = 64;    // the zero point of the inputs
+
+	// Weights are packed in groups of 4 along k, channel after channel:  w[(k/4)*opad*4 + o*4 + k%4].
+	// So 4 bytes of x broadcast against consecutive bytes of w gives a register full of channels with no horizontal sums.
+	// s[r*opad + o] = sum_k x[r*kpad + k]*w(o,k) for all opad channels of N rows of x,  N rows at a time to share the loads of w.
+	template<int N> void rowdot_scalar(const uint8_t *x, const int8_t *w, int kpad, int opad, int32_t *s)
+	{
+		std::fill(s, s + N*opad, 0);
+		for (int k = 0; k < kpad; k += 4, w += opad*4)
+			for (int r = 0; r < N; r++)
+				for (int o = 0; o < opad; o++)
+				{
+					const uint8_t *xr = x + r*kpad + k;
+					s[r*opad + o] += xr[0]*w[o*4] + xr[1]*w[o*4+1] + xr[2]*w[o*4+2] + xr[3]*w[o*4+3];
+				}
+	}
+	inline int32_t four(const uint8_t *x) { int32_t v; memcpy(&v, x, 4); return v; }
+	template<int N> SIMD_TARGET("sse4.1") void rowdot_sse4(const uint8_t *x, const int8_t *w, int kpad, int opad, int32_t *s)
+	{
+		__m128i ones = _mm_set1_epi16(1);
+		for (int o = 0; o < opad; o += 4)
+		{
+			__m128i acc[N];
+			for (int r = 0; r < N; r++)
+				acc[r] = _mm_setzero_si128();
+			for (int k = 0; k < kpad; k += 4)
+			{
+				__m128i wk = _mm_loadu_si128((const __m128i*)(w + k*opad + o*4));
+				for (int r = 0; r < N; r++)
+					acc[r] = _mm_add_epi32(acc[r], _mm_madd_epi16(_mm_maddubs_epi16(_mm_set1_epi32(four(x + r*kpad + k)), wk), ones));
+			}
+			for (int r = 0; r < N; r++)
+				_mm_storeu_si128((__m128i*)(s + r*opad + o), acc[r]);
+		}
+	}
+	template<int N> SIMD_TARGET("avx2,fma") void rowdot_avx2(const uint8_t *x, const int8_t *w, int kpad, int opad, int32_t *s)
+	{
+		__m256i ones = _mm256_set1_epi16(1);
+		for (int o = 0; o < opad; o += 8)
+		{
+			__m256i acc[N];
+			for (int r = 0; r < N; r++)
+				acc[r] = _mm256_setzero_si256();
+			for (int k = 0; k < kpad; k += 4)
+			{
+				__m256i wk = _mm256_loadu_si256((const __m256i*)(w + k*opad + o*4));
+				for (int r = 0; r < N; r++)
+					acc[r] = _mm256_add_epi32(acc[r], _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_set1_epi32(four(x + r*kpad + k)), wk), ones));
+			}
+			for (int r = 0; r < N; r++)
+				_mm256_storeu_si256((__m256i*)(s + r*opad + o), acc[r]);
+		}
+	}
+	template<int N> SIMD_TARGET("avx512f,avx512bw,avx512vnni") void rowdot_vnni(const uint8_t *x, const int8_t *w, int kpad, int opad, int32_t *s)
+	{
+		for (int o = 0; o < opad; o += 16)
+		{
+			__m512i acc[N];
+			for (int r = 0; r < N; r++)
+				acc[r] = _mm512_setzero_si512();
+			for (int k = 0; k < kpad; k += 4)
+			{
+				__m512i wk = _mm512_loadu_si512(w + k*opad + o*4);
+				for (int r = 0; r < N; r++)
+					acc[r] = _mm512_dpbusd_epi32(acc[r], _mm512_set1_epi32(four(x + r*kpad + k)), wk);
+			}
+			for (int r = 0; r < N; r++)
+				_mm512_storeu_si512(s + r*opad + o, acc[r]);
+		}
+	}
+	const int ROWS = 4;
+	typedef void (*RowDot)(const uint8_t *x, const int8_t *w, int kpad, int opad, int32_t *s);
+	template<int N> RowDot rowdot()
+	{
+		return simd_vnni() ? rowdot_vnni<N> : (simd_level() >= SIMD_AVX2) ? rowdot_avx2<N> : (simd_level() >= SIMD_SSE4) ? rowdot_sse4<N> : rowdot_scalar<N>;
+	}
+}
+
+// What the int8 conv and fully connected layers have in common:  an O x K weight matrix, one row per output channel.
+struct LInt8 : public CNN::LBase
+{
+	int O, K, kpad, opad;
+	std::vector<int8_t>  W;       // kpad x opad, packed as above and zero padded
+	std::vector<float>   wscale;  // per output channel
+	std::vector<float>   B;
+	std::vector<int32_t> wsum;    // row sums, to take the zero point back out
+	float xscale;                 // an input q stands for (q - 64) * xscale
+
+	static int align(int n, int a) { return (n + a - 1) / a * a; }
+
+	// w(o,k) gives the float weights, xmax the largest input magnitude seen while calibrating
+	template<class F> LInt8(int O, int K, F w, const CNN::Weights &B, float xmax) : O(O), K(K), kpad(align(K, cnnquant_implementation::KALIGN)), opad(align(O, cnnquant_implementation::OALIGN)),
+		W(kpad * opad, 0), wscale(O), B(B.begin(), B.end()), wsum(O, 0), xscale(std::max(xmax, 1e-6f) / 63.0f)
+	{
+		for (int o = 0; o < O; o++)
+		{
+			float m = 0.0f;
+			for (int k = 0; k < K; k++)
+				m = std::max(m, std::abs(w(o, k)));
+			wscale[o] = (m > 0.0f) ? m / 127.0f : 1.0f;
+			for (int k = 0; k < K; k++)
+				wsum[o] += (W[(k & ~3)*opad + o*4 + (k & 3)] = (int8_t)std::lround(w(o, k) / wscale[o]));
+		}
+	}
+	uint8_t quantize(float x) const { return (uint8_t)std::min(127.0f, std::max(0.0f, x / xscale + cnnquant_implementation::ZERO + 0.5f)); }  // rounds, nothing negative left to truncate
+
+	// Y[o*yo + j*yj] = W * row j of X  back in float with bias,  X is J rows of kpad quantized inputs
+	void matmul(const uint8_t *X, int J, float *Y, int yo, int yj) const
+	{
+		using namespace cnnquant_implementation;
+		RowDot rowdots[2] = { rowdot<ROWS>(), rowdot<1>() };
+		static thread_local std::vector<int32_t> s;
+		s.resize(std::max(s.size(), (size_t)(ROWS*opad)));
+		for (int j0 = 0, n; j0 < J; j0 += n)
+		{
+			n = (J - j0 >= ROWS) ? ROWS : 1;
+			rowdots[n == 1](X + j0*kpad, W.data(), kpad, opad, s.data());
+			for (int j = j0; j < j0 + n; j++)
+				for (int o = 0; o < O; o++)
+					Y[o*yo + j*yj] = (s[(j - j0)*opad + o] - ZERO*wsum[o]) * wscale[o] * xscale + B[o];
+		}
+	}
+	static std::vector<uint8_t> &scratch(size_t n)  // only grows the first time through
+	{
+		static thread_local std::vector<uint8_t> buf;
+		buf.resize(std::max(buf.size(), n));
+		return buf;
+	}
+	size_t bytes() const { return W.size() + (wscale.size() + B.size() + wsum.size()) * 4; }
+	void backward(const CNN::cbatch &X, const CNN::cbatch &Y, const CNN::cbatch &E, const CNN::batch &D) override { throw "int8 layers are for inference only"; }
+};
+
+struct LConvInt8 final : public LInt8
+{
+	int3 indims, outdims;
+	int2 kdims;
+	std::vector<int> runs;  // where each kdims.x long run of a pixel's inputs starts, relative to the pixel
+	LConvInt8(const CNN::LConv &c, float xmax) : LInt8(c.outdims.z, c.K(), [&c](int o, int k) { return c.W[o*c.K() + k]; }, c.B, xmax), indims(c.indims), outdims(c.outdims), kdims(c.dims.xy())
+	{
+		for (int iz = 0; iz < c.dims.z; iz++) for (int y = 0; y < kdims.y; y++)
+			runs.push_back(indims.x*(y + indims.y*iz));
+	}
+	int insize()  const override { return indims.x*indims.y*indims.z; }
+	int outsize() const override { return outdims.x*outdims.y*outdims.z; }
+	void forward(const CNN::cbatch &X, const CNN::batch &Y) override
+	{
+		int P = outdims.x*outdims.y;
+		auto &buf = scratch(insize() + P*kpad);
+		uint8_t *in = buf.data(), *col = buf.data() + insize();  // the quantized input, and im2col of it with a row per output pixel
+		std::fill(col, col + P*kpad, (uint8_t)cnnquant_implementation::ZERO);
+		for (int s = 0; s < X.dims.y; s++)
+		{
+			std::transform(CNN::row(X, s), CNN::row(X, s) + insize(), in, [this](float x) { return quantize(x); });
+			for (int py = 0; py < outdims.y; py++) for (int px = 0; px < outdims.x; px++)
+			{
+				uint8_t *c = col + (px + py*outdims.x)*kpad;
+				for (int r : runs)
+					c = std::copy(in + px + py*indims.x + r, in + px + py*indims.x + r + kdims.x, c);
+			}
+			matmul(col, P, CNN::row(Y, s), P, 1);
+		}
+	}
+};
+
+struct LFullInt8 final : public LInt8
+{
+	LFullInt8(const CNN::LFull &f, float xmax) : LInt8(f.N, f.M, [&f](int o, int k) { return f.W[k*f.N + o]; }, f.B, xmax) {}
+	int insize()  const override { return K; }
+	int outsize() const override { return O; }
+	void forward(const CNN::cbatch &X, const CNN::batch &Y) override
+	{
+		int n = X.dims.y;
+		auto &buf = scratch(n*kpad);
+		std::fill(buf.begin(), buf.begin() + n*kpad, (uint8_t)cnnquant_implementation::ZERO);
+		for (int s = 0; s < n; s++)
+			std::transform(CNN::row(X, s), CNN::row(X, s) + K, buf.data() + s*kpad, [this](float x) { return quantize(x); });
+		matmul(buf.data(), n, Y.data, 1, Y.stride.y);
+	}
+};
+
+// Inference copy of cnn with every LConv and LFull quantized, input ranges from running the n samples of calibration
+// through cnn.  The other layers are cnn's own, shared rather than copied, so the int8 ones are all the result owns.
+inline CNNDerived Quantize(CNN &cnn, const std::vector<float> &calibration, int n)
+{
+	cnn.EvalBatch(calibration, n);
+	CNNDerived q;
+	for (unsigned int i = 0; i < cnn.layers.size(); i++)
+	{
+		auto x = cnn.input(cnn.pass, i, CNN::make_batch(calibration, n));
+		float xmax = 0.0f;
+		for (int j = 0; j < x.dims.x*x.dims.y; j++)
+			xmax = std::max(xmax, std::abs(x.data[j]));
+		if (auto c = dynamic_cast<CNN::LConv*>(cnn.layers[i]))
+			q.cnn.layers.push_back(q.own(new LConvInt8(*c, xmax)));
+		else if (auto f = dynamic_cast<CNN::LFull*>(cnn.layers[i]))
+			q.cnn.layers.push_back(q.own(new LFullInt8(*f, xmax)));
+		else
+			q.cnn.layers.push_back(cnn.layers[i]);
+	}
+	q.cnn.Plan(q.cnn.pass, 1);
+	return q;
+}
+
+#endif // CNN_QUANT_H
@@ -0,0 +1,242 @@
+//
+// approximate convex decomposition
+//
+// Takes an arbitrary triangle mesh and breaks it into a handful of convex hulls
+// that can be handed directly to a RigidBody as its std::vector<Shape>.
+// Rather than authoring the convex pieces by hand (eg the jack in testphys made from 3 boxes),
+// or colliding against the original triangles, let the computer chop things up.
+//
+// The approach is the simple top-down one:
+// take the hull of the part, measure how far the part's surface sinks below that hull (concavity),
+// and if that's too much, slice the part with a plane and recurse on both halves.
+// Candidate split planes are sampled along the principal axes of the part and we keep
+// the one that minimizes the total hull volume of the two halves.
+// Sub-parts are independent, so the first few levels of the recursion are handed to worker threads.
+// Since this is all deterministic the result doesn't depend on thread scheduling.
+//
+// Results can take a while for complex props, so there's an optional on-disk cache keyed by
+// a hash of the input mesh and the parameters.
+//
+
+#pragma once
+#ifndef CONVEX_DECOMPOSITION_H
+#define CONVEX_DECOMPOSITION_H
+
+#include <stdio.h>  // snprintf
+#include <vector>
+#include <future>
+#include <thread>
+#include <fstream>
+#include <string>
+#include <stdint.h>
+
+#include "linalg.h"
+#include "geometric.h"
+#include "hull.h"
+#include "wingmesh.h"    // for PlaneTest and UNDER,OVER flags
+#include "physics.h"     // for Shape
+
+struct DecompParams
+{
+	float concavity   = 0.02f;  // max depth a surface point may sink below its hull, relative to the mesh's bounding box diagonal
+	int   maxdepth    = 6;      // at most 2^maxdepth pieces
+	int   vlimit      = 32;     // vertex limit for each convex piece
+	int   candidates  = 7;      // number of split offsets tried along each principal axis
+	int   threaddepth = 3;      // sub-parts at recursion levels less than this get their own worker thread, as long as there are cores for them
+};
+
+namespace convex_decomposition_implementation
+{
+	struct Part  // a piece of the input mesh, just a triangle soup that need not be closed
+	{
+		std::vector<float3> verts;
+		std::vector<int3>   tris;
+		void AddPoly(const std::vector<float3> &poly)  // fan triangulate a convex polygon
+		{
+			int base = verts.size();
+			verts.insert(verts.end(), poly.begin(), poly.end());
+			for (int i = 2; i < (int)poly.size(); i++)
+				tris.push_back({ base, base + i - 1, base + i });
+		}
+	};
+
+	inline Shape HullShape(std::vector<float3> points, int vlimit)  // returns empty shape if points are degenerate (flat or too few)
+	{
+		auto tris = calchull(points, vlimit);  // moves the hull's verts to the front of the array
+		int n = 0;
+		for (auto &t : tris)
+			n = std::max(n, std::max(t[0], std::max(t[1], t[2])) + 1);
+		points.resize(n);
+		return Shape(points, tris);
+	}
+
+	inline float Concavity(const Part &part, const Shape &hull)  // how deep below the hull surface does the part's surface go
+	{
+		std::vector<float4> planes = Transform(hull.tris, [&hull](const int3 &t) { return plane_of(hull.verts[t[0]], hull.verts[t[1]], hull.verts[t[2]]); });
+		auto depth = [&planes](const float3 &s) { float d = FLT_MAX; for (auto &p : planes) d = std::min(d, -dot(float4(s, 1), p)); return d; };
+		float c = 0.0f;
+		for (auto &t : part.tris)  // sample each triangle at its center too, otherwise a big flat face spanning a concavity would go unnoticed
+			c = std::max(c, depth((part.verts[t[0]] + part.verts[t[1]] + part.verts[t[2]]) / 3.0f));
+		for (auto &v : part.verts)
+			c = std::max(c, depth(v));
+		return c;
+	}
+
+	inline void SplitPart(const Part &part, const float4 &plane, Part &under, Part &over)
+	{
+		for (auto &t : part.tris)
+		{
+			const float3 v[3] = { part.verts[t[0]], part.verts[t[1]], part.verts[t[2]] };
+			int f[3] = { PlaneTest(plane, v[0]), PlaneTest(plane, v[1]), PlaneTest(plane, v[2]) };
+			int flag = f[0] | f[1] | f[2];
+			if (flag != SPLIT)
+			{
+				(flag == OVER ? over : under).AddPoly({ v[0], v[1], v[2] });  // coplanar goes under, its the hull that matters
+				continue;
+			}
+			std::vector<float3> pu, po;
+			for (int i = 0; i < 3; i++)
+			{
+				int i1 = (i + 1) % 3;
+				if (f[i] != OVER)  pu.push_back(v[i]);
+				if (f[i] != UNDER) po.push_back(v[i]);
+				if ((f[i] | f[i1]) == SPLIT)
+				{
+					float3 vmid = PlaneLineIntersection(plane, v[i], v[i1]);
+					pu.push_back(vmid);
+					po.push_back(vmid);
+				}
+			}
+			under.AddPoly(pu);   // the points along the cut end up in both halves, so each half's hull closes itself off
+			over.AddPoly(po);
+		}
+	}
+
+	inline float4 BestSplit(const Part &part, const DecompParams &params)
+	{
+		auto axes = PrincipalAxes(part.verts).first;
+		float4 best(0, 0, 0, 0);
+		float  bestcost = FLT_MAX;
+		for (float3 n : { qxdir(axes.orientation), qydir(axes.orientation), qzdir(axes.orientation) })
+		{
+			float lo = FLT_MAX, hi = -FLT_MAX;
+			for (auto &v : part.verts)
+				lo = std::min(lo, dot(n, v)), hi = std::max(hi, dot(n, v));
+			for (int k = 0; k < params.candidates; k++)
+			{
+				float4 plane(n, -(lo + (hi - lo) * (k + 1) / (params.candidates + 1)));
+				Part under, over;
+				SplitPart(part, plane, under, over);
+				if (!under.tris.size() || !over.tris.size())
+					continue;
+				auto hu = HullShape(under.verts, params.vlimit);
+				auto ho = HullShape(over.verts, params.vlimit);
+				float cost = Volume(hu.verts.data(), hu.tris.data(), hu.tris.size()) + Volume(ho.verts.data(), ho.tris.data(), ho.tris.size());
+				if (cost < bestcost)
+				{
+					bestcost = cost;
+					best = plane;
+				}
+			}
+		}
+		return best;
+	}
+
+	inline std::vector<Shape> Decompose(Part part, const DecompParams &params, float tolerance, int depth)
+	{
+		auto hull = HullShape(part.verts, params.vlimit);
+		if (!hull.tris.size())
+			return {};  // flat sliver, nothing worth colliding with
+		if (depth >= params.maxdepth || Concavity(part, hull) <= tolerance)
+			return { hull };
+		float4 split = BestSplit(part, params);
+		if (split.xyz() == float3(0, 0, 0))
+			return { hull };
+		Part under, over;
+		SplitPart(part, split, under, over);
+		part = Part();  // free this level's memory before going deeper
+		if (depth >= params.threaddepth || (2u << depth) > std::thread::hardware_concurrency())  // 2^(depth+1) branches would be running after this split
+		{
+			auto shapes = Decompose(std::move(under), params, tolerance, depth + 1);
+			return Append(shapes, Decompose(std::move(over), params, tolerance, depth + 1));
+		}
+		auto worker = std::async(std::launch::async, Decompose, std::move(over), std::cref(params), tolerance, depth + 1);
+		auto shapes = Decompose(std::move(under), params, tolerance, depth + 1);
+		return Append(shapes, worker.get());   // always under then over, so output order is independent of which thread finishes first
+	}
+
+	inline uint64_t Hash(uint64_t h, const void *data, size_t size)  // FNV-1a
+	{
+		for (size_t i = 0; i < size; i++)
+			h = (h ^ ((const unsigned char*)data)[i]) * 1099511628211ULL;
+		return h;
+	}
+
+	inline bool LoadShapes(const std::string &filename, std::vector<Shape> &shapes)
+	{
+		std::ifstream in(filename, std::istream::binary);
+		char magic[4];
+		uint32_t count;
+		if (!in.read(magic, 4) || std::string(magic, 4) != "CDC1" || !in.read((char*)&count, sizeof(count)))
+			return false;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t nv, nt;
+			if (!in.read((char*)&nv, sizeof(nv)) || !in.read((char*)&nt, sizeof(nt)))
+				return shapes.clear(), false;
+			std::vector<float3> verts(nv);
+			std::vector<int3>   tris(nt);
+			if (!in.read((char*)verts.data(), nv*sizeof(float3)) || !in.read((char*)tris.data(), nt*sizeof(int3)))
+				return shapes.clear(), false;
+			shapes.push_back(Shape(verts, tris));
+		}
+		return true;
+	}
+
+	inline void SaveShapes(const std::string &filename, const std::vector<Shape> &shapes)
+	{
+		std::ofstream out(filename, std::ostream::binary);
+		uint32_t count = shapes.size();
+		out.write("CDC1", 4);
+		out.write((const char*)&count, sizeof(count));
+		for (auto &s : shapes)
+		{
+			uint32_t nv = s.verts.size(), nt = s.tris.size();
+			out.write((const char*)&nv, sizeof(nv));
+			out.write((const char*)&nt, sizeof(nt));
+			out.write((const char*)s.verts.data(), nv*sizeof(float3));
+			out.write((const char*)s.tris.data(), nt*sizeof(int3));
+		}
+	}
+} // namespace convex_decomposition_implementation
+
+
+inline std::vector<Shape> ConvexDecomposition(const std::vector<float3> &verts, const std::vector<int3> &tris, const DecompParams &params = DecompParams())
+{
+	using namespace convex_decomposition_implementation;
+	Part part;
+	for (auto &t : tris)
+		part.AddPoly({ verts[t[0]], verts[t[1]], verts[t[2]] });
+	auto extents = Extents(part.verts);
+	return Decompose(std::move(part), params, params.concavity * length(extents.second - extents.first), 0);
+}
+
+inline std::vector<Shape> ConvexDecomposition(const std::vector<float3> &verts, const std::vector<int3> &tris, const DecompParams &params, const std::string &cache_prefix)  // eg cache_prefix "cache/crate_"
+{
+	using namespace convex_decomposition_implementation;
+	uint64_t h = 14695981039346656037ULL;
+	h = Hash(h, verts.data(), verts.size()*sizeof(float3));
+	h = Hash(h, tris.data(), tris.size()*sizeof(int3));
+	h = Hash(h, &params, sizeof(params));
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+	std::string filename = cache_prefix + hex + ".cdc";
+	std::vector<Shape> shapes;
+	if (LoadShapes(filename, shapes))
+		return shapes;
+	shapes = ConvexDecomposition(verts, tris, params);
+	SaveShapes(filename, shapes);
+	return shapes;
+}
+
+#endif // CONVEX_DECOMPOSITION_H
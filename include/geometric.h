@@ -245,33 +245,36 @@ inline float4 plane_of(const float3 &v0, const float3 &v1, const float3 &v2)  //
 	auto n = TriNormal(v0, v1, v2);
 	return{ n, -dot(n,v0) };
 }
-inline float4 PolyPlane(const std::vector<float3>& verts)
+inline float4 PolyPlane(const float3 *verts, size_t count)
 {
 	float4 p(0, 0, 0, 0);
 	float3 c(0, 0, 0);
-	for (const auto &v : verts)
-		c += v*(1.0f / verts.size());
-	for (unsigned int i = 0; i < verts.size(); i++)
-		p.xyz() += cross(verts[i] - c, verts[(i + 1) % verts.size()] - c);
+	for (size_t i = 0; i < count; i++)
+		c += verts[i]*(1.0f / count);
+	for (unsigned int i = 0; i < count; i++)
+		p.xyz() += cross(verts[i] - c, verts[(i + 1) % count] - c);
 	if (p == float4(0, 0, 0, 0)) 
 		return p;
 	p.xyz() = normalize(p.xyz());
 	p.w = -dot(c, p.xyz());
 	return p;
 }
+inline float4 PolyPlane(const std::vector<float3>& verts) { return PolyPlane(verts.data(), verts.size()); }
 struct HitInfo { bool hit; float3 impact; float3 normal; operator bool(){ return hit; };  };
 
-inline HitInfo PolyHitCheck(const std::vector<float3>& verts, const float4 &plane, const float3 &v0, const float3 &v1)
+inline HitInfo PolyHitCheck(const float3 *verts, size_t count, const float4 &plane, const float3 &v0, const float3 &v1)
 {
 	float d0 = dot(float4(v0, 1), plane);
 	float d1 = dot(float4(v1, 1), plane);
 	HitInfo hitinfo = { ((d0  > 0) && (d1  < 0)), { 0, 0, 0 }, { 0, 0, 0 } };  // if segment crosses into plane
 	hitinfo.normal = plane.xyz();
 	hitinfo.impact = v0 + (v1 - v0)* d0 / (d0 - d1);  //  if both points on plane this will be 0/0, if parallel you might get infinity
-	for (unsigned int i = 0; hitinfo&& i < verts.size(); i++)
-		hitinfo.hit = hitinfo && (determinant(float3x3(verts[(i + 1) % verts.size()] - v0, verts[i] - v0, v1 - v0)) >= 0);  // use v0,v1 winding instead of impact to prevent mesh edge tunneling
+	for (unsigned int i = 0; hitinfo&& i < count; i++)
+		hitinfo.hit = hitinfo && (determinant(float3x3(verts[(i + 1) % count] - v0, verts[i] - v0, v1 - v0)) >= 0);  // use v0,v1 winding instead of impact to prevent mesh edge tunneling
 	return hitinfo;  
 }
+inline HitInfo PolyHitCheck(const float3 *verts, size_t count, const float3 &v0, const float3 &v1) { return PolyHitCheck(verts, count, PolyPlane(verts, count), v0, v1); }  // for verts not in a std::vector
+inline HitInfo PolyHitCheck(const std::vector<float3>& verts, const float4 &plane, const float3 &v0, const float3 &v1) { return PolyHitCheck(verts.data(), verts.size(), plane, v0, v1); }
 inline HitInfo PolyHitCheck(const std::vector<float3>& verts, const float3 &v0, const float3 &v1) { return PolyHitCheck(verts, PolyPlane(verts), v0, v1); }
 
 inline HitInfo ConvexHitCheck(const std::vector<float4>& planes, float3 v0, const float3 &v1_)
@@ -37,7 +37,8 @@ namespace gjk_implementation
 		float			separation;
 		float3 p0w, p1w;
 		float time;
-		Contact() :normal(0, 0, 0), impact(0, 0, 0) { type = -1; separation = FLT_MAX; }
+		int failed;    // the query lost its way numerically, says nothing about the shapes even though it isnt a hit
+		Contact() :normal(0, 0, 0), impact(0, 0, 0) { type = -1; separation = FLT_MAX; failed = 0; }
 		operator bool() { return separation <= 0; }
 	};
 
@@ -364,6 +365,158 @@ namespace gjk_implementation
 
 
 
+	// Expanding Polytope Algorithm
+	// When gjk ends with the origin inside its tetrahedron the shapes overlap and we want the penetration depth,
+	// i.e. the shortest translation that would separate them.  Starting from gjk's final tetrahedron, repeatedly 
+	// take the polytope face closest to the origin, push out to the minkowski support point in that direction, and 
+	// patch the hole with new faces fanned from the horizon.  Once the closest face cant be pushed out any further it 
+	// lies on the minkowski boundary, its distance is the depth, and its barycentric weights give the contact points.
+	// All storage is fixed size inside the Polytope, faces are recycled through a free list, and the closest face
+	// comes from a binary heap.  Separated() keeps one of these per thread so deep contacts dont touch the heap allocator.
+	struct Polytope
+	{
+		enum { maxverts = 64, maxfaces = 256, maxedges = 128, maxheap = 512 };
+		struct Face  { int3 v; float3 n; float d; int gen; bool live; };
+		struct Entry { float d; int face; int gen; };  // heap entry, stale once the face slot's gen has moved on
+		MKPoint verts[maxverts];
+		Face    faces[maxfaces];
+		Entry   heap[maxheap];
+		int     freelist[maxfaces];
+		int2    edges[maxedges];  // horizon, built as each new vertex is added
+		int     vcount = 0, fcount = 0, hcount = 0, freecount = 0, ecount = 0;
+
+		static bool closer(const Entry &a, const Entry &b) { return a.d > b.d; }  // std heap is a max heap, we want the min
+		void reset() { vcount = fcount = hcount = freecount = ecount = 0; }
+		int  available() const { return maxfaces - fcount + freecount; }
+		void push(const Entry &e)
+		{
+			if (hcount == maxheap)  // full of stale entries, drop those  (live faces alone always fit)
+			{
+				hcount = (int)(std::remove_if(heap, heap + hcount, [this](const Entry &h) {return !faces[h.face].live || faces[h.face].gen != h.gen; }) - heap);
+				std::make_heap(heap, heap + hcount, closer);
+			}
+			heap[hcount++] = e;
+			std::push_heap(heap, heap + hcount, closer);
+		}
+		Entry pop()
+		{
+			std::pop_heap(heap, heap + hcount, closer);
+			return heap[--hcount];
+		}
+		void addface(int a, int b, int c)
+		{
+			int f = freecount ? freelist[--freecount] : fcount++;
+			assert(f < maxfaces);
+			Face &face = faces[f];
+			face.v = { a, b, c };
+			face.n = cross(verts[b].p - verts[a].p, verts[c].p - verts[a].p);
+			face.live = true;
+			float m = length(face.n);
+			if (m == 0.0f)
+			{
+				face.d = FLT_MAX;   // sliver, keep it for the topology but never pick it or see it
+				return;
+			}
+			face.n /= m;
+			face.d = dot(face.n, verts[a].p);
+			push({ face.d, f, face.gen });
+		}
+		void killface(int f)
+		{
+			faces[f].live = false;
+			faces[f].gen++;
+			freelist[freecount++] = f;
+		}
+		bool addedge(int a, int b)  // edges shared by two visible faces cancel out, whats left is the horizon
+		{
+			for (int i = 0; i < ecount; i++)
+				if (edges[i] == int2(b, a))
+				{
+					edges[i] = edges[--ecount];
+					return true;
+				}
+			if (ecount == maxedges)
+				return false;
+			edges[ecount++] = { a, b };
+			return true;
+		}
+		Polytope() { for (auto &f : faces) f.gen = 0; }
+	};
+
+	inline Contact ExpandingPolytope(std::function<float3(const float3&)> A, std::function<float3(const float3&)>B, const MinkSimplex &simplex, Polytope &poly)
+	{
+		assert(simplex.count == 4);
+		const float epsilon = 0.0001f;
+		poly.reset();
+		for (int i = 0; i < 4; i++)
+			poly.verts[i] = simplex.W[i];
+		poly.vcount = 4;
+		if (dot(cross(poly.verts[1].p - poly.verts[0].p, poly.verts[2].p - poly.verts[0].p), poly.verts[3].p - poly.verts[0].p) > 0.0f)
+			std::swap(poly.verts[1], poly.verts[2]);  // so the faces below all wind outward
+		int tet[4][3] = { { 0,1,2 },{ 1,0,3 },{ 2,1,3 },{ 0,2,3 } };
+		for (auto &t : tet)
+			poly.addface(t[0], t[1], t[2]);
+
+		Polytope::Face closest = poly.faces[0];
+		while (poly.hcount)
+		{
+			auto e = poly.pop();
+			if (!poly.faces[e.face].live || poly.faces[e.face].gen != e.gen)
+				continue;  // face was removed since this entry went in 
+			closest = poly.faces[e.face];
+			MKPoint w = PointOnMinkowski(A, B, closest.n);
+			if (dot(w.p, closest.n) - closest.d <= epsilon + epsilon*closest.d)
+				break;  // cant push this face out any further, its on the boundary
+			if (poly.vcount == Polytope::maxverts)
+				break;  // out of room, settle for what we have
+			poly.ecount = 0;
+			int visible = 0;
+			bool room = true;
+			for (int i = 0; room && i < poly.fcount; i++)
+			{
+				auto &f = poly.faces[i];
+				if (!f.live || dot(f.n, w.p) - f.d <= 0.0f)
+					continue;
+				visible++;
+				room = poly.addedge(f.v[0], f.v[1]) && poly.addedge(f.v[1], f.v[2]) && poly.addedge(f.v[2], f.v[0]);
+			}
+			if (!room || poly.ecount > poly.available() + visible)
+				break;  // out of room, polytope is still intact so settle for what we have
+			int vid = poly.vcount++;
+			poly.verts[vid] = w;
+			for (int i = 0; i < poly.fcount; i++)
+				if (poly.faces[i].live && dot(poly.faces[i].n, w.p) - poly.faces[i].d > 0.0f)
+					poly.killface(i);
+			for (int i = 0; i < poly.ecount; i++)
+				poly.addface(poly.edges[i].x, poly.edges[i].y, vid);
+		}
+
+		MinkSimplex face;  // the boundary face we ended up on, same layout calcpoints and fillhitv use
+		face.count = 3;
+		face.v = closest.n * closest.d;
+		for (int i = 0; i < 3; i++)
+			face.W[i] = poly.verts[closest.v[i]];
+		float area = dot(cross(face.W[1].p - face.W[0].p, face.W[2].p - face.W[0].p), closest.n);
+		face.pa = face.pb = float3(0, 0, 0);
+		for (int i = 0; i < 3; i++)
+		{
+			const float3 &p1 = face.W[(i + 1) % 3].p, &p2 = face.W[(i + 2) % 3].p;
+			face.W[i].t = (area != 0.0f) ? dot(cross(p1 - face.v, p2 - face.v), closest.n) / area : 1.0f / 3.0f;
+			face.pa += face.W[i].t * face.W[i].a;
+			face.pb += face.W[i].t * face.W[i].b;
+		}
+		Contact hitinfo;
+		hitinfo.normal = -closest.n;  // minkowski is A-B so this points from B to A as with the separated case
+		hitinfo.dist = closest.d;
+		hitinfo.separation = std::min(0.0f, -closest.d);
+		hitinfo.p0w = face.pa;  // point in A deepest inside B
+		hitinfo.p1w = face.pb;  // and the point on B's surface it would be pushed out to
+		hitinfo.impact = (hitinfo.p0w + hitinfo.p1w)*0.5f;
+		fillhitv(hitinfo, face);
+		return hitinfo;
+	}
+
+
 	inline Contact Separated(std::function<float3(const float3&)> A, std::function<float3(const float3&)>B, int findclosest)
 	{
 		int(*NextMinkSimplex[4])(MinkSimplex &dst, const MinkSimplex &src, const MKPoint &w) =
@@ -412,18 +565,8 @@ namespace gjk_implementation
 					next.W[next.count++] = PointOnMinkowski(A, B, n);   // make it a tetrahedron to kickstart EPA for finding minimal penetration depth and corresponding normal
 				}
 
-				float4 minpenetrationplane = convex_hull_implementation::ExpandingPolytopeAlgorithm({ next.W[0].p,next.W[1].p,next.W[2].p ,next.W[3].p }, [&](float3 v) {return A(v) - B(-v); }) ;  
-
-				Contact hitinfo;
-				hitinfo.normal = -minpenetrationplane.xyz();  // flip!!??
-				hitinfo.dist   = -minpenetrationplane.w;  // negate this too to be consistent
-				hitinfo.separation = std::min(0.0f, minpenetrationplane.w); // based on convention order of A and B and what is used in the non-penetration case (separation>0)
-				float4 b= linalg::inverse(float4x4({ next.W[0].p,1 }, { next.W[1].p,1 }, { next.W[2].p,1 }, { next.W[3].p,1 })).w;         // just take last column since its equiv to mul(M,[0001])
-                hitinfo.p0w = linalg::mul(float4x4({ next.W[0].a, 1 }, { next.W[1].a, 1 }, { next.W[2].a, 1 }, { next.W[3].a, 1 }), b).xyz();  // this point in A that's closest to B will be inside B too
-                hitinfo.p1w = linalg::mul(float4x4({ next.W[0].b, 1 }, { next.W[1].b, 1 }, { next.W[2].b, 1 }, { next.W[3].b, 1 }), b).xyz();  // should be about the same as the above point
-				hitinfo.impact=  (hitinfo.p0w + hitinfo.p1w)*0.5f;
-		 
-				fillhitv(hitinfo,last);
+				static thread_local Polytope polytope;   // reused, so EPA doesnt allocate
+				Contact hitinfo = ExpandingPolytope(A, B, next, polytope);
 				assert(hitinfo);
 				return hitinfo;
 			}
@@ -437,64 +580,63 @@ namespace gjk_implementation
 	}
 
 
+	// Origin is inside the swept minkowski, find where the ray leaves it, ie the first time along ray that the two touch.
+	// Same portal refinement as mpr:  keep a triangle of support points the ray goes through, and push it out
+	// toward the boundary until the support point in its normal direction is no farther out than the triangle itself.
 	inline  Contact tunnel(std::function<float3(const float3&)> A, std::function<float3(const float3&)>B, const float3& ray, MinkSimplex &start)
 	{
+		const float epsilon = 0.0001f;
 		int tet[4][3] = {{0,1,2},{1,0,3},{2,1,3},{0,2,3}};
-		int i;
 		MKPoint v0,v1,v2;
-		int k=0;
-		int s=-1;
-		for(i=0;i<4;i++)
+		float best=-FLT_MAX;
+		for(int i=0;i<4;i++)  // face the ray leaves the start simplex through, or the one it comes nearest to when roundoff has it between faces
 		{
-			if(tri_interior(start.W[tet[i][0]].p,start.W[tet[i][1]].p,start.W[tet[i][2]].p,ray))
+			float3 b = BaryCentric(start.W[tet[i][0]].p,start.W[tet[i][1]].p,start.W[tet[i][2]].p,ray);
+			float sum = b.x+b.y+b.z;
+			if(!(sum>0.0f)) 
+				continue;  // behind the origin (or degenerate)
+			float inside = std::min(b.x,std::min(b.y,b.z))/sum;
+			if(inside>best)
 			{
-				s=i;
-				k++;
+				best = inside;
 				v0 = start.W[tet[i][0]];
 				v1 = start.W[tet[i][1]];
 				v2 = start.W[tet[i][2]];
 			}
 		}
-		assert(k==1);
-		assert(s>=0);
+		if(best==-FLT_MAX)  // start simplex is flat, not a hit, but flagged so the caller can try something else
+		{
+			Contact failed;
+			failed.failed = 1;
+			return failed;
+		}
 		float3 n = TriNormal(v0.p, v1.p, v2.p);
 		if(dot(n,ray)<0.0f)
 		{
 			n=-n;
-			MKPoint tmp;
-			tmp=v0;
-			v0=v1;
-			v1=tmp;
+			std::swap(v0,v1);
 		}
-		MKPoint v = PointOnMinkowski(A,B,ray,n);
-
-		int iterlimit=0;
-		while(iterlimit++<100 && v.p!=v0.p && v.p!= v1.p && v.p!=v2.p)
+		for(int iterlimit=0;iterlimit<100;iterlimit++)
 		{
+			MKPoint v = PointOnMinkowski(A,B,ray,n);
+			float d = dot(n,v0.p);
+			if(dot(n,v.p) - d <= epsilon + epsilon*fabsf(d))
+				break;  // portal is on the boundary
 			if(tri_interior(v0.p,v1.p,v.p,ray))
-			{
 				v2=v;
-			}
 			else if(tri_interior(v1.p,v2.p,v.p,ray))
-			{
 				v0=v;
-			}
-			else 
-			{
-				assert(tri_interior(v2.p,v0.p,v.p,ray));
+			else if(tri_interior(v2.p,v0.p,v.p,ray))
 				v1=v;
-			}
+			else
+				break;  // numerically lost, stay with the portal we have
 			n = TriNormal(v0.p, v1.p, v2.p);
-			v = PointOnMinkowski(A,B,ray,n);
-			//v = mkp.p;
 		}
+		// the portal itself is inside the minkowski, so its plane gives a time no earlier than the true one, 
+		// and once refined it's within epsilon.  The plane through the last support point could be well out in front.
 		Contact hitinfo;
 		hitinfo.normal = -n;
-		if(dot(hitinfo.normal,ray) > 0.0f)
-		{
-			hitinfo.normal *= -1.0f;  // i dont think this should happen, v0v1v2 winding should have been consistent
-		}
-		hitinfo.dist   = -dot(hitinfo.normal,v.p);
+		hitinfo.dist   = -dot(hitinfo.normal,v0.p);
 		float3 hitpoint = PlaneLineIntersection(hitinfo.normal,hitinfo.dist,float3(0,0,0),ray);
 		float time = 1.0f - sqrtf(dot(hitpoint,hitpoint)/dot(ray,ray));
 		hitinfo.time = time;
@@ -544,7 +686,14 @@ namespace gjk_implementation
 			if(!isseparated)
 			{
 				// tunnel back and find the 
-				return tunnel(A, B, dir, next);
+				Contact hitinfo = tunnel(A, B, dir, next);
+				if(hitinfo && hitinfo.time < 0.0f)  // they were already touching before moving, so the contact is the one at the start
+				{
+					hitinfo = Separated(A, B, 1);
+					hitinfo.time = 0.0f;
+					hitinfo.separation = std::min(hitinfo.separation, 0.0f);
+				}
+				return hitinfo;
 			}
 			if(dot(next.v,next.v)>=dot(last.v, last.v))   // i.e. if length(w.p)>length(v) 
 			{
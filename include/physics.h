@@ -431,17 +431,27 @@ struct PhysContact : public gjk_implementation::Contact
 
 inline  std::function<float3(const float3&)> SupportFunc(RigidBody *rb,const Shape& shape) { return SupportFuncTrans(rb->position, rb->orientation,SupportFunc(shape.verts)); }  // note, using auto for the return type caused vs2015 to crash.
 
-inline void FindShapeWorldContacts(std::vector<PhysContact> &contacts_out, const std::vector<RigidBody*>& rigidbodies, const std::vector<std::vector<float3> *> & cells)
+// World geometry near one rigid body, given the body and how far out contacts are wanted.
+// For big worlds such as a bsp level, so each body only gets tested against the cells around it.
+typedef std::function<const std::vector<std::vector<float3> *>&(RigidBody *rb, float range)> WorldCells;
+
+inline void FindShapeWorldContacts(std::vector<PhysContact> &contacts_out, const std::vector<RigidBody*>& rigidbodies, const WorldCells &cellsnear)
 {
-	for (auto rb : rigidbodies) for (auto &shape : rb->shapes)   // foreach rigidbody shape
+	for (auto rb : rigidbodies) 
 	{
 		if(!(rb->collide&1)) continue;
 		float distance_range = std::max(physics_driftmax, length(rb->linear_momentum) *physics_deltaT / rb->mass);  // dont need to create potential contacts if beyond this range
+		auto &cells = cellsnear(rb, distance_range);
+		for (auto &shape : rb->shapes)   // foreach rigidbody shape
 		for (auto  cell : cells)
 			for(auto &c : ContactPatch(SupportFunc(rb,shape), SupportFunc(*cell), distance_range) )
 				contacts_out.push_back(PhysContact(rb, NULL, c));  
 	}
 }
+inline void FindShapeWorldContacts(std::vector<PhysContact> &contacts_out, const std::vector<RigidBody*>& rigidbodies, const std::vector<std::vector<float3> *> & cells)
+{
+	FindShapeWorldContacts(contacts_out, rigidbodies, [&cells](RigidBody *, float) -> const std::vector<std::vector<float3> *>& { return cells; });
+}
 
 
 inline void FindShapeShapeContacts(std::vector<PhysContact> &contacts_out_append, const std::vector<RigidBody*> & rigidbodies)  // Dynamic-Dynamic contacts
@@ -484,7 +494,7 @@ inline std::vector<LimitLinear> ConstrainContacts(const std::vector<PhysContact>
 	return linearconstraints;
 }
 
-inline std::vector<LimitLinear> CollisionConstraints(std::vector<RigidBody*> &rigidbodies, const std::vector<std::vector<float3> *> &wgeom)
+inline std::vector<LimitLinear> CollisionConstraints(std::vector<RigidBody*> &rigidbodies, const WorldCells &wgeom)
 {
 	std::vector<PhysContact> contacts;
 	FindShapeWorldContacts(contacts, rigidbodies, wgeom);
@@ -536,7 +546,7 @@ inline void rbupdatepose(RigidBody *rb)
 	rb->Iinv = mul(qmat(rb->orientation), rb->tensorinv_massless * rb->massinv, transpose(qmat(rb->orientation)));
 }
 
-inline void PhysicsUpdate(std::vector<RigidBody*> &rigidbodies, std::vector<LimitLinear> Linears, std::vector<LimitAngular> &Angulars, const std::vector<std::vector<float3> *> &wgeom)
+inline void PhysicsUpdate(std::vector<RigidBody*> &rigidbodies, std::vector<LimitLinear> Linears, std::vector<LimitAngular> &Angulars, const WorldCells &wgeom)
 {
 	const int physics_iterations = 16;
 	const int physics_iterations_post = 4;
@@ -583,6 +593,10 @@ inline void PhysicsUpdate(std::vector<RigidBody*> &rigidbodies, std::vector<Limi
 	for(auto rb : rigidbodies)
 		rbupdatepose(rb);   // setting position,orientation based on rbcalcnextpose
 }
+inline void PhysicsUpdate(std::vector<RigidBody*> &rigidbodies, std::vector<LimitLinear> Linears, std::vector<LimitAngular> &Angulars, const std::vector<std::vector<float3> *> &wgeom)
+{
+	PhysicsUpdate(rigidbodies, std::move(Linears), Angulars, WorldCells([&wgeom](RigidBody *, float) -> const std::vector<std::vector<float3> *>& { return wgeom; }));
+}
 
 
 
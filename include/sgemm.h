@@ -0,0 +1,223 @@
+//
+// sgemm   single precision general matrix multiply
+//
+//   C = alpha * op(A) * op(B) + beta * C    where op(X) is X or its transpose
+//
+// Row major, leading dimension is the stride between rows.  Same argument order as the blas routine
+// with the trans flags as bools.  All the heavy lifting in cnn.h (fully connected layers, and the
+// convolutions after im2col) ends up here.
+//
+// The usual packed, cache blocked approach:  a kc deep slab of B gets copied into nr wide column panels,
+// an mc x kc block of A into mr tall row panels, and a register blocked micro kernel does mr x nr of C
+// at a time straight out of those.  Zero padding in the panels means the kernel never has to deal with
+// edges, partial tiles just go through a little temporary.
+// The micro kernel (and so mr x nr) goes by simd_level(), see simd.h:  6x32 avx-512, 6x16 avx2+fma, 4x8 sse4, 4x4 plain c++.
+//
+
+#pragma once
+#ifndef SGEMM_H
+#define SGEMM_H
+
+#include <vector>
+#include <algorithm>
+#include "simd.h"
+
+namespace sgemm_implementation
+{
+	const int KC = 256;   // depth of a slab, an mr x kc A panel plus a kc x nr B panel sit in L1
+	const int MC = 96;    // rows of A per block, the packed block sits in L2 (multiple of every mr)
+	const int NC = 2048;  // columns of B per slab, the packed slab sits in L3
+	const int MAXMR = 6, MAXNR = 32;
+
+	inline float element(const float *M, int ld, bool trans, int r, int c) { return trans ? M[c*ld + r] : M[r*ld + c]; }
+
+	inline void pack_a(float *dst, const float *A, int lda, bool ta, int i0, int p0, int mc, int kc, int mr)  // mr tall panels, each stored column by column
+	{
+		for (int i = 0; i < mc; i += mr)
+			for (int p = 0; p < kc; p++)
+				for (int r = 0; r < mr; r++)
+					*dst++ = (i + r < mc) ? element(A, lda, ta, i0 + i + r, p0 + p) : 0.0f;
+	}
+	inline void pack_b(float *dst, const float *B, int ldb, bool tb, int p0, int j0, int kc, int nc, int nr)  // nr wide panels, each stored row by row
+	{
+		for (int j = 0; j < nc; j += nr)
+			for (int p = 0; p < kc; p++)
+			{
+				if (!tb && j + nr <= nc)
+				{
+					std::copy(B + (p0 + p)*ldb + j0 + j, B + (p0 + p)*ldb + j0 + j + nr, dst);
+					dst += nr;
+				}
+				else for (int c = 0; c < nr; c++)
+					*dst++ = (j + c < nc) ? element(B, ldb, tb, p0 + p, j0 + j + c) : 0.0f;
+			}
+	}
+
+	// C[mr x nr] += alpha * a_panel * b_panel,  each row of the tile is two vector registers wide.
+	// Accumulators are spelled out one per register, left as arrays and loops the compiler is apt to keep them in memory.
+	// The body is the same for every instruction set, only what the SGEMM_V, _W, _SET1, _LOAD, _STORE and _FMADD macros mean changes.
+	#define SGEMM_ROW_ZERO(r)  SGEMM_V c##r##0 = SGEMM_SET1(0.0f), c##r##1 = SGEMM_SET1(0.0f);
+	#define SGEMM_ROW_FMA(r)   { SGEMM_V ar = SGEMM_SET1(a[r]); c##r##0 = SGEMM_FMADD(ar, b0, c##r##0); c##r##1 = SGEMM_FMADD(ar, b1, c##r##1); }
+	#define SGEMM_ROW_STORE(r) SGEMM_STORE(C + r*ldc, SGEMM_FMADD(c##r##0, s, SGEMM_LOAD(C + r*ldc))); SGEMM_STORE(C + r*ldc + SGEMM_W, SGEMM_FMADD(c##r##1, s, SGEMM_LOAD(C + r*ldc + SGEMM_W)));
+	#define SGEMM_BODY(ROWS, MR) \
+		ROWS(SGEMM_ROW_ZERO) \
+		for (int p = 0; p < kc; p++, a += MR, b += 2*SGEMM_W) \
+		{ \
+			SGEMM_V b0 = SGEMM_LOAD(b), b1 = SGEMM_LOAD(b + SGEMM_W); \
+			ROWS(SGEMM_ROW_FMA) \
+		} \
+		SGEMM_V s = SGEMM_SET1(alpha); \
+		ROWS(SGEMM_ROW_STORE)
+	#define SGEMM_ROWS4(X) X(0) X(1) X(2) X(3)
+	#define SGEMM_ROWS6(X) X(0) X(1) X(2) X(3) X(4) X(5)
+
+	#define SGEMM_V __m128
+	#define SGEMM_W 4
+	#define SGEMM_SET1 _mm_set1_ps
+	#define SGEMM_LOAD _mm_loadu_ps
+	#define SGEMM_STORE _mm_storeu_ps
+	#define SGEMM_FMADD(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+	SIMD_TARGET("sse4.1") inline void kernel_sse4(int kc, float alpha, const float *a, const float *b, float *C, int ldc) { SGEMM_BODY(SGEMM_ROWS4, 4) }
+	#undef SGEMM_V
+	#undef SGEMM_W
+	#undef SGEMM_SET1
+	#undef SGEMM_LOAD
+	#undef SGEMM_STORE
+	#undef SGEMM_FMADD
+
+	#define SGEMM_V __m256
+	#define SGEMM_W 8
+	#define SGEMM_SET1 _mm256_set1_ps
+	#define SGEMM_LOAD _mm256_loadu_ps
+	#define SGEMM_STORE _mm256_storeu_ps
+	#define SGEMM_FMADD _mm256_fmadd_ps
+	SIMD_TARGET("avx2,fma") inline void kernel_avx2(int kc, float alpha, const float *a, const float *b, float *C, int ldc) { SGEMM_BODY(SGEMM_ROWS6, 6) }
+	#undef SGEMM_V
+	#undef SGEMM_W
+	#undef SGEMM_SET1
+	#undef SGEMM_LOAD
+	#undef SGEMM_STORE
+	#undef SGEMM_FMADD
+
+	#define SGEMM_V __m512
+	#define SGEMM_W 16
+	#define SGEMM_SET1 _mm512_set1_ps
+	#define SGEMM_LOAD _mm512_loadu_ps
+	#define SGEMM_STORE _mm512_storeu_ps
+	#define SGEMM_FMADD _mm512_fmadd_ps
+	SIMD_TARGET("avx512f") inline void kernel_avx512(int kc, float alpha, const float *a, const float *b, float *C, int ldc) { SGEMM_BODY(SGEMM_ROWS6, 6) }
+	#undef SGEMM_V
+	#undef SGEMM_W
+	#undef SGEMM_SET1
+	#undef SGEMM_LOAD
+	#undef SGEMM_STORE
+	#undef SGEMM_FMADD
+
+	#undef SGEMM_ROW_ZERO
+	#undef SGEMM_ROW_FMA
+	#undef SGEMM_ROW_STORE
+	#undef SGEMM_BODY
+	#undef SGEMM_ROWS4
+	#undef SGEMM_ROWS6
+
+	inline void kernel_scalar(int kc, float alpha, const float *a, const float *b, float *C, int ldc)  // the reference, 4x4
+	{
+		float c[4][4] = {};
+		for (int p = 0; p < kc; p++, a += 4, b += 4)
+			for (int r = 0; r < 4; r++)
+				for (int s = 0; s < 4; s++)
+					c[r][s] += a[r] * b[s];
+		for (int r = 0; r < 4; r++)
+			for (int s = 0; s < 4; s++)
+				C[r*ldc + s] += alpha * c[r][s];
+	}
+
+	struct Kernel { int mr, nr; void (*f)(int kc, float alpha, const float *a, const float *b, float *C, int ldc); };
+	inline Kernel kernel(SIMD level)
+	{
+		switch (level)
+		{
+			case SIMD_AVX512: return { 6, 32, kernel_avx512 };
+			case SIMD_AVX2:   return { 6, 16, kernel_avx2 };
+			case SIMD_SSE4:   return { 4,  8, kernel_sse4 };
+			default:          return { 4,  4, kernel_scalar };
+		}
+	}
+
+	// Few rows (eg a single sample through a fully connected layer) isnt worth packing, just stream through B.
+	inline void small(bool ta, bool tb, int m, int n, int k, float alpha, const float *A, int lda, const float *B, int ldb, float *C, int ldc)
+	{
+		for (int i = 0; i < m; i++)
+		{
+			float *c = C + i*ldc;
+			if (tb) for (int j = 0; j < n; j++)  // rows of B are contiguous then, so dot products
+			{
+				const float *b = B + j*ldb;
+				float s = 0.0f;
+				if (!ta)
+					s = dot(A + i*lda, b, k);
+				else for (int p = 0; p < k; p++)
+					s += A[p*lda + i] * b[p];
+				c[j] += alpha * s;
+			}
+			else for (int p = 0; p < k; p++)
+			{
+				float a = alpha * element(A, lda, ta, i, p);
+				if (a != 0.0f)
+					madd(c, B + p*ldb, a, n);
+			}
+		}
+	}
+}
+
+inline void sgemm(bool ta, bool tb, int m, int n, int k, float alpha, const float *A, int lda, const float *B, int ldb, float beta, float *C, int ldc)
+{
+	using namespace sgemm_implementation;
+	if (m <= 0 || n <= 0) return;
+	if (beta != 1.0f)
+		for (int i = 0; i < m; i++)
+			for (int j = 0; j < n; j++)
+				C[i*ldc + j] = beta == 0.0f ? 0.0f : C[i*ldc + j] * beta;
+	if (k <= 0 || alpha == 0.0f) return;
+	Kernel kern = kernel(simd_level());
+	int MR = kern.mr, NR = kern.nr;
+	if (m < MR)
+		return small(ta, tb, m, n, k, alpha, A, lda, B, ldb, C, ldc);
+
+	static thread_local std::vector<float> apack, bpack;
+	apack.resize(MC*KC);
+	bpack.resize((NC + MAXNR)*KC);
+	float edge[MAXMR*MAXNR];
+	for (int j0 = 0; j0 < n; j0 += NC)
+	{
+		int nc = std::min(NC, n - j0);
+		for (int p0 = 0; p0 < k; p0 += KC)
+		{
+			int kc = std::min(KC, k - p0);
+			pack_b(bpack.data(), B, ldb, tb, p0, j0, kc, nc, NR);
+			for (int i0 = 0; i0 < m; i0 += MC)
+			{
+				int mc = std::min(MC, m - i0);
+				pack_a(apack.data(), A, lda, ta, i0, p0, mc, kc, MR);
+				for (int j = 0; j < nc; j += NR) for (int i = 0; i < mc; i += MR)
+				{
+					const float *a = apack.data() + i*kc, *b = bpack.data() + j*kc;
+					float *c = C + (i0 + i)*ldc + j0 + j;
+					int mr = std::min(MR, mc - i), nr = std::min(NR, nc - j);
+					if (mr == MR && nr == NR)
+					{
+						kern.f(kc, alpha, a, b, c, ldc);
+						continue;
+					}
+					std::fill(edge, edge + MR*NR, 0.0f);
+					kern.f(kc, alpha, a, b, edge, NR);
+					for (int r = 0; r < mr; r++)
+						for (int s = 0; s < nr; s++)
+							c[r*ldc + s] += edge[r*NR + s];
+				}
+			}
+		}
+	}
+}
+
+#endif // SGEMM_H
@@ -0,0 +1,176 @@
+//
+// simd   runtime picked vector kernels
+//
+// The few inner loops the cnn code bottoms out in (madd and dot here, and the micro kernel in sgemm.h) come
+// as plain c++ plus sse4, avx2+fma and avx-512 versions.  cpuid (and xgetbv, the os has to save the wider
+// registers too) picks the best one the machine supports the first time through, so one build runs well on
+// old and new cpus alike.  Set simd_level() lower to force a slower path,  SIMD_SCALAR is the reference
+// the others get checked against.
+//
+// msvc lets any intrinsic go anywhere, gcc and clang need each function marked with what it's allowed to use.
+//
+
+#pragma once
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+ #include <intrin.h>
+ #define SIMD_TARGET(isa)
+#else
+ #include <cpuid.h>
+ #define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+enum SIMD { SIMD_SCALAR, SIMD_SSE4, SIMD_AVX2, SIMD_AVX512 };
+inline const char *simd_name(SIMD s) { const char *names[] = { "scalar", "sse4", "avx2", "avx512" }; return names[s]; }
+
+inline SIMD simd_detect()
+{
+	int r1[4] = { 0 }, r7[4] = { 0 };
+	unsigned long long xcr0 = 0;
+#ifdef _MSC_VER
+	__cpuidex(r1, 1, 0);
+	__cpuidex(r7, 7, 0);
+	if (r1[2] & (1 << 27))  // osxsave
+		xcr0 = _xgetbv(0);
+#else
+	__cpuid_count(1, 0, r1[0], r1[1], r1[2], r1[3]);
+	__cpuid_count(7, 0, r7[0], r7[1], r7[2], r7[3]);
+	if (r1[2] & (1 << 27))
+	{
+		unsigned int lo, hi;
+		__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		xcr0 = ((unsigned long long)hi << 32) | lo;
+	}
+#endif
+	bool sse4 = (r1[2] & (1 << 19)) != 0;
+	bool avx2 = (r1[2] & (1 << 12)) && (r1[2] & (1 << 28)) && (r7[1] & (1 << 5)) && (xcr0 & 0x06) == 0x06;  // fma, avx, avx2, ymm state
+	bool avx512 = avx2 && (r7[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6;                                  // avx512f, zmm and mask state
+	return avx512 ? SIMD_AVX512 : avx2 ? SIMD_AVX2 : sse4 ? SIMD_SSE4 : SIMD_SCALAR;
+}
+inline SIMD &simd_level() { static SIMD level = simd_detect(); return level; }  // what the cpu can do, or lower if set
+inline SIMD  simd_best()  { static SIMD best  = simd_detect(); return best; }   // what the cpu can do
+inline bool  simd_vnni()  // avx-512 int8 dot products (vpdpbusd), goes with SIMD_AVX512
+{
+	static bool vnni = [] {
+		int r7[4] = { 0 };
+#ifdef _MSC_VER
+		__cpuidex(r7, 7, 0);
+#else
+		__cpuid_count(7, 0, r7[0], r7[1], r7[2], r7[3]);
+#endif
+		return simd_best() == SIMD_AVX512 && (r7[1] & (1 << 30)) && (r7[2] & (1 << 11));  // avx512bw, avx512_vnni
+	}();
+	return vnni && simd_level() == SIMD_AVX512;
+}
+
+namespace simd_implementation
+{
+	inline void madd_scalar(float *d, const float *a, float s, int n)
+	{
+		for (int j = 0; j < n; j++)
+			d[j] += a[j] * s;
+	}
+	SIMD_TARGET("sse4.1") inline void madd_sse4(float *d, const float *a, float s, int n)
+	{
+		int j = 0;
+		__m128 ssss = _mm_set1_ps(s);
+		for (; j + 4 <= n; j += 4)
+			_mm_storeu_ps(d + j, _mm_add_ps(_mm_loadu_ps(d + j), _mm_mul_ps(_mm_loadu_ps(a + j), ssss)));
+		for (; j < n; j++)
+			d[j] += a[j] * s;
+	}
+	SIMD_TARGET("avx2,fma") inline void madd_avx2(float *d, const float *a, float s, int n)
+	{
+		int j = 0;
+		__m256 s8 = _mm256_set1_ps(s);
+		for (; j + 8 <= n; j += 8)
+			_mm256_storeu_ps(d + j, _mm256_fmadd_ps(_mm256_loadu_ps(a + j), s8, _mm256_loadu_ps(d + j)));
+		for (; j < n; j++)
+			d[j] += a[j] * s;
+	}
+	SIMD_TARGET("avx512f") inline void madd_avx512(float *d, const float *a, float s, int n)
+	{
+		int j = 0;
+		__m512 s16 = _mm512_set1_ps(s);
+		for (; j + 16 <= n; j += 16)
+			_mm512_storeu_ps(d + j, _mm512_fmadd_ps(_mm512_loadu_ps(a + j), s16, _mm512_loadu_ps(d + j)));
+		if (j < n)  // the tail in one masked go
+		{
+			__mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+			_mm512_mask_storeu_ps(d + j, m, _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + j), s16, _mm512_maskz_loadu_ps(m, d + j)));
+		}
+	}
+
+	inline float dot_scalar(const float *a, const float *b, int n)
+	{
+		float s = 0;
+		for (int j = 0; j < n; j++)
+			s += a[j] * b[j];
+		return s;
+	}
+	SIMD_TARGET("sse4.1") inline float dot_sse4(const float *a, const float *b, int n)
+	{
+		int j = 0;
+		__m128 s4 = _mm_setzero_ps();
+		for (; j + 4 <= n; j += 4)
+			s4 = _mm_add_ps(s4, _mm_mul_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j)));
+		float s = _mm_cvtss_f32(_mm_dp_ps(s4, _mm_set1_ps(1.0f), 0xf1));
+		for (; j < n; j++)
+			s += a[j] * b[j];
+		return s;
+	}
+	SIMD_TARGET("avx2,fma") inline float dot_avx2(const float *a, const float *b, int n)
+	{
+		int j = 0;
+		__m256 s8 = _mm256_setzero_ps();
+		for (; j + 8 <= n; j += 8)
+			s8 = _mm256_fmadd_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j), s8);
+		__m128 s4 = _mm_add_ps(_mm256_castps256_ps128(s8), _mm256_extractf128_ps(s8, 1));
+		s4 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+		float s = _mm_cvtss_f32(_mm_add_ss(s4, _mm_movehdup_ps(s4)));
+		for (; j < n; j++)
+			s += a[j] * b[j];
+		return s;
+	}
+	SIMD_TARGET("avx512f") inline float dot_avx512(const float *a, const float *b, int n)
+	{
+		int j = 0;
+		__m512 s16 = _mm512_setzero_ps();
+		for (; j + 16 <= n; j += 16)
+			s16 = _mm512_fmadd_ps(_mm512_loadu_ps(a + j), _mm512_loadu_ps(b + j), s16);
+		if (j < n)
+		{
+			__mmask16 m = (__mmask16)((1u << (n - j)) - 1);
+			s16 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + j), _mm512_maskz_loadu_ps(m, b + j), s16);
+		}
+		return _mm512_reduce_add_ps(s16);
+	}
+}
+
+inline void madd(float *d, const float *a, float s, int n)  // d[0..n) += a[0..n) * s
+{
+	using namespace simd_implementation;
+	switch (simd_level())
+	{
+		case SIMD_AVX512: return madd_avx512(d, a, s, n);
+		case SIMD_AVX2:   return madd_avx2(d, a, s, n);
+		case SIMD_SSE4:   return madd_sse4(d, a, s, n);
+		default:          return madd_scalar(d, a, s, n);
+	}
+}
+inline float dot(const float *a, const float *b, int n)
+{
+	using namespace simd_implementation;
+	switch (simd_level())
+	{
+		case SIMD_AVX512: return dot_avx512(a, b, n);
+		case SIMD_AVX2:   return dot_avx2(a, b, n);
+		case SIMD_SSE4:   return dot_sse4(a, b, n);
+		default:          return dot_scalar(a, b, n);
+	}
+}
+
+#endif // SIMD_H
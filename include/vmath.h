@@ -0,0 +1,272 @@
+//
+// vmath   exp, tanh and sigmoid over whole arrays
+//
+// The activations and softmax spend most of their time in exp.  These do a vector of floats at a time the
+// usual cephes way:  x = n*ln2 + r with |r| <= ln2/2, a polynomial for e^r, and 2^n goes straight into the
+// exponent bits.  tanh is 1-2/(e^2x+1) from that, with its own polynomial near 0 where that would cancel.
+// sigmoid is 1/(1+e^-x).  Inputs past where e^x would over or underflow a float get clamped, so tanh and
+// sigmoid saturate cleanly instead of going to inf/inf.  NaN stays NaN, same as std::exp and std::tanh.
+//
+// vmath_mode() picks how close to get, vmath_maxerror() has the bounds (exp relative, tanh and sigmoid absolute):
+//    VMATH_STD       std::exp and std::tanh one at a time, the reference
+//    VMATH_PRECISE   degree 5 polynomial, float precision give or take a few ulp
+//    VMATH_FAST      degree 3 polynomial, plenty for training a net
+// Vector width goes by simd_level() same as everything else in simd.h.
+//
+
+#pragma once
+#ifndef VMATH_H
+#define VMATH_H
+
+#include <cmath>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include "simd.h"
+
+enum VMATH { VMATH_STD, VMATH_PRECISE, VMATH_FAST };
+inline const char *vmath_name(VMATH m) { const char *names[] = { "std", "precise", "fast" }; return names[m]; }
+inline VMATH &vmath_mode() { static VMATH mode = VMATH_PRECISE; return mode; }
+inline float vmath_maxerror(VMATH m) { const float bounds[] = { 0.0f, 5e-7f, 1e-4f }; return bounds[m]; }
+
+namespace vmath_implementation
+{
+	const float EXP_LO = -87.3f, EXP_HI = 88.0f;  // e^x stays a normal float in between
+	const float LOG2E = 1.44269504f, LN2_HI = 0.693359375f, LN2_LO = -2.12194440e-4f;  // n*LN2_HI is exact for any n that comes up
+	const float P0 = 1.9875691500e-4f, P1 = 1.3981999507e-3f, P2 = 8.3334519073e-3f, P3 = 4.1665795894e-2f, P4 = 1.6666665459e-1f, P5 = 5.0000001201e-1f;  // e^r = 1+r+r^2*P(r)
+	const float F0 = 0.99992805f, F1 = 1.00016422f, F2 = 0.50496422f, F3 = 0.16566872f;  // e^r = F(r), minimax relative error 7.5e-5
+	const float T0 = -5.70498872745e-3f, T1 = 2.06390887954e-2f, T2 = -5.37397155531e-2f, T3 = 1.33314422036e-1f, T4 = -3.33332819422e-1f;  // tanh a = a+a^3*T(a^2) for a < TSMALL
+	const float TSMALL = 0.625f;
+
+	// plain c++, the same arithmetic as the vector versions, for SIMD_SCALAR.  The vectors carry NaN through the
+	// clamp and out the end on their own, here it gets returned before n would go to an int, which is undefined for NaN.
+	inline float exp1(float x, bool fast)
+	{
+		if (x != x)
+			return x;
+		x = std::min(std::max(x, EXP_LO), EXP_HI);
+		float n = std::floor(x * LOG2E + 0.5f);
+		float r = x - n * LN2_HI - n * LN2_LO;
+		float e = fast ? ((F3 * r + F2) * r + F1) * r + F0 : (((((P0 * r + P1) * r + P2) * r + P3) * r + P4) * r + P5) * (r * r) + (r + 1.0f);
+		int32_t bits = ((int32_t)n + 127) << 23;
+		float s;
+		memcpy(&s, &bits, 4);
+		return e * s;
+	}
+	inline float tanh1(float x, bool fast)
+	{
+		float a = std::abs(x), t;
+		if (!fast && a < TSMALL)
+		{
+			float z = a * a;
+			t = ((((T0 * z + T1) * z + T2) * z + T3) * z + T4) * z * a + a;
+		}
+		else
+			t = 1.0f - 2.0f / (exp1(a + a, fast) + 1.0f);
+		return std::copysign(t, x);
+	}
+	inline float sigmoid1(float x, bool fast) { return 1.0f / (1.0f + exp1(0.0f - x, fast)); }
+
+	// The vector versions are written once in terms of the VM_ macros, each instruction set below says what those mean.
+	#define VMATH_FUNCTIONS(ISA, TARGET) \
+		TARGET inline VM_V exp_##ISA(VM_V x, bool fast) \
+		{ \
+			x = VM_MIN(VM_SET1(EXP_HI), VM_MAX(VM_SET1(EXP_LO), x)); /* min and max give back their second operand for NaN, so x keeps it */ \
+			VM_V n = VM_FLOOR(VM_FMADD(x, VM_SET1(LOG2E), VM_SET1(0.5f))); \
+			VM_V r = VM_SUB(VM_SUB(x, VM_MUL(n, VM_SET1(LN2_HI))), VM_MUL(n, VM_SET1(LN2_LO))); \
+			VM_V e = fast ? VM_FMADD(VM_FMADD(VM_FMADD(VM_SET1(F3), r, VM_SET1(F2)), r, VM_SET1(F1)), r, VM_SET1(F0)) \
+				: VM_FMADD(VM_FMADD(VM_FMADD(VM_FMADD(VM_FMADD(VM_FMADD(VM_SET1(P0), r, VM_SET1(P1)), r, VM_SET1(P2)), r, VM_SET1(P3)), r, VM_SET1(P4)), r, VM_SET1(P5)), VM_MUL(r, r), VM_ADD(r, VM_SET1(1.0f))); \
+			return VM_MUL(e, VM_POW2(n)); \
+		} \
+		TARGET inline VM_V tanh_##ISA(VM_V x, bool fast) \
+		{ \
+			VM_V a = VM_ABS(x); \
+			VM_V t = VM_SUB(VM_SET1(1.0f), VM_DIV(VM_SET1(2.0f), VM_ADD(exp_##ISA(VM_ADD(a, a), fast), VM_SET1(1.0f)))); \
+			if (!fast) \
+			{ \
+				VM_V z = VM_MUL(a, a); \
+				VM_V p = VM_FMADD(VM_FMADD(VM_FMADD(VM_FMADD(VM_SET1(T0), z, VM_SET1(T1)), z, VM_SET1(T2)), z, VM_SET1(T3)), z, VM_SET1(T4)); \
+				t = VM_SELECT_LT(a, VM_SET1(TSMALL), VM_FMADD(VM_MUL(p, z), a, a), t); \
+			} \
+			return VM_OR(t, VM_SIGN(x)); \
+		} \
+		TARGET inline VM_V sigmoid_##ISA(VM_V x, bool fast) { return VM_DIV(VM_SET1(1.0f), VM_ADD(VM_SET1(1.0f), exp_##ISA(VM_SUB(VM_SET1(0.0f), x), fast))); } \
+		VMATH_ARRAY(ISA, TARGET, exp) \
+		VMATH_ARRAY(ISA, TARGET, tanh) \
+		VMATH_ARRAY(ISA, TARGET, sigmoid)
+
+	// y[0..n) = f(x[0..n)),  the last few go through a vector's worth of padding so where something sits in the array never changes what comes out
+	#define VMATH_ARRAY(ISA, TARGET, F) \
+		TARGET inline void v##F##_##ISA(const float *x, float *y, int n, bool fast) \
+		{ \
+			int j = 0; \
+			for (; j + VM_W <= n; j += VM_W) \
+				VM_STORE(y + j, F##_##ISA(VM_LOAD(x + j), fast)); \
+			if (j == n) return; \
+			float t[VM_W] = {}; \
+			std::copy(x + j, x + n, t); \
+			VM_STORE(t, F##_##ISA(VM_LOAD(t), fast)); \
+			std::copy(t, t + n - j, y + j); \
+		}
+
+	#define VM_V __m128
+	#define VM_W 4
+	#define VM_SET1 _mm_set1_ps
+	#define VM_LOAD _mm_loadu_ps
+	#define VM_STORE _mm_storeu_ps
+	#define VM_ADD _mm_add_ps
+	#define VM_SUB _mm_sub_ps
+	#define VM_MUL _mm_mul_ps
+	#define VM_DIV _mm_div_ps
+	#define VM_FMADD(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+	#define VM_MIN _mm_min_ps
+	#define VM_MAX _mm_max_ps
+	#define VM_FLOOR _mm_floor_ps
+	#define VM_POW2(n) _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23))
+	#define VM_ABS(x) _mm_andnot_ps(_mm_set1_ps(-0.0f), x)
+	#define VM_SIGN(x) _mm_and_ps(_mm_set1_ps(-0.0f), x)
+	#define VM_OR _mm_or_ps
+	#define VM_SELECT_LT(a, b, t, f) _mm_blendv_ps(f, t, _mm_cmplt_ps(a, b))
+	VMATH_FUNCTIONS(sse4, SIMD_TARGET("sse4.1"))
+	#undef VM_V
+	#undef VM_W
+	#undef VM_SET1
+	#undef VM_LOAD
+	#undef VM_STORE
+	#undef VM_ADD
+	#undef VM_SUB
+	#undef VM_MUL
+	#undef VM_DIV
+	#undef VM_FMADD
+	#undef VM_MIN
+	#undef VM_MAX
+	#undef VM_FLOOR
+	#undef VM_POW2
+	#undef VM_ABS
+	#undef VM_SIGN
+	#undef VM_OR
+	#undef VM_SELECT_LT
+
+	#define VM_V __m256
+	#define VM_W 8
+	#define VM_SET1 _mm256_set1_ps
+	#define VM_LOAD _mm256_loadu_ps
+	#define VM_STORE _mm256_storeu_ps
+	#define VM_ADD _mm256_add_ps
+	#define VM_SUB _mm256_sub_ps
+	#define VM_MUL _mm256_mul_ps
+	#define VM_DIV _mm256_div_ps
+	#define VM_FMADD _mm256_fmadd_ps
+	#define VM_MIN _mm256_min_ps
+	#define VM_MAX _mm256_max_ps
+	#define VM_FLOOR _mm256_floor_ps
+	#define VM_POW2(n) _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23))
+	#define VM_ABS(x) _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x)
+	#define VM_SIGN(x) _mm256_and_ps(_mm256_set1_ps(-0.0f), x)
+	#define VM_OR _mm256_or_ps
+	#define VM_SELECT_LT(a, b, t, f) _mm256_blendv_ps(f, t, _mm256_cmp_ps(a, b, _CMP_LT_OQ))
+	VMATH_FUNCTIONS(avx2, SIMD_TARGET("avx2,fma"))
+	#undef VM_V
+	#undef VM_W
+	#undef VM_SET1
+	#undef VM_LOAD
+	#undef VM_STORE
+	#undef VM_ADD
+	#undef VM_SUB
+	#undef VM_MUL
+	#undef VM_DIV
+	#undef VM_FMADD
+	#undef VM_MIN
+	#undef VM_MAX
+	#undef VM_FLOOR
+	#undef VM_POW2
+	#undef VM_ABS
+	#undef VM_SIGN
+	#undef VM_OR
+	#undef VM_SELECT_LT
+
+	#define VM_V __m512
+	#define VM_W 16
+	#define VM_SET1 _mm512_set1_ps
+	#define VM_LOAD _mm512_loadu_ps
+	#define VM_STORE _mm512_storeu_ps
+	#define VM_ADD _mm512_add_ps
+	#define VM_SUB _mm512_sub_ps
+	#define VM_MUL _mm512_mul_ps
+	#define VM_DIV _mm512_div_ps
+	#define VM_FMADD _mm512_fmadd_ps
+	#define VM_MIN _mm512_min_ps
+	#define VM_MAX _mm512_max_ps
+	#define VM_FLOOR(x) _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+	#define VM_POW2(n) _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23))
+	#define VM_ABS(x) _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32(0x7fffffff)))
+	#define VM_SIGN(x) _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(x), _mm512_set1_epi32((int)0x80000000)))
+	#define VM_OR(a, b) _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)))
+	#define VM_SELECT_LT(a, b, t, f) _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), f, t)
+	VMATH_FUNCTIONS(avx512, SIMD_TARGET("avx512f"))
+	#undef VM_V
+	#undef VM_W
+	#undef VM_SET1
+	#undef VM_LOAD
+	#undef VM_STORE
+	#undef VM_ADD
+	#undef VM_SUB
+	#undef VM_MUL
+	#undef VM_DIV
+	#undef VM_FMADD
+	#undef VM_MIN
+	#undef VM_MAX
+	#undef VM_FLOOR
+	#undef VM_POW2
+	#undef VM_ABS
+	#undef VM_SIGN
+	#undef VM_OR
+	#undef VM_SELECT_LT
+	#undef VMATH_FUNCTIONS
+	#undef VMATH_ARRAY
+}
+
+inline void vexp(const float *x, float *y, int n)  // y[0..n) = e^x[0..n),  y can be x
+{
+	using namespace vmath_implementation;
+	bool fast = vmath_mode() == VMATH_FAST;
+	if (vmath_mode() == VMATH_STD)
+		for (int j = 0; j < n; j++) y[j] = std::exp(x[j]);
+	else switch (simd_level())
+	{
+		case SIMD_AVX512: return vexp_avx512(x, y, n, fast);
+		case SIMD_AVX2:   return vexp_avx2(x, y, n, fast);
+		case SIMD_SSE4:   return vexp_sse4(x, y, n, fast);
+		default:          for (int j = 0; j < n; j++) y[j] = exp1(x[j], fast);
+	}
+}
+inline void vtanh(const float *x, float *y, int n)
+{
+	using namespace vmath_implementation;
+	bool fast = vmath_mode() == VMATH_FAST;
+	if (vmath_mode() == VMATH_STD)
+		for (int j = 0; j < n; j++) y[j] = std::tanh(x[j]);
+	else switch (simd_level())
+	{
+		case SIMD_AVX512: return vtanh_avx512(x, y, n, fast);
+		case SIMD_AVX2:   return vtanh_avx2(x, y, n, fast);
+		case SIMD_SSE4:   return vtanh_sse4(x, y, n, fast);
+		default:          for (int j = 0; j < n; j++) y[j] = tanh1(x[j], fast);
+	}
+}
+inline void vsigmoid(const float *x, float *y, int n)
+{
+	using namespace vmath_implementation;
+	bool fast = vmath_mode() == VMATH_FAST;
+	if (vmath_mode() == VMATH_STD)
+		for (int j = 0; j < n; j++) y[j] = 1.0f / (1.0f + std::exp(-x[j]));
+	else switch (simd_level())
+	{
+		case SIMD_AVX512: return vsigmoid_avx512(x, y, n, fast);
+		case SIMD_AVX2:   return vsigmoid_avx2(x, y, n, fast);
+		case SIMD_SSE4:   return vsigmoid_sse4(x, y, n, fast);
+		default:          for (int j = 0; j < n; j++) y[j] = sigmoid1(x[j], fast);
+	}
+}
+
+#endif // VMATH_H
@@ -35,11 +35,16 @@
 #include <assert.h>
 #include <iterator>
 #include <algorithm>
-#include <assert.h>
+#include <limits>
+#include <stdint.h>
 
 #include "linalg.h"
 #include "geometric.h"
 
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
 #define COPLANAR   (0)
 #define UNDER      (1)
 #define OVER       (2)
@@ -53,6 +58,45 @@ inline int PlaneTest(const float4 &plane, const float3 &v, float epsilon = PAPER
 	return flag;
 }
 
+// PlaneTest for a whole array of points, returns the OR of all the flags, i.e. UNDER, OVER, SPLIT or COPLANAR.
+// The split tests done while building and merging bsp trees are where most of the time goes, so this does 4 points at a time.
+// If dists is non-null it gets filled with the signed distance of every point, otherwise we stop as soon as we see SPLIT.
+inline int PlaneSplitTest(const float4 &plane, const float3 *verts, int count, float epsilon = PAPERWIDTH, float *dists = NULL)
+{
+	int flag = COPLANAR;
+	int i = 0;
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+	const __m128 nx = _mm_set1_ps(plane.x), ny = _mm_set1_ps(plane.y), nz = _mm_set1_ps(plane.z), nw = _mm_set1_ps(plane.w);
+	const __m128 over = _mm_set1_ps(epsilon), under = _mm_set1_ps(-epsilon);
+	for (; i + 4 <= count; i += 4)
+	{
+		const float *p = &verts[i].x;  // 4 packed float3s is exactly 3 sse registers, transpose to x,y,z
+		__m128 a = _mm_loadu_ps(p), b = _mm_loadu_ps(p + 4), c = _mm_loadu_ps(p + 8);  // x0y0z0x1 y1z1x2y2 z2x3y3z3
+		__m128 u = _mm_shuffle_ps(b, c, _MM_SHUFFLE(1, 0, 3, 2));  // x2y2z2x3
+		__m128 v = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1));  // y0z0y1z1
+		__m128 w = _mm_shuffle_ps(u, c, _MM_SHUFFLE(3, 2, 2, 1));  // y2z2y3z3
+		__m128 x = _mm_shuffle_ps(a, u, _MM_SHUFFLE(3, 0, 3, 0));
+		__m128 y = _mm_shuffle_ps(v, w, _MM_SHUFFLE(2, 0, 2, 0));
+		__m128 z = _mm_shuffle_ps(v, w, _MM_SHUFFLE(3, 1, 3, 1));
+		__m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, nx), _mm_mul_ps(y, ny)), _mm_mul_ps(z, nz)), nw);  // same order as PlaneTest so results match exactly
+		if (_mm_movemask_ps(_mm_cmpgt_ps(d, over)))  flag |= OVER;
+		if (_mm_movemask_ps(_mm_cmplt_ps(d, under))) flag |= UNDER;
+		if (dists)
+			_mm_storeu_ps(dists + i, d);
+		else if (flag == SPLIT)
+			return flag;
+	}
+#endif
+	for (; i < count; i++)
+	{
+		float a = dot(verts[i], plane.xyz()) + plane.w;
+		flag |= (a > epsilon) ? OVER : ((a < -epsilon) ? UNDER : COPLANAR);
+		if (dists)
+			dists[i] = a;
+	}
+	return flag;
+}
+
 
 struct WingMesh
 {
@@ -153,7 +197,14 @@ struct WingMesh
 		return fverts;
 	}
 
-	float4& ComputeFaceNormal(int f) { return (faces[f] = PolyPlane(GenerateFaceVerts(f))); }
+	float4& ComputeFaceNormal(int f)  // gets called for every face of every crop, so reuse the vert list
+	{
+		static thread_local std::vector<float3> fverts;
+		fverts.clear();
+		for (auto &e : FaceView(f))
+			fverts.push_back(verts[e.v]);
+		return (faces[f] = PolyPlane(fverts));
+	}
 
 
 	void EdgeSwap(int a, int b)  // untested, using packslotedge typically
@@ -574,7 +625,7 @@ struct WingMesh
 		return tris;
 	}
 
-	int    SplitTest(const float4 &plane) const { int flag = 0; for (auto &v : verts) flag |= PlaneTest(plane, v); return flag; }
+	int    SplitTest(const float4 &plane) const { return PlaneSplitTest(plane, verts.data(), verts.size()); }
 
 	float  CalcVolume() const { auto tris = GenerateTris(); return Volume(verts.data(), tris.data(), tris.size()); }
 
@@ -700,9 +751,16 @@ inline WingMesh WingMeshCrop(const WingMesh &src,const float4 &slice)
 	int s = src.SplitTest(slice);
 	if (s == OVER) return WingMesh(); //  NULL;
 	if(s==UNDER) return src;          // returning this will make a copy
-	WingMesh m = src;
+	WingMesh m;  // with room for everything slicing can add (every edge split, an edge across every face), bsp code crops a lot 
+	m.edges.reserve(src.edges.size() * 2 + src.faces.size() * 2);
+	m.verts.reserve(src.verts.size() + src.edges.size() / 2);
+	m.vback.reserve(m.verts.capacity());
+	m.faces.reserve(src.faces.size() * 2 + 1);
+	m.fback.reserve(m.faces.capacity());
+	m = src;
 	auto coplanar = m.SliceMesh( slice);   // 	std::vector<int>  the coplanar edges (i believe these are the above ones)
 	std::vector<int> reverse;              // the coplanar edges below (todo verify)  reverse is probably the wrong name
+	reverse.reserve(coplanar.size());
     for (unsigned int i = 0; i<coplanar.size(); i++) reverse.push_back(m.edges[coplanar[coplanar.size() - 1 - i]].adj);
 
     if (coplanar.size()) 
@@ -1002,4 +1060,202 @@ inline WingMesh WingMeshCone(int sides, float radius, float height)
     return mesh;
 }
 
+
+//
+// Compact WingMesh
+//
+// For big bsp/csg workloads most of the time is spent streaming convex cells through SplitTest, SupportPoint and Crop.
+// This variant stores the halfedges as separate arrays (structure of arrays) so a loop that only needs v or next
+// doesn't drag the rest through the cache, drops the redundant id (its just the array index), and can use 16 bit
+// indices since hulls with more than 65k halfedges just don't happen.  Mesh must be packed (no unused slots).
+// Convert with WingMeshCompactT<I>(wingmesh) and back with .Expand().
+// Crop here assumes a convex mesh, which is all the bsp code ever feeds it.
+//
+template<class I> struct WingMeshCompactT
+{
+	std::vector<I>        ev;     // halfedge's vertex
+	std::vector<I>        eadj;
+	std::vector<I>        enext;
+	std::vector<I>        eprev;
+	std::vector<I>        eface;
+	std::vector<float3>   verts;
+	std::vector<float4>   faces;
+	std::vector<I>        vback;
+	std::vector<I>        fback;
+
+	static I Index(size_t i) { assert(i < (size_t)std::numeric_limits<I>::max()); return (I)i; }
+
+	WingMeshCompactT() {}
+	explicit WingMeshCompactT(const WingMesh &m) : verts(m.verts), faces(m.faces)
+	{
+		assert(!m.unpacked);
+		size_t n = m.edges.size();
+		ev.resize(n); eadj.resize(n); enext.resize(n); eprev.resize(n); eface.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			auto &e = m.edges[i];
+			ev[i] = Index(e.v); eadj[i] = Index(e.adj); enext[i] = Index(e.next); eprev[i] = Index(e.prev); eface[i] = Index(e.face);
+		}
+		vback = Transform(m.vback, [](int e) { return Index(e); });
+		fback = Transform(m.fback, [](int e) { return Index(e); });
+	}
+	WingMesh Expand() const
+	{
+		WingMesh m;
+		m.verts = verts;
+		m.faces = faces;
+		m.edges.resize(ev.size());
+		for (size_t i = 0; i < ev.size(); i++)
+			m.edges[i] = WingMesh::HalfEdge((int)i, ev[i], eadj[i], enext[i], eprev[i], eface[i]);
+		m.vback = Transform(vback, [](I e) { return (int)e; });
+		m.fback = Transform(fback, [](I e) { return (int)e; });
+		return m;
+	}
+
+	int  SplitTest(const float4 &plane) const { return PlaneSplitTest(plane, verts.data(), verts.size()); }
+
+	void LinkMesh()  // same idea as WingMesh::LinkMesh, fill in eadj, leaves unmatched (boundary) halfedges at max()
+	{
+		const I none = std::numeric_limits<I>::max();
+		std::vector<I> edgesv(ev.size());
+		for (size_t i = 0; i < ev.size(); i++) edgesv[i] = Index(i);
+		std::sort(edgesv.begin(), edgesv.end(), [this](I a, I b) { return ev[a] < ev[b]; });
+		std::vector<I> veback(verts.size(), none);
+		for (size_t i = edgesv.size(); i--;)
+			veback[ev[edgesv[i]]] = Index(i);
+		eadj.assign(ev.size(), none);
+		for (size_t e = 0; e < ev.size(); e++)
+		{
+			if (eadj[e] != none) continue;
+			I a = ev[e], b = ev[enext[e]];
+			for (size_t k = veback[b]; k < edgesv.size() && ev[edgesv[k]] == b; k++)
+				if (ev[enext[edgesv[k]]] == a)
+				{
+					eadj[e] = edgesv[k];
+					eadj[edgesv[k]] = Index(e);
+					break;
+				}
+		}
+	}
+	void InitBackLists()
+	{
+		vback.assign(verts.size(), 0);
+		fback.assign(faces.size(), 0);
+		for (size_t i = ev.size(); i--;)
+		{
+			vback[ev[i]] = Index(i);
+			fback[eface[i]] = Index(i);
+		}
+	}
+};
+
+typedef WingMeshCompactT<uint16_t> WingMeshCompact16;
+typedef WingMeshCompactT<int32_t>  WingMeshCompact32;
+
+template<class I> float3 SupportPoint(const WingMeshCompactT<I> *m, const float3& dir) { return m->verts[maxdir(m->verts.data(), m->verts.size(), dir)]; }
+
+template<class I> float WingMeshVolume(const WingMeshCompactT<I> &m)  // same fan of triangles per face as WingMesh::GenerateTris, without building the list
+{
+	float volume = 0;
+	for (I e0 : m.fback)
+	{
+		I ea = e0, eb = m.enext[ea];
+		while ((eb = m.enext[ea = eb]) != e0)
+			volume += determinant(float3x3(m.verts[m.ev[e0]], m.verts[m.ev[ea]], m.verts[m.ev[eb]]));
+	}
+	return volume / 6.0f;
+}
+
+template<class I> WingMeshCompactT<I> WingMeshCrop(const WingMeshCompactT<I> &src, const float4 &slice)  // convex only, result's faces[0] is slice just like WingMeshCrop
+{
+	typedef WingMeshCompactT<I> M;
+	const I none = std::numeric_limits<I>::max();
+	std::vector<float> dist(src.verts.size());
+	int s = PlaneSplitTest(slice, src.verts.data(), (int)src.verts.size(), PAPERWIDTH, dist.data());
+	std::vector<int> side = Transform(dist, [](float d) { return (d > PAPERWIDTH) ? OVER : ((d < -PAPERWIDTH) ? UNDER : COPLANAR); });
+	if (s == OVER) return M();
+	if (s != SPLIT) return src;
+	M m;
+	size_t maxedges = src.ev.size() + src.faces.size() * 2;  // each face can gain one vertex, plus the cap
+	m.ev.reserve(maxedges); m.eadj.reserve(maxedges); m.enext.reserve(maxedges); m.eprev.reserve(maxedges); m.eface.reserve(maxedges);
+	m.verts.reserve(src.verts.size() + src.faces.size());
+	m.faces.reserve(src.faces.size() + 1);
+	std::vector<I> vmap(src.verts.size(), none);   // kept vertices
+	std::vector<I> emap(src.ev.size(), none);      // new vertex made where an edge crosses the plane, shared by both halfedges
+	std::vector<I> ecopy(src.ev.size(), none);     // new halfedge running along (the kept part of) a source halfedge
+	auto keep = [&](int v) { if (vmap[v] == none) { vmap[v] = M::Index(m.verts.size()); m.verts.push_back(src.verts[v]); } return vmap[v]; };
+	auto crossing = [&](int e)
+	{
+		int k = std::min<int>(e, src.eadj[e]);
+		if (emap[k] == none)
+		{
+			emap[k] = M::Index(m.verts.size());
+			m.verts.push_back(PlaneLineIntersection(slice, src.verts[src.ev[e]], src.verts[src.ev[src.enext[e]]]));
+		}
+		return emap[k];
+	};
+	m.faces.push_back(slice);  // cap goes first
+	std::vector<I> poly, from;  // from: source halfedge the new one lies along, none if it runs across the face on the plane
+	for (size_t f = 0; f < src.faces.size(); f++)
+	{
+		poly.clear();
+		from.clear();
+		int e0 = src.fback[f], e = e0;
+		do {
+			int v0 = src.ev[e], v1 = src.ev[src.enext[e]];
+			bool split = (side[v0] | side[v1]) == SPLIT;
+			if (side[v0] != OVER)
+			{
+				poly.push_back(keep(v0));
+				from.push_back((split || side[v1] != OVER) ? M::Index(e) : none);
+			}
+			if (split)
+			{
+				poly.push_back(crossing(e));
+				from.push_back((side[v1] != OVER) ? M::Index(e) : none);
+			}
+			e = src.enext[e];
+		} while (e != e0);
+		if (poly.size() < 3)
+			continue;
+		I face = M::Index(m.faces.size()), base = M::Index(m.ev.size()), n = M::Index(poly.size());
+		m.faces.push_back(src.faces[f]);
+		for (I i = 0; i < n; i++)
+		{
+			if (from[i] != none) ecopy[from[i]] = base + i;
+			m.ev.push_back(poly[i]);
+			m.enext.push_back(base + (i + 1) % n);
+			m.eprev.push_back(base + (i + n - 1) % n);
+			m.eface.push_back(face);
+		}
+		for (I i = 0; i < n; i++)
+			m.eadj.push_back(from[i]);  // source halfedge for now, swapped for its neighbor's copy below
+	}
+	I border = M::Index(m.ev.size());
+	for (I e = 0; e < border; e++)
+		m.eadj[e] = (m.eadj[e] != none) ? ecopy[src.eadj[m.eadj[e]]] : none;  // still none if the neighbor face was cropped away
+	std::vector<I> capfrom(m.verts.size(), none);   // cap's halfedge leaving each boundary vertex
+	for (I e = 0; e < border; e++)
+	{
+		if (m.eadj[e] != none) continue;
+		I c = M::Index(m.ev.size());  // cap halfedge runs opposite boundary halfedge e
+		m.ev.push_back(m.ev[m.enext[e]]);
+		m.eadj.push_back(e);
+		m.enext.push_back(none);
+		m.eprev.push_back(none);
+		m.eface.push_back(0);
+		m.eadj[e] = c;
+		capfrom[m.ev[c]] = c;
+	}
+	for (I c = border; c < m.ev.size(); c++)
+	{
+		I n = capfrom[m.ev[m.eadj[c]]];  // next cap halfedge starts where boundary edge started 
+		m.enext[c] = n;
+		m.eprev[n] = c;
+	}
+	m.InitBackLists();
+	return m;
+}
+
+
 #endif
@@ -4,6 +4,7 @@
 #include <iostream>
 #include <fstream>
 #include <cctype>    // std::tolower
+#include <future>
 
 #include <geometric.h>
 #include <glwin.h>
@@ -11,6 +12,7 @@
 #include "misc.h"
 #include "misc_gl.h"
 #include <mesh.h>
+#include <physics.h>
 
 void InitTex()  // create a checkerboard texture   (duplicated function, move to misc_gl.h)
 {
@@ -89,6 +91,10 @@ void fdraw(BSPNode *root,const float3 &camera_position)
 		for (auto &f : n->brep) 
 			fdraw(f); 
 }
+void fdraw(const BSPVis &vis, const float3 &camera_position)  // just the leaves in the pvs of the camera's leaf
+{
+	vis.EachVisible(vis.Leaf(camera_position), [](BSPNode *n) { fdraw(n->brep); });
+}
 
 //----- player nav code ---------
 
@@ -283,7 +289,7 @@ std::unique_ptr<BSPNode> bsp_blast(std::unique_ptr<BSPNode> bsp, const float3 &p
 	auto b = BSPDup(mashers[k].get());
 	BSPScale(*b, s);
 	BSPTranslate(*b, round(p, qsnap));
-	return BSPIntersect(move(b),move(bsp) );
+	return BSPIntersectLocal(move(b),move(bsp));   // also fixes up the brep, but just around the blast
 }
 
 //---------------
@@ -321,6 +327,16 @@ int main(int argc,const char argv[]) try
 	BSPMakeBrep(bsp.get(), BSPRipBrep(bsp.get()));                     // just regenerate the brep, ensures no T-intersections
 	//auto faces = BSPRipBrep(bsp.get());                               // brep moved into faces array
 	// done arena creation
+	BSPVis vis = BSPMakeVis(bsp.get());
+	std::unique_ptr<BSPNode> vistree;  // copy of the tree that vis points into, once it's been remade
+	bool visstale = false;  // tree got blasted since the vis was made
+	int  blasts = 0;
+	struct VisBuild { std::unique_ptr<BSPNode> tree; BSPVis vis; int blasts; };
+	std::future<VisBuild> visbuild;  // remaking the vis on another thread, from a copy so blasting can carry on meanwhile
+
+	std::vector<RigidBody*> crates;  // dropped with 'g', they collide with just the solid cells around them
+	BSPCellCache worldcells(bsp.get());
+	bool dropcrate = false;
 
 	bool planeview = false;
 	bool cammove = false;
@@ -331,6 +347,7 @@ int main(int argc,const char argv[]) try
 		glwin.centermouse = glwin.centermouse != (key == 'm');
 		cammove = cammove != (key == 'c');
 		camsnap = camsnap != (key == 'l');
+		dropcrate = dropcrate || (key == 'g');
 	};
 	Player player;
 
@@ -347,11 +364,51 @@ int main(int argc,const char argv[]) try
 		{
 			float3 hitpoint;
 			if (HitCheck(bsp.get(), 0, camera.position, camera*float3(0, 0, -100.0f), &hitpoint) && length(hitpoint)<14.0f)
+			{
 				bsp = bsp_blast(move(bsp), hitpoint, 4.0f);
+				visstale = true;
+				blasts++;
+				worldcells.Reset(bsp.get());
+			}
 			//BSPMakeBrep(bsp.get(), BSPRipBrep(bsp.get()));               // just regenerate the brep, ensures no T-intersections
 			//faces = BSPRipBrep(bsp.get());                               // brep moved into faces array
 		}
+		else if (visstale && !visbuild.valid())  // redo it once the blasting stops, until then just draw everything
+		{
+			visbuild = std::async(std::launch::async, [](std::unique_ptr<BSPNode> tree, int blasts)
+			{
+				BSPVis vis = BSPMakeVis(tree.get());
+				return VisBuild{ std::move(tree), std::move(vis), blasts };
+			}, BSPDup(bsp.get()), blasts);
+		}
+		if (visbuild.valid() && visbuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+		{
+			VisBuild built = visbuild.get();
+			if (built.blasts == blasts)  // otherwise the tree got blasted again meanwhile, toss it and start over
+			{
+				vis = std::move(built.vis);
+				vistree = std::move(built.tree);
+				visstale = false;
+			}
+		}
+
 
+		if (dropcrate)
+		{
+			if (crates.size() == 16)  // oldest one goes
+			{
+				worldcells.Forget(crates.front());
+				delete crates.front();
+				crates.erase(crates.begin());
+			}
+			crates.push_back(new RigidBody({ Shape(WingMeshCube(0.25f).verts, WingMeshCube(0.25f).GenerateTris()) }, camera*float3(0, 0, -1.5f)));
+			dropcrate = false;
+		}
+		if (crates.size())
+		{
+			std::vector<LimitAngular> angulars;
+			PhysicsUpdate(crates, {}, angulars, WorldCells([&worldcells](RigidBody *rb, float range) -> const std::vector<std::vector<float3> *>& { return worldcells.Cells(rb, range); }));
+		}
 
 		float3 thrust = float3((float)(keyheld['D'] - keyheld['A']), (float)(keyheld['W'] - keyheld['S']), (float)(keyheld[' '] - keyheld['Z']));
 		player.wasd_mlook(glwin.dmouse, thrust, bsp.get());
@@ -405,12 +462,17 @@ int main(int argc,const char argv[]) try
 			glEnable(GL_LIGHTING); glEnable(GL_LIGHT0);
 			float4 ambient(0.50f, 0.75f, 1.0f, 1.0f);
 			glMaterialfv(GL_FRONT, GL_AMBIENT, &ambient.x);
-			fdraw(bsp.get(),camera.position); //  faces);
+			if (visstale)
+				fdraw(bsp.get(), camera.position);
+			else
+				fdraw(vis, camera.position);
 			glPopAttrib();
 		}
 		glPushAttrib(GL_ALL_ATTRIB_BITS);
 		glPushMatrix();
 		glcolorbox(float3(player.radius, player.radius, player.height / 2.0f), player.pose()*Pose({ 0,0,player.height / 2.0f }, { 0,0,0,1 }));
+		for (auto rb : crates)
+			glcolorbox(float3(0.25f), rb->pose());
 		glPopMatrix();
 		glPopAttrib();
 
@@ -419,7 +481,7 @@ int main(int argc,const char argv[]) try
 		glMatrixMode(GL_MODELVIEW);
 		glPopMatrix();  
 		glPopAttrib();
-		glwin.PrintString({ 0, 0 }, "[esc] to quit, [b] to blow holes in stuff");
+		glwin.PrintString({ 0, 0 }, "[esc] to quit, [b] to blow holes in stuff, [g] to drop a crate");
 #       ifdef _DEBUG
 		 glwin.PrintString({ 0, -1 }, "DEBUG Version.  CSG Boolean Ops may be SLOW.");
 #       endif
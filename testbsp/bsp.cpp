@@ -12,6 +12,20 @@
 #include <stdlib.h>
 #include <math.h>
 #include <float.h>
+#include <string.h>
+#include <future>
+#include <thread>
+#include <mutex>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>  // for mapping compiled bsp files
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 
 #define FUZZYWIDTH (PAPERWIDTH*100)
@@ -23,18 +37,24 @@ int allowaxial=1;
 int solidbias =0;
 int usevolcalc=1;
 int allowhull =0;
+int splitbins =16;       // axial split candidates from binned face extents, set to 0 for the exhaustive per-vertex search
+int bspthreaddepth=4;    // levels of the compile that fan out to worker threads, 0 for serial
+int bspthreadfaces=256;  // not worth a thread for fewer faces than this
 BSPNode *currentbsp=NULL;
 
 
 
-int bspnodecount=0;
+std::atomic<int> bspnodecount(0);
+static std::atomic<uint64_t> bspnodeids(0);
 BSPNode::BSPNode(const float3 &n,float d):float4(n,d){
 	isleaf= 0;
+	id = ++bspnodeids;
 	bspnodecount++;
 }
 BSPNode::BSPNode(const float4 &p) : float4(p)
 {
 	isleaf=0;
+	id = ++bspnodeids;
 	bspnodecount++;
 }
 
@@ -42,6 +62,138 @@ BSPNode::~BSPNode() {
 	bspnodecount--;
 }
 
+// Node storage.
+// Compiles and merges make and throw away nodes by the thousand, on several threads at once.  
+// A freed node goes on a free list belonging to the thread that freed it and gets reused from there, 
+// so the heap only gets hit for a new chunk now and then.  Threads keep a limited number to themselves 
+// and pass the rest, and whatever they have when they exit, to a shared list.  Chunks stay with the pool
+// until BSPNodePoolRelease(), which bumps the generation so lists still held by other threads get dropped.
+// Release only goes ahead when no block is handed out and no thread is inside new or delete, and it holds 
+// off any that arrive meanwhile, so calling it at the wrong time just does nothing.
+int bspnodepoolchunk = 256;   // nodes allocated at once when there are none free anywhere
+int bspnodepoolkeep  = 4096;  // more free nodes than this on one thread go to the shared list
+
+union BSPNodeBlock { BSPNodeBlock *next; alignas(BSPNode) char bytes[sizeof(BSPNode)]; };
+struct BSPNodeFreeList { BSPNodeBlock *head, *tail; int count; int exited; int generation; };  // plain data so it still works while the thread is shutting down
+struct BSPNodeShared   { std::mutex mutex; BSPNodeBlock *head = NULL; std::vector<BSPNodeBlock*> chunks; };
+static thread_local BSPNodeFreeList bspnodefree;
+static std::atomic<int> bspnodegeneration(0);  // only changes with the shared mutex held
+static BSPNodeShared &BSPNodeSharedList() { static BSPNodeShared *shared = new BSPNodeShared(); return *shared; }  // never destroyed, nodes in globals get freed after main()
+static std::atomic<int> bspnodepoolusers(0);      // threads inside new or delete right now
+static std::atomic<int> bspnodepoolreleasing(0);  // set while BSPNodePoolRelease() decides, and frees if it can
+static std::atomic<int> bspnodepoolblocks(0);     // handed out by new and not yet back through delete
+
+struct BSPNodePoolUse  // either release sees this thread in here, or this thread sees the release and waits it out
+{
+	BSPNodePoolUse()
+	{
+		for(;;) {
+			bspnodepoolusers++;
+			if(!bspnodepoolreleasing) return;
+			bspnodepoolusers--;
+			std::lock_guard<std::mutex> wait(BSPNodeSharedList().mutex);  // release holds this until it's done
+		}
+	}
+	~BSPNodePoolUse() { bspnodepoolusers--; }
+};
+
+static void BSPNodeGiveBack(BSPNodeBlock *head, BSPNodeBlock *tail, int generation)
+{
+	auto &shared = BSPNodeSharedList();
+	std::lock_guard<std::mutex> lock(shared.mutex);
+	if(generation != bspnodegeneration) 
+		return;  // their chunk is gone
+	tail->next  = shared.head;
+	shared.head = head;
+}
+struct BSPNodeThreadExit { ~BSPNodeThreadExit() { if(bspnodefree.head) BSPNodeGiveBack(bspnodefree.head, bspnodefree.tail, bspnodefree.generation); bspnodefree = { NULL, NULL, 0, 1, bspnodegeneration }; } };
+static thread_local BSPNodeThreadExit bspnodethreadexit;
+
+static BSPNodeFreeList &BSPNodeThreadList()
+{
+	auto &list = bspnodefree;
+	if(!list.exited)
+		(void)&bspnodethreadexit;  // so this thread's list gets handed back when it exits
+	if(list.generation != bspnodegeneration)
+		list = { NULL, NULL, 0, list.exited, bspnodegeneration };
+	return list;
+}
+
+void *BSPNode::operator new(size_t size)
+{
+	assert(size == sizeof(BSPNode));
+	BSPNodePoolUse use;
+	auto &list = BSPNodeThreadList();
+	if(!list.head) {
+		auto &shared = BSPNodeSharedList();
+		std::lock_guard<std::mutex> lock(shared.mutex);
+		list.generation = bspnodegeneration;
+		list.head = list.tail = shared.head;
+		list.count = shared.head ? 1 : 0;
+		while(list.count < bspnodepoolchunk && list.tail && list.tail->next) {
+			list.tail = list.tail->next;
+			list.count++;
+		}
+		if(list.tail) {
+			shared.head = list.tail->next;
+			list.tail->next = NULL;
+		}
+		if(!list.head) {
+			int n = std::max(1, bspnodepoolchunk);
+			BSPNodeBlock *chunk = new BSPNodeBlock[n];
+			shared.chunks.push_back(chunk);
+			for(int i=0;i<n;i++) 
+				chunk[i].next = (i+1<n) ? &chunk[i+1] : NULL;
+			list = { chunk, &chunk[n-1], n, list.exited, list.generation };
+		}
+	}
+	BSPNodeBlock *b = list.head;
+	list.head = b->next;
+	list.count--;
+	bspnodepoolblocks++;
+	return b;
+}
+
+void BSPNode::operator delete(void *p)
+{
+	if(!p) return;
+	BSPNodePoolUse use;
+	bspnodepoolblocks--;
+	auto b = (BSPNodeBlock*)p;
+	auto &list = BSPNodeThreadList();
+	if(list.exited) {
+		b->next = NULL;
+		BSPNodeGiveBack(b, b, list.generation);
+		return;
+	}
+	b->next = list.head;
+	if(!list.head) list.tail = b;
+	list.head = b;
+	if(++list.count > bspnodepoolkeep) {
+		BSPNodeGiveBack(list.head, list.tail, list.generation);
+		list = { NULL, NULL, 0, 0, list.generation };
+	}
+}
+
+int BSPNodePoolRelease()
+{
+	auto &shared = BSPNodeSharedList();
+	std::lock_guard<std::mutex> lock(shared.mutex);
+	bspnodepoolreleasing = 1;
+	if(bspnodepoolblocks || bspnodepoolusers) {
+		bspnodepoolreleasing = 0;
+		return 0;
+	}
+	int n = (int)shared.chunks.size();
+	for(auto chunk : shared.chunks)
+		delete[] chunk;
+	shared.chunks.clear();
+	shared.head = NULL;
+	bspnodegeneration++;
+	bspnodepoolreleasing = 0;
+	return n;
+}
+
 int BSPCount(BSPNode *n)
 {
 	if(!n) return 0;
@@ -73,25 +225,17 @@ void ReorderFaceArray(std::vector<Face> & face){
     face.swap(newFaces);
 }
 
-static int count[4];
-
-
-float sumbboxdim(const WingMesh &convex)
+template<class M> float sumbboxdim(const M &convex)
 {
 	float3 bmin,bmax;
 	std::tie(bmin, bmax) = Extents<float,3>(convex.verts); // (convex->verts.data(), convex->verts.size(), bmin, bmax);
 	return dot(float3(1,1,1),bmax-bmin);
 }
 
-float PlaneCost(const std::vector<Face> &inputfaces,const float4 &split,const WingMesh &space,int onbrep)
+// SplitCost and the candidate searches that call it are templated on the cell so BSPChooseSplit can hand them
+// a WingMeshCompactT, every candidate crops the cell twice and that's most of the compile time.
+template<class M> float SplitCost(const int count[4],const float4 &split,const M &space,int onbrep)
 {
-	count[COPLANAR] = 0;
-	count[UNDER]    = 0;
-	count[OVER]     = 0;
-	count[SPLIT]    = 0;
-	for(unsigned int i=0;i<inputfaces.size();i++) {
-		count[FaceSplitTest(inputfaces[i],split,FUZZYWIDTH)]++;
-	}
     if (space.verts.size() == 0) {
 		// The following formula isn't that great.
 		// Better to use volume as well eh.
@@ -100,8 +244,8 @@ float PlaneCost(const std::vector<Face> &inputfaces,const float4 &split,const Wi
 	float volumeover =(float)1.0;
 	float volumeunder=(float)1.0;
 	float volumetotal=WingMeshVolume(space);
-	WingMesh spaceunder= WingMeshCrop(space,float4( split.xyz(), split.w));
-	WingMesh spaceover = WingMeshCrop(space,float4(-split.xyz(),-split.w));
+	M spaceunder= WingMeshCrop(space,float4( split.xyz(), split.w));
+	M spaceover = WingMeshCrop(space,float4(-split.xyz(),-split.w));
 	if(usevolcalc==1)
 	{
 		volumeunder = WingMeshVolume(spaceunder);
@@ -127,7 +271,149 @@ float PlaneCost(const std::vector<Face> &inputfaces,const float4 &split,const Wi
 	       volumeunder*powf(count[UNDER]+1.5f*count[SPLIT],0.9f);
 }
 
+template<class M> float PlaneCost(const std::vector<Face> &inputfaces,const float4 &split,const M &space,int onbrep,int count[4])
+{
+	count[COPLANAR] = 0;
+	count[UNDER]    = 0;
+	count[OVER]     = 0;
+	count[SPLIT]    = 0;
+	for(unsigned int i=0;i<inputfaces.size();i++) {
+		count[FaceSplitTest(inputfaces[i],split,FUZZYWIDTH)]++;
+	}
+	return SplitCost(count, split, space, onbrep);
+}
+
+// The original axial search tries planes through every vertex of the first facetestlimit faces, 
+// each one costing a pass over all the faces.  Instead, bin the faces' extents along each axis 
+// and sweep the bin boundaries, so the face counts for every candidate come out of a prefix sum. 
+// Only the volume part of the cost still needs to crop the cell.
+template<class M> static void BinnedAxialSplit(const std::vector<Face> &inputfaces,const M &space,float &minval,float4 &split)
+{
+	std::vector<int> minbin(splitbins), maxbin(splitbins);
+	for(int a=0;a<3;a++)
+	{
+		if(!(allowaxial & (1<<a))) continue;
+		float lo=FLT_MAX,hi=-FLT_MAX;
+		for(auto &f : inputfaces) for(auto &v : f.vertex) {
+			lo = std::min(lo, v[a]);
+			hi = std::max(hi, v[a]);
+		}
+		if(hi-lo <= FUZZYWIDTH*2) continue;
+		float w = (hi-lo)/splitbins;
+		auto bin = [&](float x) { return std::max(0, std::min(splitbins-1, (int)((x-lo)/w))); };
+		std::fill(minbin.begin(), minbin.end(), 0);
+		std::fill(maxbin.begin(), maxbin.end(), 0);
+		for(auto &f : inputfaces) {
+			float fmin=FLT_MAX,fmax=-FLT_MAX;
+			for(auto &v : f.vertex) {
+				fmin = std::min(fmin, v[a]);
+				fmax = std::max(fmax, v[a]);
+			}
+			minbin[bin(fmin)]++;
+			maxbin[bin(fmax)]++;
+		}
+		int count[4] = { 0, 0, (int)inputfaces.size(), 0 };
+		for(int b=1;b<splitbins;b++)
+		{
+			count[UNDER] += maxbin[b-1];  // faces entirely below this boundary
+			count[OVER]  -= minbin[b-1];  // faces entirely above
+			count[SPLIT]  = inputfaces.size() - count[UNDER] - count[OVER];
+			if(!(count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) continue;
+			float4 p(0,0,0,-(lo+b*w));
+			p[a] = 1.0f;
+			float val = SplitCost(count, p, space, 0);
+			if(val<minval) {
+				minval=val;
+				split = p;
+			}
+		}
+	}
+}
+
+template<class M> static float4 BSPChooseSplit(const std::vector<Face> & inputfaces,const M & space,unsigned int threads)
+{
+	// select partitioning plane
+	float minval=FLT_MAX;
+	float4 split(float3(0,0,0),0);
+
+	// candidates from the faces' own planes, spread across the threads BSPCompile can spare at this depth
+	// and reduce the per-chunk winners in order, so the choice is the same as the serial loop would make
+	unsigned int candidates = std::min((unsigned int)inputfaces.size(), (unsigned int)std::max(facetestlimit, 1));
+	auto facecandidates = [&inputfaces,&space](unsigned int begin, unsigned int end) {
+		std::pair<float, float4> best(FLT_MAX, float4(0, 0, 0, 0));
+		int count[4];
+		for (unsigned int i = begin; i < end; i++) {
+			float val = PlaneCost(inputfaces, inputfaces[i].plane(), space, 1, count);
+			if (val < best.first)
+				best = std::make_pair(val, inputfaces[i].plane());
+		}
+		return best;
+	};
+	std::vector<std::future<std::pair<float, float4>>> chunks;
+	unsigned int nchunks = std::max(1u, std::min(candidates, threads));
+	for (unsigned int c = 1; c < nchunks; c++)
+		chunks.push_back(std::async(std::launch::async, facecandidates, candidates*c / nchunks, candidates*(c + 1) / nchunks));
+	auto best = facecandidates(0, candidates / nchunks);
+	for (auto &c : chunks) {
+		auto b = c.get();
+		if (b.first < best.first)
+			best = b;
+	}
+	minval = best.first;
+	split  = best.second;
+	assert(split.xyz() != float3(0,0,0));
+
+    if (allowaxial && inputfaces.size() > 8 && splitbins > 1) {
+		BinnedAxialSplit(inputfaces, space, minval, split);
+	}
+    else if (allowaxial && inputfaces.size() > 8) {
+		// consider some other planes:
+		int count[4];
+        for (unsigned int i = 0; i<inputfaces.size() && (int)i<facetestlimit; i++) {
+			for(unsigned int j=0;j<inputfaces[i].vertex.size();j++ ) {
+				float val;
+				if(allowaxial & (1<<0))
+				{
+					val = PlaneCost(inputfaces,float4(float3(1,0,0),-inputfaces[i].vertex[j].x),space,0,count);
+					if(val<minval && (count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) { 
+						minval=val;
+						split.xyz() = float3(1, 0, 0);
+						split.w   = -inputfaces[i].vertex[j].x;
+					}
+				}
+				if(allowaxial & (1<<1))
+				{
+					val = PlaneCost(inputfaces,float4(float3(0,1,0),-inputfaces[i].vertex[j].y),space,0,count);
+					if(val<minval && (count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) { 
+						minval=val;
+						split.xyz() = float3(0, 1, 0);
+						split.w   = -inputfaces[i].vertex[j].y;
+					}
+				}
+				if(allowaxial & (1<<2))
+				{
+					val = PlaneCost(inputfaces,float4(float3(0,0,1),-inputfaces[i].vertex[j].z),space,0,count);
+					if(val<minval && (count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) { 
+						minval=val;
+						split.xyz() = float3(0, 0, 1);
+						split.w   = -inputfaces[i].vertex[j].z;
+					}
+				}
+			}
+		}
+	}
+	return split;
+}
 
+static float4 BSPChooseSplit(const std::vector<Face> & inputfaces,const WingMesh & space,unsigned int threads)
+{
+	// converted once here, then cropped for every candidate plane
+	if (space.unpacked)
+		return BSPChooseSplit<WingMesh>(inputfaces, space, threads);
+	if (space.edges.size() < 0xffff)
+		return BSPChooseSplit(inputfaces, WingMeshCompact16(space), threads);
+	return BSPChooseSplit(inputfaces, WingMeshCompact32(space), threads);
+}
 
 void DividePolys(const float4 &splitplane,std::vector<Face> && inputfaces,
 				 std::vector<Face> &under,std::vector<Face> &over,std::vector<Face> &coplanar){
@@ -152,9 +438,9 @@ void DividePolys(const float4 &splitplane,std::vector<Face> && inputfaces,
 	}
 }
 
-
-std::unique_ptr<BSPNode> BSPCompile(const std::vector<Face> & inputfaces,WingMesh convex_space,int side) { return BSPCompile(std::vector<Face>(inputfaces), convex_space, side); }
-std::unique_ptr<BSPNode> BSPCompile(std::vector<Face> && inputfaces,WingMesh space,int side) 
+// Nothing in here touches shared state, so the tree that comes out is the same no matter how many threads 
+// helped build it or in what order they finished.  Set bspthreaddepth=0 for a plain serial build to compare against.
+static std::unique_ptr<BSPNode> BSPCompile(std::vector<Face> && inputfaces,WingMesh space,int side,int depth) 
 {
     if (inputfaces.size() == 0) {
         std::unique_ptr<BSPNode> node(new BSPNode);
@@ -166,86 +452,10 @@ std::unique_ptr<BSPNode> BSPCompile(std::vector<Face> && inputfaces,WingMesh spa
 	std::vector<Face> under;
 	std::vector<Face> coplanar;
 	ReorderFaceArray(inputfaces);
-	// select partitioning plane
-	float minval=FLT_MAX;
-	float4 split(float3(0,0,0),0);
+	int parallel = (depth < bspthreaddepth && (int)inputfaces.size() >= bspthreadfaces);
+	unsigned int threads = (parallel) ? std::max(1u, std::thread::hardware_concurrency() >> depth) : 1;  // up to 2^depth branches are choosing splits at once, they share the cores
+	float4 split = BSPChooseSplit(inputfaces, space, threads);
 
-//    if (inputfaces.size()>1 && inputfaces.size() <= allowhull)
-//	{
-//		int j;
-//		std::vector<float3> verts;
-//		for(i=0;i<inputfaces.size();i++) 
-//			for(j=0;j<inputfaces[i]->vertex.size();j++)
-//                AddUnique(verts, inputfaces[i]->vertex[j]);
-//
-//
-//        std::vector<int3> tris=calchull(verts.data(), verts.size(), 50);  // passing in array members might not be the best thing here!!
-//
-//		for(i=0;i<tris.size();i++)
-//		{
-//			float4 p(TriNormal(verts[tris[i][0]],verts[tris[i][1]],verts[tris[i][2]]),0);
-//			if(p.xyz()==float3(0,0,0))continue;
-//			p.w = -dot(verts[tris[i][0]],p.xyz());
-//			float3 c = (verts[tris[i][0]]+verts[tris[i][1]]+verts[tris[i][2]]) /3.0f + p.xyz() * 0.001f;
-//			if(solidbias && !currentbsp) continue; 
-//			if(solidbias && HitCheck(currentbsp,1,c,c,&c)) continue;
-//			if(WingMeshSplitTest(space,p)!= SPLIT) continue;
-//			float val = PlaneCost(inputfaces,p,space,1)*1.01f;
-//			if(val<minval) 
-//			{
-//				minval=val;
-//				split = p;
-//			}
-//		}
-//	}
-
-	if(!solidbias || split.xyz()==float3(0,0,0))
-	{
-        for (unsigned int i = 0; i<inputfaces.size() && (int)i<facetestlimit; i++) {
-			float val=PlaneCost(inputfaces, inputfaces[i].plane(), space, 1);
-			if(val<minval) {
-				minval=val;
-				split = inputfaces[i].plane();
-			}
-		}
-		assert(split.xyz() != float3(0,0,0));
-		PlaneCost(inputfaces,split,space,1);
-        if (allowaxial && inputfaces.size() > 8) {
-			// consider some other planes:
-            for (unsigned int i = 0; i<inputfaces.size() && (int)i<facetestlimit; i++) {
-				for(unsigned int j=0;j<inputfaces[i].vertex.size();j++ ) {
-					float val;
-					if(allowaxial & (1<<0))
-					{
-						val = PlaneCost(inputfaces,float4(float3(1,0,0),-inputfaces[i].vertex[j].x),space,0);
-						if(val<minval && (count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) { 
-							minval=val;
-							split.xyz() = float3(1, 0, 0);
-							split.w   = -inputfaces[i].vertex[j].x;
-						}
-					}
-					if(allowaxial & (1<<1))
-					{
-						val = PlaneCost(inputfaces,float4(float3(0,1,0),-inputfaces[i].vertex[j].y),space,0);
-						if(val<minval && (count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) { 
-							minval=val;
-							split.xyz() = float3(0, 1, 0);
-							split.w   = -inputfaces[i].vertex[j].y;
-						}
-					}
-					if(allowaxial & (1<<2))
-					{
-						val = PlaneCost(inputfaces,float4(float3(0,0,1),-inputfaces[i].vertex[j].z),space,0);
-						if(val<minval && (count[OVER]*count[UNDER]>0 || count[SPLIT]>0)) { 
-							minval=val;
-							split.xyz() = float3(0, 0, 1);
-							split.w   = -inputfaces[i].vertex[j].z;
-						}
-					}
-				}
-			}
-		}
-	}
 	// Divide the faces
     std::unique_ptr<BSPNode> node(new BSPNode);
     node->plane() = split;
@@ -264,11 +474,20 @@ std::unique_ptr<BSPNode> BSPCompile(std::vector<Face> && inputfaces,WingMesh spa
 		}
 	}
 
-	node->under = BSPCompile(std::move(under), WingMeshCrop(space, split), UNDER);
-	node->over = BSPCompile(std::move(over), WingMeshCrop(space, -split), OVER);
+	if (parallel) {
+		auto task = std::async(std::launch::async, [&]() { return BSPCompile(std::move(under), WingMeshCrop(space, split), UNDER, depth + 1); });
+		node->over  = BSPCompile(std::move(over), WingMeshCrop(space, -split), OVER, depth + 1);
+		node->under = task.get();
+		return node;
+	}
+	node->under = BSPCompile(std::move(under), WingMeshCrop(space, split), UNDER, depth + 1);
+	node->over  = BSPCompile(std::move(over), WingMeshCrop(space, -split), OVER, depth + 1);
 	return node;
 }
 
+std::unique_ptr<BSPNode> BSPCompile(const std::vector<Face> & inputfaces,WingMesh convex_space,int side) { return BSPCompile(std::vector<Face>(inputfaces), convex_space, side); }
+std::unique_ptr<BSPNode> BSPCompile(std::vector<Face> && inputfaces,WingMesh space,int side) { return BSPCompile(std::move(inputfaces), std::move(space), side, 0); }
+
 std::unique_ptr<BSPNode> BSPDup(BSPNode *n) 
 {
 	if (!n) {
@@ -284,6 +503,208 @@ std::unique_ptr<BSPNode> BSPDup(BSPNode *n)
 	return std::unique_ptr<BSPNode>(a);
 }
 
+BSPFlat BSPFlatten(BSPNode *root)
+{
+	struct Pending { BSPNode *n; int depth; int parent; };  // parent is set for over children only, under children are simply next
+	BSPFlat flat;
+	std::vector<Pending> stack;
+	if(root) stack.push_back({root,1,-1});
+	while(stack.size())
+	{
+		Pending p = stack.back();
+		stack.pop_back();
+		int i = flat.nodes.size();
+		if(p.parent>=0) flat.nodes[p.parent].over = i;
+		flat.depth = std::max(flat.depth, p.depth);
+		BSPFlatNode f = { p.n->plane(), -1, -1, p.n->isleaf, -1 };
+		if(p.n->isleaf) {
+			f.cell = flat.convex.size();
+			flat.convex.push_back(p.n->convex);
+			flat.brep.push_back(p.n->brep);
+		}
+		else {
+			assert(p.n->under && p.n->over);
+			f.under = i+1;
+			stack.push_back({p.n->over.get(),p.depth+1,i});   // over goes on first so the whole under subtree comes out before it
+			stack.push_back({p.n->under.get(),p.depth+1,-1});
+		}
+		flat.nodes.push_back(f);
+	}
+	return flat;
+}
+
+// Saving and mapping compiled bsps, see BSPFileHeader in bsp.h for the layout.
+static_assert(sizeof(BSPFileHeader) == 48, "bsp file header layout changed, bump BSPFILEVERSION");
+static_assert(sizeof(WingMesh::HalfEdge) == 6*sizeof(int), "halfedges are written as is");
+
+template<class T> static void FilePut(std::vector<char> &buf, const T *data, size_t count)
+{
+	const char *p = (const char*)data;
+	buf.insert(buf.end(), p, p + count*sizeof(T));
+}
+template<class T> static void FilePut(std::vector<char> &buf, const T &v) { FilePut(buf, &v, 1); }
+
+int BSPSave(const BSPFlat &flat, const char *filename)
+{
+	assert(flat.convex.size() == flat.brep.size());
+	BSPFileHeader header = {};
+	memcpy(header.magic, "BSPF", 4);
+	header.version   = BSPFILEVERSION;
+	header.nodecount = (uint32_t)flat.nodes.size();
+	header.leafcount = (uint32_t)flat.convex.size();
+	header.depth     = flat.depth;
+	header.nodes     = (sizeof(header) + 31) & ~31;
+	header.leaves    = header.nodes + flat.nodes.size()*sizeof(BSPFlatNode);
+	std::vector<char> buf(header.leaves + flat.convex.size()*2*sizeof(uint64_t));
+	memcpy(buf.data() + header.nodes, flat.nodes.data(), flat.nodes.size()*sizeof(BSPFlatNode));
+	for(unsigned int i=0;i<flat.convex.size();i++)
+	{
+		uint64_t offsets[2];
+		const WingMesh &m = flat.convex[i];
+		offsets[0] = buf.size();
+		FilePut(buf, (uint32_t)m.verts.size());
+		FilePut(buf, (uint32_t)m.edges.size());
+		FilePut(buf, (uint32_t)m.faces.size());
+		FilePut(buf, (uint32_t)m.unpacked);
+		FilePut(buf, m.verts.data(), m.verts.size());
+		FilePut(buf, m.edges.data(), m.edges.size());
+		FilePut(buf, m.faces.data(), m.faces.size());
+		FilePut(buf, m.vback.data(), m.vback.size());
+		FilePut(buf, m.fback.data(), m.fback.size());
+		offsets[1] = buf.size();
+		FilePut(buf, (uint32_t)flat.brep[i].size());
+		for(auto &f : flat.brep[i])
+		{
+			FilePut(buf, f.plane());
+			FilePut(buf, (int32_t)f.matid);
+			FilePut(buf, f.gu);
+			FilePut(buf, f.gv);
+			FilePut(buf, f.ot);
+			FilePut(buf, (uint32_t)f.vertex.size());
+			FilePut(buf, f.vertex.data(), f.vertex.size());
+		}
+		memcpy(buf.data() + header.leaves + i*sizeof(offsets), offsets, sizeof(offsets));
+	}
+	header.size = buf.size();
+	memcpy(buf.data(), &header, sizeof(header));
+	FILE *fp = fopen(filename, "wb");
+	if(!fp) return 0;
+	size_t written = fwrite(buf.data(), 1, buf.size(), fp);
+	return (fclose(fp) == 0 && written == buf.size()) ? 1 : 0;
+}
+
+struct BSPMapped::Mapping
+{
+	const char *data = NULL;
+	size_t      size = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE map  = NULL;
+	~Mapping() { if(data) UnmapViewOfFile(data); if(map) CloseHandle(map); if(file != INVALID_HANDLE_VALUE) CloseHandle(file); }
+	int Open(const char *filename)
+	{
+		file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		LARGE_INTEGER filesize;
+		if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &filesize) || !filesize.QuadPart) return 0;
+		size = (size_t)filesize.QuadPart;
+		map  = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		data = map ? (const char*)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0) : NULL;
+		return data != NULL;
+	}
+#else
+	~Mapping() { if(data) munmap((void*)data, size); }
+	int Open(const char *filename)
+	{
+		int fd = open(filename, O_RDONLY);
+		if(fd < 0) return 0;
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_size > 0) {
+			void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if(p != MAP_FAILED) { data = (const char*)p; size = (size_t)st.st_size; }
+		}
+		close(fd);  // the mapping stays valid
+		return data != NULL;
+	}
+#endif
+};
+
+struct FileGet  // bounds checked reads out of a leaf record
+{
+	const char *p, *end;
+	int ok;
+	template<class T> void Array(T *dst, size_t count) { size_t n = count*sizeof(T); if(!ok || (size_t)(end-p) < n) { ok = 0; return; } memcpy(dst, p, n); p += n; }
+	template<class T> T Value() { T v = T(); Array(&v, 1); return v; }
+	size_t Count(size_t bytes_each) { size_t n = Value<uint32_t>(); if(n*bytes_each > (size_t)(end-p)) ok = 0; return ok ? n : 0; }  // so a bad count cant ask for gigabytes
+};
+
+BSPMapped::BSPMapped() {}
+BSPMapped::~BSPMapped() {}
+
+std::unique_ptr<BSPMapped> BSPMap(const char *filename)
+{
+	std::unique_ptr<BSPMapped::Mapping> mapping(new BSPMapped::Mapping());
+	if(!mapping->Open(filename) || mapping->size < sizeof(BSPFileHeader)) return NULL;
+	const char *data = mapping->data;
+	BSPFileHeader header;
+	memcpy(&header, data, sizeof(header));
+	if(memcmp(header.magic, "BSPF", 4) || header.version != BSPFILEVERSION || header.size != mapping->size || !header.nodecount) return NULL;
+	if(header.nodes % alignof(BSPFlatNode) || header.nodes + header.nodecount*sizeof(BSPFlatNode) > header.leaves || header.leaves + header.leafcount*2*sizeof(uint64_t) > header.size) return NULL;
+	const BSPFlatNode *nodes = (const BSPFlatNode*)(data + header.nodes);
+	for(uint32_t i=0;i<header.nodecount;i++)  // the queries trust the indices, so check them once here
+	{
+		const BSPFlatNode &n = nodes[i];
+		if(n.isleaf ? (n.cell < 0 || (uint32_t)n.cell >= header.leafcount) : (n.under <= (int)i || n.over <= (int)i || (uint32_t)n.under >= header.nodecount || (uint32_t)n.over >= header.nodecount)) return NULL;
+	}
+	std::unique_ptr<BSPMapped> bsp(new BSPMapped());
+	bsp->nodes.p = nodes;
+	bsp->nodes.n = header.nodecount;
+	bsp->depth   = header.depth;
+	auto record = [data, header](int cell, int which) {
+		uint64_t offset;
+		memcpy(&offset, data + header.leaves + (cell*2 + which)*sizeof(uint64_t), sizeof(offset));
+		return FileGet{ data + std::min(offset, header.size), data + header.size, 1 };
+	};
+	bsp->convex.decode = [record](int cell) {
+		FileGet get = record(cell, 0);
+		WingMesh m;
+		m.verts.resize(get.Count(sizeof(float3)));
+		m.edges.resize(get.Count(sizeof(WingMesh::HalfEdge)));
+		m.faces.resize(get.Count(sizeof(float4)));
+		m.unpacked = get.Value<uint32_t>();
+		m.vback.resize(m.verts.size());
+		m.fback.resize(m.faces.size());
+		get.Array(m.verts.data(), m.verts.size());
+		get.Array(m.edges.data(), m.edges.size());
+		get.Array(m.faces.data(), m.faces.size());
+		get.Array(m.vback.data(), m.vback.size());
+		get.Array(m.fback.data(), m.fback.size());
+		assert(get.ok);
+		if(!get.ok) m = WingMesh();
+		return m;
+	};
+	bsp->brep.decode = [record](int cell) {
+		FileGet get = record(cell, 1);
+		std::vector<Face> faces(get.Count(sizeof(float4) + sizeof(int32_t) + 3*sizeof(float3) + sizeof(uint32_t)));
+		for(auto &f : faces)
+		{
+			get.Array(&f.plane(), 1);
+			f.matid = get.Value<int32_t>();
+			get.Array(&f.gu, 1);
+			get.Array(&f.gv, 1);
+			get.Array(&f.ot, 1);
+			f.vertex.resize(get.Count(sizeof(float3)));
+			get.Array(f.vertex.data(), f.vertex.size());
+		}
+		assert(get.ok);
+		if(!get.ok) faces.clear();
+		return faces;
+	};
+	bsp->convex.resize(header.leafcount);
+	bsp->brep.resize(header.leafcount);
+	bsp->mapping = move(mapping);
+	return bsp;
+}
+
 void BSPDeriveConvex(BSPNode & node, WingMesh cnvx) 
 {
 	if (cnvx.edges.size() && cnvx.verts.size())
@@ -377,7 +798,7 @@ void BSPScale(BSPNode & n, float scaling)
 void NegateFace(Face & f)
 {
     f.plane() = -f.plane();
-    std::reverse(begin(f.vertex), end(f.vertex));
+    std::reverse(f.vertex.begin(), f.vertex.end());
 }
 
 void NegateTreePlanes(BSPNode * root) 
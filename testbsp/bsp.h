@@ -20,6 +20,14 @@
 #include "wingmesh.h"  
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <initializer_list>
+#include <type_traits>
 
 //#define COPLANAR   (0)   <= these found in geometric.h
 //#define UNDER      (1)
@@ -28,21 +36,109 @@
 //#define PAPERWIDTH (0.0001f)
 
 
+// Vector that keeps its first N elements in place and only goes to the heap beyond that.
+// Clipping and splitting faces during compile and merge used to be a constant stream of little 
+// mallocs for the vertex lists, all fighting over the heap lock once the builds went multithreaded.  
+// Nearly every face fits in place.  Has the std::vector bits that the bsp code uses, for plain data only.
+template<class T, int N> class SmallVector
+{
+	T        local[N];
+	T       *p   = local;
+	uint32_t n   = 0;
+	uint32_t cap = N;
+	static_assert(std::is_trivially_copyable<T>::value, "SmallVector moves elements with memcpy");
+	void grow(size_t want)
+	{
+		if (want <= cap) return;
+		size_t c = std::max(want, (size_t)cap * 2);
+		T *q = (T*)malloc(c * sizeof(T));
+		memcpy(q, p, n * sizeof(T));
+		if (p != local) free(p);
+		p = q;
+		cap = (uint32_t)c;
+	}
+  public:
+	typedef T        value_type;
+	typedef T*       iterator;
+	typedef const T* const_iterator;
+	SmallVector() {}
+	SmallVector(std::initializer_list<T> l)     { assign(l.begin(), l.end()); }
+	SmallVector(const SmallVector &r)           { assign(r.begin(), r.end()); }
+	SmallVector(SmallVector &&r) noexcept       { *this = std::move(r); }
+	~SmallVector()                              { if (p != local) free(p); }
+	SmallVector &operator=(const SmallVector &r)        { if (this != &r) assign(r.begin(), r.end()); return *this; }
+	SmallVector &operator=(const std::vector<T> &v)     { assign(v.data(), v.data() + v.size()); return *this; }
+	SmallVector &operator=(std::initializer_list<T> l)  { assign(l.begin(), l.end()); return *this; }
+	SmallVector &operator=(SmallVector &&r) noexcept
+	{
+		if (this == &r) return *this;
+		if (r.p == r.local) { assign(r.begin(), r.end()); r.n = 0; return *this; }
+		if (p != local) free(p);
+		p = r.p; n = r.n; cap = r.cap;  // steal the heap block
+		r.p = r.local; r.n = 0; r.cap = N;
+		return *this;
+	}
+	void assign(const T *b, const T *e) { assert(e <= p || b >= p + cap); n = 0; grow(e - b); memcpy(p, b, (e - b) * sizeof(T)); n = (uint32_t)(e - b); }
+
+	size_t   size()  const { return n; }
+	bool     empty() const { return n == 0; }
+	T       *data()        { return p; }
+	const T *data()  const { return p; }
+	T       *begin()       { return p; }
+	const T *begin() const { return p; }
+	T       *end()         { return p + n; }
+	const T *end()   const { return p + n; }
+	T       &operator[](size_t i)       { assert(i < n); return p[i]; }
+	const T &operator[](size_t i) const { assert(i < n); return p[i]; }
+	T       &front()       { assert(n); return p[0]; }
+	const T &front() const { assert(n); return p[0]; }
+	T       &back()        { assert(n); return p[n - 1]; }
+	const T &back()  const { assert(n); return p[n - 1]; }
+	bool operator==(const SmallVector &r) const { return n == r.n && std::equal(begin(), end(), r.begin()); }
+	bool operator!=(const SmallVector &r) const { return !(*this == r); }
+
+	void clear()                { n = 0; }
+	void reserve(size_t c)      { grow(c); }
+	void resize(size_t c)       { grow(c); for (size_t i = n; i < c; i++) p[i] = T(); n = (uint32_t)c; }
+	void push_back(const T &v)  { T t = v; grow(n + 1); p[n++] = t; }  // copy first, v could be one of ours
+	void pop_back()             { assert(n); n--; }
+	T   *insert(const T *pos, const T &v)
+	{
+		size_t i = pos - p;
+		assert(i <= n);
+		T t = v;
+		grow(n + 1);
+		memmove(p + i + 1, p + i, (n - i) * sizeof(T));
+		p[i] = t;
+		n++;
+		return p + i;
+	}
+	T   *erase(const T *first, const T *last)
+	{
+		size_t i = first - p, j = last - p;
+		assert(i <= j && j <= n);
+		memmove(p + i, p + j, (n - j) * sizeof(T));
+		n -= (uint32_t)(j - i);
+		return p + i;
+	}
+	T   *erase(const T *pos) { return erase(pos, pos + 1); }
+};
+
 struct Face : public float4 
 {
 	float4&         plane() {return *this;}  
 	const float4&   plane() const { return *this; }  // hmmmm is-a vs has-a
 	int				matid;
-	std::vector<float3>	vertex;
+	SmallVector<float3,8> vertex;  // in place up to octagons
 	float3			gu;
 	float3			gv;
 	float3			ot;
 
     Face() : matid(0) {}
     Face(const Face & r) = default;
-    Face(Face && r) : Face() { *this = std::move(r); }
+    Face(Face && r) noexcept : Face() { *this = std::move(r); }
     Face & operator = (const Face & r) = default;
-    Face & operator = (Face && r) { plane()=r.plane(); matid=r.matid; vertex=move(r.vertex); gu=r.gu; gv=r.gv; ot=r.ot; return *this; }
+    Face & operator = (Face && r) noexcept { plane()=r.plane(); matid=r.matid; vertex=std::move(r.vertex); gu=r.gu; gv=r.gv; ot=r.ot; return *this; }
 };
 
 
@@ -56,9 +152,12 @@ class BSPNode :public float4
 	int				isleaf;
 	WingMesh 		convex;    // the volume of space occupied by this node
 	std::vector<Face> brep;
+	uint64_t		id;        // never reused the way the address can be, see BSPMakeBrepLocal()
 	explicit		BSPNode(const float4 &p);
 	explicit		BSPNode(const float3 &n=float3(0,0,0),float d=0);
 					~BSPNode();
+	static void *	operator new(size_t size);  // nodes come from per thread free lists, see bsp.cpp
+	static void 	operator delete(void *p);
 };
 
 struct treetraverse  // preorder
@@ -94,7 +193,187 @@ struct treebacktofront
 	iterator end()   { iterator e; e.p = p;  return e; }
 };
 
-inline std::pair<float3, float3> Extents(const Face &face){ return Extents(face.vertex); }
+// Baked bsp for queries.
+// A BSPNode is fat (it embeds its WingMesh cell and brep) and lives wherever new put it, so walking 
+// a tree of them for a ray or sphere test is mostly cache misses.  BSPFlatten() makes a snapshot with 
+// just the planes in one array of 32 byte nodes in depth first order, so the under child of node i is 
+// always node i+1.  Leaf cells and their faces go in side tables that only get touched when needed.
+// Rebake after editing the tree.
+struct BSPFlatNode
+{
+	float4 plane;
+	int    under, over;  // child node indices
+	int    isleaf;       // 0 for internal nodes, otherwise UNDER or OVER just like BSPNode
+	int    cell;         // leaf's index into BSPFlat::convex and BSPFlat::brep, -1 for internal nodes
+};
+static_assert(sizeof(BSPFlatNode) == 32, "keep flat bsp nodes at half a cache line");
+
+struct BSPFlat
+{
+	std::vector<BSPFlatNode>       nodes;   // nodes[0] is the root
+	std::vector<WingMesh>          convex;  // per leaf
+	std::vector<std::vector<Face>> brep;    // per leaf
+	int                            depth = 0;
+};
+
+// Compiled bsp on disk, so a server can map a level instead of running BSPCompile() at startup.
+// BSPSave() writes a BSPFlat out.  BSPMap() maps the file back in and the node array is used right where 
+// it sits in the mapping, the flat queries run straight off it.  A leaf's convex and brep are only decoded the 
+// first time something asks for them (eg a cylinder hitting that solid) and then kept.
+// Layout is the header, then the BSPFlatNode array at a 32 byte aligned offset, then one {convex,brep} offset 
+// pair per leaf, then the leaf records.  All native little endian.  
+// Bump BSPFILEVERSION whenever any of this or BSPFlatNode changes, BSPMap() refuses other versions.
+#define BSPFILEVERSION (1)
+struct BSPFileHeader
+{
+	char     magic[4];    // "BSPF"
+	uint32_t version;
+	uint32_t nodecount, leafcount;
+	uint32_t depth, reserved;
+	uint64_t nodes;       // file offset of the node array
+	uint64_t leaves;      // file offset of the per leaf {convex,brep} record offsets
+	uint64_t size;        // whole file, catches truncated copies
+};
+
+class BSPMapped
+{
+  public:
+	struct Nodes  // enough like the vector in BSPFlat for the queries
+	{
+		const BSPFlatNode *p = NULL;
+		size_t             n = 0;
+		size_t size() const { return n; }
+		const BSPFlatNode &operator[](size_t i) const { assert(i < n); return p[i]; }
+	};
+	template<class T> struct Lazy  // leaf records decoded on first use, safe to hit from several query threads
+	{
+		std::function<T(int)>                decode;  // set up by BSPMap()
+		mutable std::vector<std::atomic<T*>> cache;   // once a slot is set, reading it is just a load
+		Lazy() {}
+		Lazy(const Lazy &) = delete;
+		~Lazy() { for (auto &t : cache) delete t.load(); }
+		void   resize(size_t n) { cache = std::vector<std::atomic<T*>>(n); }
+		size_t size() const { return cache.size(); }
+		const T &operator[](int i) const
+		{
+			T *t = cache[i].load(std::memory_order_acquire);
+			if (!t)  // first use, if two threads decode it at once the loser throws its copy away
+			{
+				std::unique_ptr<T> fresh(new T(decode(i)));
+				if (cache[i].compare_exchange_strong(t, fresh.get(), std::memory_order_acq_rel))
+					t = fresh.release();
+			}
+			return *t;
+		}
+	};
+	Nodes                        nodes;   // nodes[0] is the root
+	Lazy<WingMesh>               convex;  // per leaf
+	Lazy<std::vector<Face>>      brep;    // per leaf
+	int                          depth = 0;
+
+	struct Mapping;  // the os file mapping, lives in bsp.cpp
+	std::unique_ptr<Mapping> mapping;
+	BSPMapped();
+	~BSPMapped();
+};
+
+// Result of a bsp query.
+// The older HitCheck entry points report extra info through the HitCheck* globals, 
+// which is fine for one player but not when many queries run on different threads at once.
+// These versions keep everything they learn in here instead.
+// Extends the HitInfo (hit, impact, normal) used by the other ray queries in geometric.h.
+struct BSPHitInfo : public HitInfo
+{
+	BSPNode *node     = NULL;   // BSPNode queries: node whose plane was crossed into solid
+	BSPNode *leaf     = NULL;   //                  solid leaf entered
+	BSPNode *overleaf = NULL;   //                  last empty leaf before that
+	int      flatnode = -1;     // BSPFlat queries: index of node whose plane was crossed
+	int      flatleaf = -1;     //                  index of solid leaf entered
+	float    time     = 1.0f;   // convex sweeps: fraction of the motion done at first contact
+	BSPHitInfo() : HitInfo{ false, { 0, 0, 0 }, { 0, 0, 0 } } {}
+};
+
+// Solid cells near each moving body, the world geometry for physics.h FindShapeWorldContacts() and PhysicsUpdate(),
+// so a body gets tested against what's around it instead of every solid leaf in the level.
+// Cells are looked up with some margin to spare and reused until the body has moved or turned enough 
+// that something outside that could come within range.  Holds pointers into the tree, so Reset() after editing it.
+class BSPCellCache
+{
+	struct Entry
+	{
+		Pose  pose;
+		float padding = -1.0f;  // how far out cells were collected, negative when never looked up
+		std::vector<std::vector<float3> *> cells;
+	};
+	std::unordered_map<const void *, Entry> entries;
+	BSPNode *bsp;
+  public:
+	float margin = 0.25f;  // extra distance looked out each lookup, bigger means fewer lookups but more cells each
+	explicit BSPCellCache(BSPNode *bsp) : bsp(bsp) {}
+	void Reset(BSPNode *newbsp) { bsp = newbsp; entries.clear(); }
+	void Forget(const void *body) { entries.erase(body); }
+	const std::vector<std::vector<float3> *> &Cells(const void *body, const Pose &pose, float radius, float range, std::function<float3(const float3&)> support);  // radius bounds the hull around pose.position
+	template<class B> const std::vector<std::vector<float3> *> &Cells(const B *rb, float range)  // eg a physics.h RigidBody, anything with a pose, radius and shapes
+	{
+		return Cells(rb, rb->pose(), rb->radius, range, [rb](const float3 &dir) 
+		{
+			float3 d = qrot(qconj(rb->orientation), dir), best = { 0, 0, 0 };
+			float bestdot = -FLT_MAX;
+			for (auto &shape : rb->shapes) if (shape.verts.size())
+			{
+				auto &v = shape.verts[maxdir_index(shape.verts, d)];
+				if (dot(v, d) > bestdot) { bestdot = dot(v, d); best = v; }
+			}
+			return rb->position + qrot(rb->orientation, best);
+		});
+	}
+};
+
+// Visibility between empty leaves, for drawing and for deciding what each client needs to hear about.
+// Portals are the shared parts of the boundaries of neighbouring empty leaves' convex cells.  
+// The pvs row for a leaf has a bit for each leaf that might be seen from anywhere inside it, 
+// solid leaves included since those hold the brep that actually gets drawn.
+// Built offline (or after a geomod) by BSPMakeVis(), conservative:  it only ever errs toward visible.
+struct BSPPortal
+{
+	Face face;      // polygon with its plane facing into leaf 'to'
+	int  from, to;  // indices into BSPVis::leaves
+};
+struct BSPVis
+{
+	BSPNode *                        root = NULL;
+	std::vector<BSPNode *>           leaves;       // all leaves, index is the bit number in the pvs rows
+	std::unordered_map<const BSPNode *, int> leafindex;
+	std::vector<BSPPortal>           portals;      // both directions of each opening
+	std::vector<std::vector<int>>    leafportals;  // portals leading out of each leaf
+	int                              rowwords = 0; // 32 bit words per pvs row
+	std::vector<uint32_t>            pvs;          // leaves.size() rows, a solid leaf's row is all set 
+	int  Leaf(const float3 &p) const;              // index of the leaf containing p, -1 if there's no tree
+	bool Visible(int a, int b) const               { return a < 0 || b < 0 || ((pvs[a*rowwords + (b >> 5)] >> (b & 31)) & 1); }  // unknown leaf errs toward visible
+	bool Visible(const float3 &a, const float3 &b) const { return Visible(Leaf(a), Leaf(b)); }
+	template<class F> void EachVisible(int a, F f) const  // f(BSPNode *leaf) for leaves in a's row, all of them if a is -1
+	{
+		if (a < 0)
+		{
+			for (auto leaf : leaves) f(leaf);
+			return;
+		}
+		for (int w = 0; w < rowwords; w++) 
+			for (uint32_t bits = pvs[a*rowwords + w], b = w * 32; bits; bits >>= 1, b++)
+				if (bits & 1) f(leaves[b]);
+	}
+};
+
+inline std::pair<float3, float3> Extents(const Face &face)
+{
+    auto bbox = Extents(std::vector<float3>());  // initializes to empty limits
+    for (auto &v : face.vertex)
+    {
+        bbox.first  = min(v, bbox.first);
+        bbox.second = max(v, bbox.second);
+    }
+    return bbox;
+}
 inline std::pair<float3, float3> Extents(const std::vector<Face*> &faces)
 {
     auto bbox = Extents(std::vector<float3>());  // initializes to empty limits
@@ -142,6 +421,10 @@ std::unique_ptr<BSPNode> BSPDup(BSPNode *n);
 
 void     BSPDeriveConvex(BSPNode &node, WingMesh convex);
 void     BSPMakeBrep(BSPNode *r, std::vector<Face> && faces);  // only uses faces to sample for texture and material
+struct BSPTouched { uint64_t id; std::pair<float3,float3> cell; };  // leaf a merge changed, by id since it may have been freed since, and its cell's extents to find it by
+std::pair<float3,float3> BSPMakeBrepLocal(BSPNode *r, std::vector<BSPTouched> touched);  // redo brep only where these leaves changed, returns bounds of what was redone
+std::unique_ptr<BSPNode> BSPUnionLocal(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b, std::pair<float3,float3> *rebuilt=NULL);      // BSPUnion then BSPMakeBrepLocal on the leaves it changed
+std::unique_ptr<BSPNode> BSPIntersectLocal(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b, std::pair<float3,float3> *rebuilt=NULL);  // same for BSPIntersect, eg geomod blasting a hole
 std::vector<Face> BSPRipBrep(BSPNode *r);
 void     BSPTranslate(BSPNode & n,const float3 & translation);
 void     BSPRotate(BSPNode & n, const float4 & rotation);
@@ -161,16 +444,43 @@ int      HitCheckConvex(std::vector<float3> &verts,BSPNode *node,int solid,
 int HitCheckConvexGJKm(std::function<float3(const float3&)> support_map_function, BSPNode *bsp);
 template<class T> int HitCheckConvexGJK(T collidable, BSPNode *bsp) {return HitCheckConvexGJKm(SupportPointFunc<T>(collidable), bsp); }
 int      HitCheckSphere(float r, BSPNode *node, int solid, float3 v0, float3 v1, float3 *impact, const float3 &nv0);
+BSPFlat  BSPFlatten(BSPNode *root);
+int      BSPSave(const BSPFlat &flat, const char *filename);  // returns 0 if the file couldnt be written
+std::unique_ptr<BSPMapped> BSPMap(const char *filename);     // NULL if missing, truncated, or an older BSPFILEVERSION
+int      HitCheck(const BSPFlat &bsp,int solid,float3 v0,float3 v1,float3 *impact);
+int      HitCheckSolidReEnter(const BSPFlat &bsp,float3 v0,float3 v1,float3 *impact);
+int      HitCheckSphere(float r, const BSPFlat &bsp, int solid, float3 v0, float3 v1, float3 *impact, const float3 &nv0);
+int      HitCheckCylinder(float r,float h,const BSPFlat &bsp,int solid,float3 v0,float3 v1,float3 *impact,const float3 &nv0);
+BSPHitInfo  HitCheck(BSPNode *bsp, const float3 &v0, const float3 &v1, int reenter = 0);  // reenter: dont stop in solid at v0
+BSPHitInfo  HitCheck(const BSPFlat &bsp, const float3 &v0, const float3 &v1, int reenter = 0);
+BSPHitInfo  HitCheckSphere(float r, const BSPFlat &bsp, const float3 &v0, const float3 &v1, const float3 &nv0 = float3(0, 0, 0));
+BSPHitInfo  HitCheckCylinder(float r, float h, const BSPFlat &bsp, const float3 &v0, const float3 &v1, const float3 &nv0 = float3(0, 0, 0));
+void     HitCheckPacket(const BSPFlat &bsp, const std::pair<float3, float3> *segments, int count, BSPHitInfo *results);  // up to 4 segments traced together with sse, same results as HitCheck() on each
+BSPHitInfo  HitCheck(const BSPMapped &bsp, const float3 &v0, const float3 &v1, int reenter = 0);  // same queries off a mapped file, flatnode/flatleaf index the mapped nodes
+BSPHitInfo  HitCheckSphere(float r, const BSPMapped &bsp, const float3 &v0, const float3 &v1, const float3 &nv0 = float3(0, 0, 0));
+BSPHitInfo  HitCheckCylinder(float r, float h, const BSPMapped &bsp, const float3 &v0, const float3 &v1, const float3 &nv0 = float3(0, 0, 0));
+void     HitCheckPacket(const BSPMapped &bsp, const std::pair<float3, float3> *segments, int count, BSPHitInfo *results);
+BSPHitInfo  HitCheckConvexSweep(std::function<float3(const float3&)> support, const BSPFlat &bsp, const float3 &motion);  // hull given by its support function moved by motion, impact is the contact point
+BSPHitInfo  HitCheckConvexSweep(std::function<float3(const float3&)> support, const BSPMapped &bsp, const float3 &motion);
+std::vector<BSPHitInfo> HitCheckBatch(BSPNode *bsp, const std::vector<std::pair<float3, float3>> &segments);  // result[i] for segments[i], spread over all cores
+std::vector<BSPHitInfo> HitCheckBatch(const BSPFlat &bsp, const std::vector<std::pair<float3, float3>> &segments);
+std::vector<BSPHitInfo> HitCheckCylinderBatch(float r, float h, const BSPFlat &bsp, const std::vector<std::pair<float3, float3>> &segments);
+std::vector<BSPHitInfo> HitCheckBatch(const BSPMapped &bsp, const std::vector<std::pair<float3, float3>> &segments);
+std::vector<BSPHitInfo> HitCheckCylinderBatch(float r, float h, const BSPMapped &bsp, const std::vector<std::pair<float3, float3>> &segments);
 int      ConvexHitCheck(WingMesh *convex,float3 v0,float3 v1,float3 *impact); 
-std::vector<WingMesh*> ProximityCellsm(std::function<float3(const float3&)> support_map_function, BSPNode *bsp, float padding = 0.0f);
+std::vector<WingMesh*> ProximityCellsm(std::function<float3(const float3&)> support_map_function, BSPNode *bsp, float padding = 0.0f);  // solid leaf cells within padding of the hull
 template<class T> std::vector<WingMesh*> ProximityCells(T collidable, BSPNode *bsp, float padding = 0.0f) { return ProximityCellsm(SupportPointFunc<T>(collidable), bsp, padding); }
 std::vector<WingMesh*> BSPGetSolids(BSPNode *bsp);
+BSPVis   BSPMakeVis(BSPNode *root);  // portals and pvs, uses all cores.  Holds pointers into the tree, so remake after editing it
 void     BSPPartition(BSPNode *n, const float4 &p, BSPNode * &nodeunder, BSPNode * &nodeover);
 int      BSPCount(BSPNode *n);
+int      BSPNodePoolRelease();  // node pool memory back to the heap, returns chunks freed.  Does nothing, returns 0, while any nodes exist or another thread is making or freeing one.
 int      BSPFinite(BSPNode *bsp);
 inline int maxdir(const std::vector<float3> &a,const float3 &dir) {return maxdir(a.data(),a.size(),dir);}
+template<int N> int maxdir(const SmallVector<float3,N> &a,const float3 &dir) {return maxdir(a.data(),a.size(),dir);}
 
-extern int bspnodecount;  // just a running count of all nodes created, for monitoring purposes
+extern std::atomic<int> bspnodecount;  // just a running count of all nodes created, for monitoring purposes
+extern size_t hitcheckbatchgrain;      // min segments per thread in HitCheckBatch
 
 
 #endif
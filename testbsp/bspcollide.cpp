@@ -9,6 +9,9 @@
 
 
 #include "bsp.h"
+#include "gjk.h"
+#include <future>
+#include <thread>
 
 
 
@@ -17,6 +20,7 @@ int      HitCheckVertexHit;     // global variable storing the vertex id of the
 BSPNode *HitCheckNodeHitLeaf=NULL; // global variable storing the BSP node leaf hit.
 BSPNode *HitCheckNodeHitOverLeaf=NULL; // global variable storing the BSP over leaf node that was just beforehit.
 BSPNode *HitCheckNode=NULL; // global variable storing the BSP node plane hit.
+size_t   hitcheckbatchgrain=256;  // HitCheckBatch wont give a thread fewer segments than this
 
 
 int PointInsideFace(const Face & f,const float3 &s)
@@ -61,17 +65,18 @@ Face* FaceHit(const float3& s)
 	return FaceHit(leaf,plane,s);
 }
 
-static int bypass_first_solid=0;  // put into hitinfo
-int HitCheck(BSPNode *node,int solid,float3 v0,float3 v1,float3 *impact) {
+// The query state lives in a BSPHitInfo and the bypass flag is passed along, so these can run on any number of threads at once.  
+// The old entry points below just copy the BSPHitInfo out to the HitCheck* globals afterwards.
+static int HitCheck(BSPNode *node,float3 v0,float3 v1,BSPHitInfo &hitinfo,int &bypass_first_solid) {
 	assert(node);
 	if(node->isleaf ){
 		if(node->isleaf==UNDER ){
-			HitCheckNodeHitLeaf=node;
-			if(impact) *impact = v0;
+			hitinfo.leaf=node;
+			hitinfo.impact = v0;
 		}
 		else
 		{
-			HitCheckNodeHitOverLeaf = node;
+			hitinfo.overleaf = node;
 			bypass_first_solid=0;
 		}
 		return (node->isleaf==UNDER  && !bypass_first_solid );
@@ -79,37 +84,58 @@ int HitCheck(BSPNode *node,int solid,float3 v0,float3 v1,float3 *impact) {
 	int f0 = (dot(v0,node->xyz())+node->w>0)?1:0;  // if v0 above plane
 	int f1 = (dot(v1, node->xyz()) + node->w>0) ? 1 : 0;  // if v1 above plane
 	if(f0==0 && f1==0) {
-		return HitCheck(node->under.get(),1,v0,v1,impact);
+		return HitCheck(node->under.get(),v0,v1,hitinfo,bypass_first_solid);
 	}
 	if(f0==1 && f1==1) {
-		return HitCheck(node->over.get(),0,v0,v1,impact);
+		return HitCheck(node->over.get(),v0,v1,hitinfo,bypass_first_solid);
 	}
 	float3 vmid = PlaneLineIntersection(*node,v0,v1);
 	if(f0==0) {
 		assert(f1==1);
-		// perhaps we could pass 'solid' instead of '1' here:
-		if(HitCheck(node->under.get(),1,v0,vmid,impact)) {
+		if(HitCheck(node->under.get(),v0,vmid,hitinfo,bypass_first_solid)) {
 			return 1;
 		}
-		HitCheckImpactNormal = -node->xyz();
-		HitCheckNode = node;
-		return HitCheck(node->over.get(),0,vmid,v1,impact);
+		hitinfo.normal = -node->xyz();
+		hitinfo.node = node;
+		return HitCheck(node->over.get(),vmid,v1,hitinfo,bypass_first_solid);
 	}
 	assert(f0==1 && f1==0);
-	if(HitCheck(node->over.get(),0,v0,vmid,impact)) {
+	if(HitCheck(node->over.get(),v0,vmid,hitinfo,bypass_first_solid)) {
 		return 1;
 	}
-	HitCheckImpactNormal = node->xyz();
-	HitCheckNode = node;
-	return HitCheck(node->under.get(),1,vmid,v1,impact);
+	hitinfo.normal = node->xyz();
+	hitinfo.node = node;
+	return HitCheck(node->under.get(),vmid,v1,hitinfo,bypass_first_solid);
+}
+
+BSPHitInfo HitCheck(BSPNode *bsp,const float3 &v0,const float3 &v1,int reenter)
+{
+	BSPHitInfo hitinfo;
+	int bypass_first_solid = reenter;
+	hitinfo.hit = HitCheck(bsp,v0,v1,hitinfo,bypass_first_solid);
+	return hitinfo;
+}
+
+static int HitCheckGlobals(const BSPHitInfo &hitinfo,float3 *impact)  // for the original interface
+{
+	if(hitinfo.leaf || hitinfo.flatleaf>=0) {
+		if(hitinfo.leaf) HitCheckNodeHitLeaf = hitinfo.leaf;
+		if(impact) *impact = hitinfo.impact;
+	}
+	if(hitinfo.overleaf) HitCheckNodeHitOverLeaf = hitinfo.overleaf;
+	if(hitinfo.node) HitCheckNode = hitinfo.node;
+	if(hitinfo.node || hitinfo.flatnode>=0) HitCheckImpactNormal = hitinfo.normal;
+	return hitinfo.hit;
+}
+
+int HitCheck(BSPNode *node,int solid,float3 v0,float3 v1,float3 *impact) 
+{
+	return HitCheckGlobals(HitCheck(node,v0,v1,0),impact);
 }
 
 int HitCheckSolidReEnter(BSPNode *node,float3 v0,float3 v1,float3 *impact) 
 {
-	bypass_first_solid =1;
-	int	h=HitCheck(node,1,v0,v1,impact);
-	bypass_first_solid =0; // make sure you turn this back off in case the query never hit empty space.
-	return h;
+	return HitCheckGlobals(HitCheck(node,v0,v1,1),impact);
 }
 
 
@@ -195,7 +221,7 @@ float3 TangentPointOnCylinder(const float r,const float h,const float3 &n) {
 int usebevels=1;
 
 // hmmm this isn't working right now for some reason:
-int HitCheckBevelsCylinder(float r,float h,WingMesh *convex,float3 v0,float3 v1,float3 *impact,float3 nv0) 
+int HitCheckBevelsCylinder(float r,float h,WingMesh *convex,float3 v0,float3 v1,float3 *impact,float3 nv0,float3 *normal) 
 {
     if (!convex || !convex->edges.size())
 	{
@@ -224,7 +250,7 @@ int HitCheckBevelsCylinder(float r,float h,WingMesh *convex,float3 v0,float3 v1,
 		}
 	}
 	*impact = v0;
-	HitCheckImpactNormal = nv0;
+	*normal = nv0;
 	return 1;
 }
 
@@ -235,7 +261,7 @@ int HitCheckCylinder(float r,float h,BSPNode *node,int solid,float3 v0,float3 v1
 	if(node->isleaf )
 	{
 		if(usebevels && node->isleaf==UNDER) {
-			return HitCheckBevelsCylinder(r,h,&node->convex,v0,v1,impact,nv0);
+			return HitCheckBevelsCylinder(r,h,&node->convex,v0,v1,impact,nv0,&HitCheckImpactNormal);
 		}
 		if(node->isleaf==UNDER){
 			if(impact) *impact = v0;
@@ -261,6 +287,436 @@ int HitCheckCylinder(float r,float h,BSPNode *node,int solid,float3 v0,float3 v1
 	return hit;
 }
 
+
+// The same queries against a baked BSPFlat, or a BSPMapped file which looks the same to these.
+// Only the 32 byte nodes get touched until a leaf needs its cell.  Results match the BSPNode versions above.
+
+template<class FLAT> static BSPHitInfo HitCheckFlat(const FLAT &bsp,const float3 &v0_,const float3 &v1_,int reenter)
+{
+	struct Far { int node, split; float3 v0, v1, normal; };  // far side of a split segment, only visited if the near side didn't hit
+	static thread_local std::vector<Far> stack;       // no recursion, and stops allocating once its grown to the tree depth
+	BSPHitInfo hitinfo;
+	if(!bsp.nodes.size()) return hitinfo;
+	stack.clear();
+	float3 v0=v0_, v1=v1_;
+	int bypass_first_solid=reenter;
+	int i=0;
+	for(;;)
+	{
+		const BSPFlatNode *n = &bsp.nodes[i];
+		while(!n->isleaf) {
+			int f0 = (dot(v0,n->plane.xyz())+n->plane.w>0)?1:0;  // if v0 above plane
+			int f1 = (dot(v1,n->plane.xyz())+n->plane.w>0)?1:0;  // if v1 above plane
+			if(f0!=f1) {
+				float3 vmid = PlaneLineIntersection(n->plane,v0,v1);
+				stack.push_back({ f0 ? n->under : n->over, i, vmid, v1, f0 ? n->plane.xyz() : -n->plane.xyz() });
+				v1 = vmid;
+			}
+			i = f0 ? n->over : n->under;
+			n = &bsp.nodes[i];
+		}
+		if(n->isleaf==UNDER) {
+			hitinfo.flatleaf = i;
+			hitinfo.impact = v0;
+			if(!bypass_first_solid) {
+				hitinfo.hit = 1;
+				return hitinfo;
+			}
+		}
+		else {
+			bypass_first_solid=0;
+		}
+		if(!stack.size()) return hitinfo;
+		i  = stack.back().node;
+		v0 = stack.back().v0;
+		v1 = stack.back().v1;
+		hitinfo.normal   = stack.back().normal;
+		hitinfo.flatnode = stack.back().split;
+		stack.pop_back();
+	}
+}
+
+BSPHitInfo HitCheck(const BSPFlat &bsp,const float3 &v0,const float3 &v1,int reenter)   { return HitCheckFlat(bsp,v0,v1,reenter); }
+BSPHitInfo HitCheck(const BSPMapped &bsp,const float3 &v0,const float3 &v1,int reenter) { return HitCheckFlat(bsp,v0,v1,reenter); }
+
+int HitCheck(const BSPFlat &bsp,int solid,float3 v0,float3 v1,float3 *impact)
+{
+	return HitCheckGlobals(HitCheck(bsp,v0,v1,0),impact);
+}
+
+int HitCheckSolidReEnter(const BSPFlat &bsp,float3 v0,float3 v1,float3 *impact)
+{
+	return HitCheckGlobals(HitCheck(bsp,v0,v1,1),impact);
+}
+
+// Swept volume version.  Both sides of a node can be visited, and a hit on the under side shortens the 
+// segment tested against the over side, so this one just recurses like the BSPNode version does.
+template<class FLAT,class OFFSET,class LEAF>
+static int HitCheckSweptFlat(const FLAT &bsp,int node,float3 v0,float3 v1,float3 *impact,const float3 &nv0,const OFFSET &offset,const LEAF &leafhit)
+{
+	const BSPFlatNode &n = bsp.nodes[node];
+	if(n.isleaf) {
+		return leafhit(node,v0,v1,nv0,impact);
+	}
+	float3 w0,w1,nw0;
+	int hit=0;
+	if(SegmentUnder(float4(n.plane.xyz(),n.plane.w+offset(n.plane,0)),v0,v1,nv0,&w0,&w1,&nw0)) {  // plane shifted by the swept shape's extent
+		hit |= HitCheckSweptFlat(bsp,n.under,w0,w1,&v1,nw0,offset,leafhit);
+	}
+	if(SegmentOver( float4(n.plane.xyz(),n.plane.w+offset(n.plane,1)),v0,v1,nv0,&w0,&w1,&nw0)) {
+		hit |= HitCheckSweptFlat(bsp,n.over,w0,w1,&v1,nw0,offset,leafhit);
+	}
+	if(hit && impact) {
+		*impact = v1;
+	}
+	return hit;
+}
+
+template<class FLAT> static BSPHitInfo HitCheckSphereFlat(float r,const FLAT &bsp,const float3 &v0,const float3 &v1,const float3 &nv0)
+{
+	BSPHitInfo hitinfo;
+	if(!bsp.nodes.size()) return hitinfo;
+	hitinfo.hit = HitCheckSweptFlat(bsp,0,v0,v1,&hitinfo.impact,nv0,
+		[r](const float4 &,int side) { return side ? r : -r; },
+		[&bsp,&hitinfo](int leaf,const float3 &v0,const float3 &,const float3 &nv0,float3 *impact) {
+			if(bsp.nodes[leaf].isleaf!=UNDER) return 0;
+			*impact = v0;
+			hitinfo.normal = nv0;
+			hitinfo.flatleaf = leaf;
+			return 1;
+		});
+	return hitinfo;
+}
+
+template<class FLAT> static BSPHitInfo HitCheckCylinderFlat(float r,float h,const FLAT &bsp,const float3 &v0,const float3 &v1,const float3 &nv0)
+{
+	BSPHitInfo hitinfo;
+	if(!bsp.nodes.size()) return hitinfo;
+	hitinfo.hit = HitCheckSweptFlat(bsp,0,v0,v1,&hitinfo.impact,nv0,
+		[r,h](const float4 &plane,int side) { return side ? dot(TangentPointOnCylinder(r,h,plane.xyz()),plane.xyz()) : -dot(TangentPointOnCylinder(r,h,-plane.xyz()),-plane.xyz()); },
+		[r,h,&bsp,&hitinfo](int leaf,const float3 &v0,const float3 &v1,const float3 &nv0,float3 *impact) {
+			const BSPFlatNode &n = bsp.nodes[leaf];
+			if(n.isleaf!=UNDER) return 0;
+			if(usebevels && !HitCheckBevelsCylinder(r,h,const_cast<WingMesh*>(&bsp.convex[n.cell]),v0,v1,impact,nv0,&hitinfo.normal))
+				return 0;
+			if(!usebevels) {
+				*impact = v0;
+				hitinfo.normal = nv0;
+			}
+			hitinfo.flatleaf = leaf;
+			return 1;
+		});
+	return hitinfo;
+}
+
+BSPHitInfo HitCheckSphere(float r,const BSPFlat &bsp,const float3 &v0,const float3 &v1,const float3 &nv0)   { return HitCheckSphereFlat(r,bsp,v0,v1,nv0); }
+BSPHitInfo HitCheckSphere(float r,const BSPMapped &bsp,const float3 &v0,const float3 &v1,const float3 &nv0) { return HitCheckSphereFlat(r,bsp,v0,v1,nv0); }
+BSPHitInfo HitCheckCylinder(float r,float h,const BSPFlat &bsp,const float3 &v0,const float3 &v1,const float3 &nv0)   { return HitCheckCylinderFlat(r,h,bsp,v0,v1,nv0); }
+BSPHitInfo HitCheckCylinder(float r,float h,const BSPMapped &bsp,const float3 &v0,const float3 &v1,const float3 &nv0) { return HitCheckCylinderFlat(r,h,bsp,v0,v1,nv0); }
+
+int HitCheckSphere(float r,const BSPFlat &bsp,int solid,float3 v0,float3 v1,float3 *impact,const float3 &nv0)
+{
+	BSPHitInfo hitinfo = HitCheckSphere(r,bsp,v0,v1,nv0);
+	if(hitinfo) {
+		if(impact) *impact = hitinfo.impact;
+		HitCheckImpactNormal = hitinfo.normal;
+	}
+	return hitinfo.hit;
+}
+
+int HitCheckCylinder(float r,float h,const BSPFlat &bsp,int solid,float3 v0,float3 v1,float3 *impact,const float3 &nv0)
+{
+	BSPHitInfo hitinfo = HitCheckCylinder(r,h,bsp,v0,v1,nv0);
+	if(hitinfo) {
+		if(impact) *impact = hitinfo.impact;
+		HitCheckImpactNormal = hitinfo.normal;
+	}
+	return hitinfo.hit;
+}
+
+// Swept convex hulls, anything with a support function, eg a player's or a vehicle's collision hull.
+// Walks the flat tree without recursion, only going down the side(s) of a plane the swept hull reaches,  
+// and gjk Sweep()s the hull against the cell of each solid leaf it gets to.  Nearer side first, and the 
+// motion used for culling is cut back to the earliest hit so far, so farther leaves mostly get skipped.
+typedef std::function<float3(const float3&)> SupportFunction;
+float sweeptolerance = PAPERWIDTH*10;  // how far from touching still counts as a contact
+
+// Sweep() only gives up (flags failed) when its starting simplex is flat.  Then advance the hull by its gjk 
+// distance over the closing speed until it touches, moves away, or gets past the end of the motion.  Each step
+// is at least sweeptolerance/|motion| so that ends too.
+static gjk_implementation::Contact SweepCell(const SupportFunction &a,const SupportFunction &b,const float3 &motion)
+{
+	auto c = gjk_implementation::Sweep(a,b,motion);
+	if(!c.failed) 
+		return c;
+	auto moved = [&a,&motion](float t) { float3 offset = motion*t; return SupportFunction([&a,offset](const float3 &dir) { return a(dir)+offset; }); };
+	for(float t=0.0f; t<=1.0f; ) {
+		auto d = Separated(moved(t),b,1);
+		if(d.separation < sweeptolerance) {
+			d.time = t;
+			d.separation = std::min(d.separation,0.0f);  // so it tests as a hit
+			return d;
+		}
+		float closing = -dot(d.normal,motion);
+		if(closing <= 0.0f)
+			break;  // not approaching, so it never will
+		t += d.separation/closing;
+	}
+	return gjk_implementation::Contact();
+}
+
+template<class FLAT> static BSPHitInfo HitCheckConvexSweepFlat(SupportFunction support,const FLAT &bsp,const float3 &motion)
+{
+	static thread_local std::vector<int> stack;
+	BSPHitInfo hitinfo;
+	if(!bsp.nodes.size()) return hitinfo;
+	stack.clear();
+	stack.push_back(0);
+	while(stack.size())
+	{
+		int i = stack.back();
+		stack.pop_back();
+		const BSPFlatNode &n = bsp.nodes[i];
+		float3 reach = motion * hitinfo.time;  // no point looking past the best hit so far
+		if(n.isleaf) {
+			if(n.isleaf!=UNDER) continue;
+			const WingMesh &cell = bsp.convex[n.cell];
+			if(!cell.verts.size()) continue;
+			SupportFunction cellsupport = [&cell](const float3 &dir) { return cell.verts[maxdir(cell.verts,dir)]; };
+			gjk_implementation::Contact c;
+			if(dot(reach,reach) > 0.0f) {
+				c = SweepCell(support,cellsupport,reach);
+			}
+			else {
+				c = Separated(support,cellsupport,0);
+				c.time = 0.0f;
+			}
+			if(!c || (hitinfo.hit && c.time >= 1.0f)) continue;  // missed, or no sooner than what we have
+			hitinfo.hit      = true;
+			hitinfo.time     = c.time * hitinfo.time;
+			hitinfo.impact   = c.impact;
+			hitinfo.normal   = c.normal;
+			hitinfo.flatleaf = i;
+			if(hitinfo.time==0.0f) break;  // cant do better than that
+			continue;
+		}
+		float lo = dot(n.plane.xyz(),support(-n.plane.xyz())) + std::min(0.0f,dot(n.plane.xyz(),reach)) + n.plane.w;
+		float hi = dot(n.plane.xyz(),support( n.plane.xyz())) + std::max(0.0f,dot(n.plane.xyz(),reach)) + n.plane.w;
+		int movingover = dot(n.plane.xyz(),motion) > 0;  // then the under side is nearer, so it goes on the stack last
+		if(movingover ? hi > -PAPERWIDTH : lo < PAPERWIDTH) stack.push_back(movingover ? n.over : n.under);
+		if(movingover ? lo < PAPERWIDTH : hi > -PAPERWIDTH) stack.push_back(movingover ? n.under : n.over);
+	}
+	return hitinfo;
+}
+
+BSPHitInfo HitCheckConvexSweep(SupportFunction support,const BSPFlat &bsp,const float3 &motion)   { return HitCheckConvexSweepFlat(support,bsp,motion); }
+BSPHitInfo HitCheckConvexSweep(SupportFunction support,const BSPMapped &bsp,const float3 &motion) { return HitCheckConvexSweepFlat(support,bsp,motion); }
+
+// Same plane culling as the sweep, padding instead of motion, and just collecting the solid cells.
+// Cost goes with the depth of the tree and the cells nearby, not the size of the level.
+std::vector<WingMesh*> ProximityCellsm(SupportFunction support,BSPNode *bsp,float padding)
+{
+	static thread_local std::vector<BSPNode*> stack;
+	std::vector<WingMesh*> cells;
+	stack.clear();
+	stack.push_back(bsp);
+	while(stack.size())
+	{
+		BSPNode *n = stack.back();
+		stack.pop_back();
+		if(!n) continue;
+		if(n->isleaf) {
+			if(n->isleaf==UNDER && n->convex.verts.size()) cells.push_back(&n->convex);
+			continue;
+		}
+		if(dot(n->xyz(),support(-n->xyz())) + n->w <  padding) stack.push_back(n->under.get());
+		if(dot(n->xyz(),support( n->xyz())) + n->w > -padding) stack.push_back(n->over.get());
+	}
+	return cells;
+}
+
+// Cells got collected out to padding from where the body was.  Nothing on the body has moved farther than 
+// the distance its center moved plus radius times the angle turned, so while that plus range stays 
+// within the padding, anything in range now was in range then.
+const std::vector<std::vector<float3>*> &BSPCellCache::Cells(const void *body,const Pose &pose,float radius,float range,SupportFunction support)
+{
+	Entry &e = entries[body];
+	float turned = 2.0f*acosf(std::min(1.0f,fabsf(dot(pose.orientation,e.pose.orientation))));
+	float moved  = length(pose.position-e.pose.position) + radius*turned;
+	if(e.padding >= 0.0f && moved + range <= e.padding)
+		return e.cells;
+	e.pose    = pose;
+	e.padding = range + margin;
+	e.cells.clear();
+	for(auto cell : ProximityCellsm(support,bsp,e.padding))
+		e.cells.push_back(&cell->verts);
+	return e.cells;
+}
+
+// Packets of segments.
+// Sight checks, visibility fans and lightmap sample rays come in bunches that mostly take the same 
+// path through the tree, so trace 4 at once, one per SSE lane.  Each node plane gets classified against 
+// all 4 segments together, and lanes that don't want to go somewhere are just masked off.
+// Each lane still visits leaves in the same near-to-far order the one segment HitCheck() does, and the 
+// math is done in the same order, so results are identical to calling HitCheck() on each segment.
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE__)
+
+struct Packet4 { __m128 x0, y0, z0, x1, y1, z1; };  // segments as SoA, lane i is segment i
+struct PacketHits4 { __m128 x, y, z, leaf, plane; };  // impact, solid leaf, and which node's plane and which side (as +-(node+1)), per lane
+
+static inline __m128 LaneMask(int lanes)  // 4 bit lane mask to all-ones float lanes
+{
+	static const struct Masks { uint32_t m[16][4]; Masks() { for(int i=0;i<16;i++) for(int j=0;j<4;j++) m[i][j] = (i&(1<<j)) ? ~0u : 0u; } } masks;
+	return _mm_loadu_ps((const float*)masks.m[lanes]);
+}
+static inline __m128 Select(__m128 mask,__m128 a,__m128 b) { return _mm_or_ps(_mm_and_ps(mask,a),_mm_andnot_ps(mask,b)); }
+
+template<class FLAT> static int HitCheckPacket(const FLAT &bsp,int i,int active,const Packet4 &p,int &bypass_first_solid,PacketHits4 &hits)
+{
+	for(;;)  // walk down while all the lanes agree, which is most of the time for coherent segments
+	{
+		const BSPFlatNode &n = bsp.nodes[i];
+		if(n.isleaf) {
+			if(n.isleaf==OVER) {
+				bypass_first_solid &= ~active;
+				return 0;
+			}
+			__m128 m = LaneMask(active);
+			hits.x    = Select(m,p.x0,hits.x);
+			hits.y    = Select(m,p.y0,hits.y);
+			hits.z    = Select(m,p.z0,hits.z);
+			hits.leaf = Select(m,_mm_set1_ps((float)i),hits.leaf);
+			return active & ~bypass_first_solid;
+		}
+		__m128 nx = _mm_set1_ps(n.plane.x), ny = _mm_set1_ps(n.plane.y), nz = _mm_set1_ps(n.plane.z), w = _mm_set1_ps(n.plane.w);
+		__m128 dot0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p.x0,nx),_mm_mul_ps(p.y0,ny)),_mm_mul_ps(p.z0,nz));
+		__m128 dot1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(p.x1,nx),_mm_mul_ps(p.y1,ny)),_mm_mul_ps(p.z1,nz));
+		int f0 = _mm_movemask_ps(_mm_cmpgt_ps(_mm_add_ps(dot0,w),_mm_setzero_ps())) & active;  // lanes with v0 above plane
+		int f1 = _mm_movemask_ps(_mm_cmpgt_ps(_mm_add_ps(dot1,w),_mm_setzero_ps())) & active;  // lanes with v1 above plane
+		if(f0==f1 && (f0==0 || f0==active)) {
+			i = f0 ? n.over : n.under;
+			continue;
+		}
+		int split = f0^f1;
+		Packet4 pnear = p, pfar = p;
+		if(split) {  // PlaneLineIntersection() for each lane
+			__m128 dx = _mm_sub_ps(p.x1,p.x0), dy = _mm_sub_ps(p.y1,p.y0), dz = _mm_sub_ps(p.z1,p.z0);
+			__m128 dn = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx,dx),_mm_mul_ps(ny,dy)),_mm_mul_ps(nz,dz));
+			__m128 t  = _mm_xor_ps(_mm_div_ps(_mm_add_ps(w,dot0),dn),_mm_set1_ps(-0.0f));
+			__m128 m  = LaneMask(split);
+			pfar.x0 = _mm_add_ps(p.x0,_mm_mul_ps(dx,t));
+			pfar.y0 = _mm_add_ps(p.y0,_mm_mul_ps(dy,t));
+			pfar.z0 = _mm_add_ps(p.z0,_mm_mul_ps(dz,t));
+			pnear.x1 = Select(m,pfar.x0,p.x1);
+			pnear.y1 = Select(m,pfar.y0,p.y1);
+			pnear.z1 = Select(m,pfar.z0,p.z1);
+		}
+		int hit = 0;
+		for(int side=1;side>=0;side--) {  // lanes starting over the plane, then those starting under, each group near side first
+			int group = (side ? f0 : ~f0) & active;
+			if(!group) continue;
+			hit |= HitCheckPacket(bsp,side ? n.over : n.under,group,pnear,bypass_first_solid,hits);
+			int farlanes = group & split & ~hit;
+			if(!farlanes) continue;
+			hits.plane = Select(LaneMask(farlanes),_mm_set1_ps(side ? i+1.0f : -(i+1.0f)),hits.plane);
+			hit |= HitCheckPacket(bsp,side ? n.under : n.over,farlanes,pfar,bypass_first_solid,hits);
+		}
+		return hit;
+	}
+}
+
+template<class FLAT> static void HitCheckPacketFlat(const FLAT &bsp,const std::pair<float3,float3> *segments,int count,BSPHitInfo *results)
+{
+	assert(count>=0 && count<=4);
+	for(int k=0;k<count;k++) results[k] = BSPHitInfo();
+	if(!bsp.nodes.size() || !count) return;
+	float s[6][4] = {};
+	for(int k=0;k<count;k++) {
+		s[0][k]=segments[k].first.x;  s[1][k]=segments[k].first.y;  s[2][k]=segments[k].first.z;
+		s[3][k]=segments[k].second.x; s[4][k]=segments[k].second.y; s[5][k]=segments[k].second.z;
+	}
+	Packet4 p = { _mm_loadu_ps(s[0]),_mm_loadu_ps(s[1]),_mm_loadu_ps(s[2]),_mm_loadu_ps(s[3]),_mm_loadu_ps(s[4]),_mm_loadu_ps(s[5]) };
+	PacketHits4 hits = { _mm_setzero_ps(),_mm_setzero_ps(),_mm_setzero_ps(),_mm_set1_ps(-1.0f),_mm_setzero_ps() };
+	int bypass_first_solid = 0;
+	int hit = HitCheckPacket(bsp,0,(1<<count)-1,p,bypass_first_solid,hits);
+	float h[5][4];
+	_mm_storeu_ps(h[0],hits.x); _mm_storeu_ps(h[1],hits.y); _mm_storeu_ps(h[2],hits.z); _mm_storeu_ps(h[3],hits.leaf); _mm_storeu_ps(h[4],hits.plane);
+	for(int k=0;k<count;k++) {
+		BSPHitInfo &r = results[k];
+		r.hit      = ((hit>>k)&1)!=0;
+		r.impact   = float3(h[0][k],h[1][k],h[2][k]);
+		r.flatleaf = (int)h[3][k];
+		if(h[4][k]!=0) {
+			r.flatnode = (int)fabsf(h[4][k])-1;
+			r.normal   = (h[4][k]>0) ? bsp.nodes[r.flatnode].plane.xyz() : -bsp.nodes[r.flatnode].plane.xyz();
+		}
+	}
+}
+
+#else
+
+template<class FLAT> static void HitCheckPacketFlat(const FLAT &bsp,const std::pair<float3,float3> *segments,int count,BSPHitInfo *results)
+{
+	for(int k=0;k<count;k++)
+		results[k] = HitCheck(bsp,segments[k].first,segments[k].second);
+}
+
+#endif
+
+void HitCheckPacket(const BSPFlat &bsp,const std::pair<float3,float3> *segments,int count,BSPHitInfo *results)   { HitCheckPacketFlat(bsp,segments,count,results); }
+void HitCheckPacket(const BSPMapped &bsp,const std::pair<float3,float3> *segments,int count,BSPHitInfo *results) { HitCheckPacketFlat(bsp,segments,count,results); }
+
+// Lots of independent traces, eg all the players and bots on a server for one tick.
+// Splits the list over the available cores, each result lands in the same slot as its segment.
+// The trace function does a contiguous run of segments, so it can be a packet traversal.
+// For BSPFlat, consecutive segments go in the same packet, so keep the rays of a fan or sight 
+// checks from the same eye next to each other in the list.  Unrelated segments in one packet 
+// diverge right away and end up a bit slower than tracing them one at a time.
+template<class T> static std::vector<BSPHitInfo> HitCheckBatch(const std::vector<std::pair<float3,float3>> &segments,T trace)
+{
+	std::vector<BSPHitInfo> results(segments.size());
+	auto range = [&](size_t begin,size_t end) { trace(segments.data()+begin,end-begin,results.data()+begin); };
+	size_t threads = std::max(1u,std::thread::hardware_concurrency());
+	threads = std::min(threads, (segments.size()+hitcheckbatchgrain-1)/hitcheckbatchgrain);
+	std::vector<std::future<void>> tasks;
+	for(size_t t=1;t<threads;t++)
+		tasks.push_back(std::async(std::launch::async,range,segments.size()*t/threads,segments.size()*(t+1)/threads));
+	range(0,threads?segments.size()/threads:0);
+	for(auto &t : tasks) t.get();
+	return results;
+}
+template<class Q> static std::function<void(const std::pair<float3,float3>*,size_t,BSPHitInfo*)> EachSegment(Q query)
+{
+	return [query](const std::pair<float3,float3> *segments,size_t count,BSPHitInfo *results) { for(size_t i=0;i<count;i++) results[i] = query(segments[i].first,segments[i].second); };
+}
+template<class FLAT> static std::function<void(const std::pair<float3,float3>*,size_t,BSPHitInfo*)> EachPacket(const FLAT &bsp)
+{
+	return [&bsp](const std::pair<float3,float3> *segments,size_t count,BSPHitInfo *results) {
+		for(size_t i=0;i<count;i+=4)
+			HitCheckPacketFlat(bsp,segments+i,(int)std::min<size_t>(4,count-i),results+i);
+	};
+}
+std::vector<BSPHitInfo> HitCheckBatch(const BSPFlat &bsp,const std::vector<std::pair<float3,float3>> &segments)
+{
+	return HitCheckBatch(segments,EachPacket(bsp));
+}
+std::vector<BSPHitInfo> HitCheckBatch(const BSPMapped &bsp,const std::vector<std::pair<float3,float3>> &segments)
+{
+	return HitCheckBatch(segments,EachPacket(bsp));
+}
+std::vector<BSPHitInfo> HitCheckBatch(BSPNode *bsp,const std::vector<std::pair<float3,float3>> &segments)
+{
+	return HitCheckBatch(segments,EachSegment([bsp](const float3 &v0,const float3 &v1) { return HitCheck(bsp,v0,v1); }));
+}
+std::vector<BSPHitInfo> HitCheckCylinderBatch(float r,float h,const BSPFlat &bsp,const std::vector<std::pair<float3,float3>> &segments)
+{
+	return HitCheckBatch(segments,EachSegment([r,h,&bsp](const float3 &v0,const float3 &v1) { return HitCheckCylinder(r,h,bsp,v0,v1); }));
+}
+std::vector<BSPHitInfo> HitCheckCylinderBatch(float r,float h,const BSPMapped &bsp,const std::vector<std::pair<float3,float3>> &segments)
+{
+	return HitCheckBatch(segments,EachSegment([r,h,&bsp](const float3 &v0,const float3 &v1) { return HitCheckCylinder(r,h,bsp,v0,v1); }));
+}
+
 class Collision
 {
 public:
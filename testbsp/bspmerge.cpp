@@ -8,11 +8,19 @@
 //
 
 #include "bsp.h"
+#include <future>
 
 template<class T> T Pop(std::vector<T> &a){ T t = a.back(); a.pop_back(); return t; }
 
 static int fusenodes=0;
 
+// The two recursive calls at each level of a merge work on disjoint pieces of both trees, so the top 
+// few levels hand one of them to another thread.  Small operands aren't worth the overhead.
+// Nothing shared is written, so the result is the same tree the serial merge produces.
+extern int bspthreaddepth;   // see bsp.cpp, 0 for serial
+extern int bspthreadfaces;
+int bspmergethreadnodes=256; // dont bother with a thread if the pieces of "a" being merged have fewer nodes than this
+
 std::unique_ptr<BSPNode> BSPClean(std::unique_ptr<BSPNode> n)
 {
 	// removes empty cells.
@@ -180,7 +188,7 @@ void BSPPartition(std::unique_ptr<BSPNode> n, const float4 &p, std::unique_ptr<B
 */
 }
 
-void FaceCutting(BSPNode *n, std::vector<Face> & faces)
+static void FaceCutting(BSPNode *n, std::vector<Face> & faces, int depth)
 {
 	if(n->isleaf==OVER)
 	{
@@ -194,6 +202,7 @@ void FaceCutting(BSPNode *n, std::vector<Face> & faces)
 	std::vector<Face> faces_over;
 	std::vector<Face> faces_under;
 	std::vector<Face> faces_coplanar;
+	int parallel = (depth < bspthreaddepth && (int)faces.size() >= bspthreadfaces);
     while (faces.size())
 	{
 		Face f = Pop(faces);
@@ -211,8 +220,17 @@ void FaceCutting(BSPNode *n, std::vector<Face> & faces)
 			faces_over.push_back(FaceClip(std::move(f), -n->plane()));
 		}
 	}
-	FaceCutting(n->under.get(),faces_under);
-	FaceCutting(n->over.get(),faces_over);
+	if(parallel)
+	{
+		auto task = std::async(std::launch::async, [&]() { FaceCutting(n->under.get(), faces_under, depth + 1); });
+		FaceCutting(n->over.get(), faces_over, depth + 1);
+		task.get();
+	}
+	else
+	{
+		FaceCutting(n->under.get(), faces_under, depth + 1);
+		FaceCutting(n->over.get(), faces_over, depth + 1);
+	}
 	for(unsigned int i=0;i<faces_under.size();i++)
 		faces.push_back(faces_under[i]);
 	for (unsigned int i = 0; i<faces_over.size(); i++)
@@ -221,15 +239,39 @@ void FaceCutting(BSPNode *n, std::vector<Face> & faces)
 		faces.push_back(faces_coplanar[i]);
 }
 
-std::unique_ptr<BSPNode> BSPUnion(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b) {
+void FaceCutting(BSPNode *n, std::vector<Face> & faces)
+{
+	FaceCutting(n, faces, 0);
+}
+
+static int MergeInParallel(BSPNode *aunder, BSPNode *aover, int depth)
+{
+	return depth < bspthreaddepth && aunder && aover && BSPCount(aunder) + BSPCount(aover) >= bspmergethreadnodes;
+}
+
+// For incremental geomod the merges can note which leaves of the result are new, or had their brep changed.  
+// Anything else came through from b as it was.  Leaves go by id since some of them get freed before the merge is done,
+// along with the extents of their cell so BSPMakeBrepLocal() in face.cpp can find the rest without walking the whole tree.
+static void Touch(std::vector<BSPTouched> *touched, BSPNode *n)
+{
+	if(!touched) 
+		return;
+	for(auto leaf : treetraverse(n))
+		if(leaf->isleaf && leaf->convex.verts.size())
+			touched->push_back({ leaf->id, Extents(leaf->convex.verts) });
+}
+
+static std::unique_ptr<BSPNode> BSPUnion(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b, int depth, std::vector<BSPTouched> *touched) {
 	if(!a || b->isleaf == UNDER || a->isleaf==OVER) {
 		if(a && b->isleaf==UNDER)
 		{
-			FaceCutting(a.get(), b->brep);
+			FaceCutting(a.get(), b->brep, depth);
+			if(a->isleaf!=OVER) Touch(touched, b.get());
 		}
 		return b;
 	}
 	if(a->isleaf == UNDER || b->isleaf==OVER) {
+		Touch(touched, a.get());
 		return a;
 	}
 	std::unique_ptr<BSPNode> aover;
@@ -238,8 +280,17 @@ std::unique_ptr<BSPNode> BSPUnion(std::unique_ptr<BSPNode> a, std::unique_ptr<BS
 	assert(!a->isleaf);
 	BSPPartition(move(a), float4(b->xyz(), b->w), aunder, aover);
 	assert(aunder || aover);
-	b->under = BSPUnion(move(aunder), move(b->under));
-	b->over = BSPUnion(move(aover), move(b->over));
+	if(MergeInParallel(aunder.get(), aover.get(), depth)) {
+		std::vector<BSPTouched> touchedunder;
+		auto task = std::async(std::launch::async, [&]() { return BSPUnion(move(aunder), move(b->under), depth + 1, touched ? &touchedunder : NULL); });
+		b->over  = BSPUnion(move(aover), move(b->over), depth + 1, touched);
+		b->under = task.get();
+		if(touched) touched->insert(touched->end(), touchedunder.begin(), touchedunder.end());
+	}
+	else {
+		b->under = BSPUnion(move(aunder), move(b->under), depth + 1, touched);
+		b->over  = BSPUnion(move(aover), move(b->over), depth + 1, touched);
+	}
 /*	if(fusenodes) {
 		if(b->over->isleaf == UNDER) {
 			DeriveCells(b->under,b->cell);
@@ -254,13 +305,19 @@ std::unique_ptr<BSPNode> BSPUnion(std::unique_ptr<BSPNode> a, std::unique_ptr<BS
 	return b;
 }
 
+std::unique_ptr<BSPNode> BSPUnion(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b) 
+{
+	return BSPUnion(move(a), move(b), 0, NULL);
+}
+
 
 int bspmergeallowswap=0;
-std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b) 
+static std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b, int depth, std::vector<BSPTouched> *touched) 
 {
 	int swapflag;
 	if(!a||a->isleaf == UNDER || b->isleaf==OVER) {
 		if(a&&a->isleaf==UNDER ) {
+			if(a->brep.size()) Touch(touched, b.get());
             while (a->brep.size()) {
 				FaceEmbed(b.get(), Pop(a->brep));
 			}
@@ -274,16 +331,17 @@ std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_pt
 				FaceEmbed(a.get(), Pop(b->brep));
 			}
 		}
+		Touch(touched, a.get());
 		return a;
 	}
 	// I'm not sure about the following bit - it only works if booleaning bsp's cells cover entire area volume too
 	if(bspmergeallowswap)if( SPLIT != (swapflag = b->convex.SplitTest( *a))) {
 		if(swapflag == OVER) {
-			a->over = BSPIntersect(move(a->over), move(b));
+			a->over = BSPIntersect(move(a->over), move(b), depth + 1, touched);
 			return a;
 		}
 		if(swapflag == UNDER) {
-			a->under= BSPIntersect(move(a->under), move(b));
+			a->under= BSPIntersect(move(a->under), move(b), depth + 1, touched);
 			return a;
 		}
 	}
@@ -291,8 +349,17 @@ std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_pt
 	std::unique_ptr<BSPNode> aunder;
 	// its like "b" is the master, so a should be the little object and b is the area's shell
 	BSPPartition(move(a), float4(b->xyz(), b->w), aunder, aover);
-	b->under = BSPIntersect(move(aunder), move(b->under));
-	b->over  = BSPIntersect(move(aover), move(b->over));
+	if(MergeInParallel(aunder.get(), aover.get(), depth)) {
+		std::vector<BSPTouched> touchedunder;
+		auto task = std::async(std::launch::async, [&]() { return BSPIntersect(move(aunder), move(b->under), depth + 1, touched ? &touchedunder : NULL); });
+		b->over  = BSPIntersect(move(aover), move(b->over), depth + 1, touched);
+		b->under = task.get();
+		if(touched) touched->insert(touched->end(), touchedunder.begin(), touchedunder.end());
+	}
+	else {
+		b->under = BSPIntersect(move(aunder), move(b->under), depth + 1, touched);
+		b->over  = BSPIntersect(move(aover), move(b->over), depth + 1, touched);
+	}
 	if(b->over->isleaf && b->over->isleaf==b->under->isleaf) {  // both children are leaves of same type so merge them into parent
         while (b->over->brep.size()) {
 			b->brep.push_back(Pop(b->over->brep));
@@ -304,6 +371,7 @@ std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_pt
 		b->isleaf = b->over->isleaf;
         b->over.reset();
         b->under.reset();
+		Touch(touched, b.get());  // the children might already be in touched, BSPMakeBrepLocal() ignores nodes no longer in the tree
 	}
 /*	if(fusenodes) {
 		if(b->over->isleaf == UNDER) {
@@ -319,6 +387,32 @@ std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_pt
 	return b;
 }
 
+std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b) 
+{
+	return BSPIntersect(move(a), move(b), 0, NULL);
+}
+
+// Incremental geomod.  
+// Merge as usual but keep track of the leaves that changed, then only regenerate the brep around those
+// instead of BSPMakeBrep(BSPRipBrep()) on the whole level.  b's brep has to be complete going in.
+std::unique_ptr<BSPNode> BSPUnionLocal(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b, std::pair<float3,float3> *rebuilt)
+{
+	std::vector<BSPTouched> touched;
+	b = BSPUnion(move(a), move(b), 0, &touched);
+	auto r = BSPMakeBrepLocal(b.get(), move(touched));
+	if (rebuilt) *rebuilt = r;
+	return b;
+}
+
+std::unique_ptr<BSPNode> BSPIntersectLocal(std::unique_ptr<BSPNode> a, std::unique_ptr<BSPNode> b, std::pair<float3,float3> *rebuilt)
+{
+	std::vector<BSPTouched> touched;
+	b = BSPIntersect(move(a), move(b), 0, &touched);
+	auto r = BSPMakeBrepLocal(b.get(), move(touched));
+	if (rebuilt) *rebuilt = r;
+	return b;
+}
+
 //int HitCheckConvexGJK(const Collidable *dude, BSPNode *n)
 //  int HitCheckConvexGJKm(std::function<float3(const float3&)> collidersupportmap, BSPNode *n)
 //  {
@@ -344,37 +438,3 @@ std::unique_ptr<BSPNode> BSPIntersect(std::unique_ptr<BSPNode> a, std::unique_pt
 //  	}
 //  	return 0;
 //  }
-
-//  std::vector<WingMesh*> ProximityCellsm(std::function<float3(const float3&)> supportmap, BSPNode *bsp, float padding)
-//  {
-//  	std::vector<WingMesh*> cells;
-//  	std::vector<BSPNode *> stack;
-//  	stack.push_back(bsp);
-//  	Contact hitinfo;
-//  	while (stack.size())
-//  	{
-//  		BSPNode *n = Pop(stack);
-//  		if (!n) continue;
-//  		if (n->isleaf == UNDER)
-//  		{
-//  			cells.push_back(n->convex);
-//  			continue;
-//  		}
-//  		if (n->isleaf == OVER)
-//  			continue;
-//  		int f = 0;
-//  		auto u = supportmap(-n->xyz());
-//  		auto o = supportmap(n->xyz());
-//  		f |= PlaneTest(n->xyz(), n->w - padding, u, 0);  // verify sign for padding, seems right
-//  		f |= PlaneTest(n->xyz(), n->w + padding, o, 0);
-//  		if (f&UNDER)
-//  		{
-//  			stack.push_back(n->under); // ProximityCellsm(dude, n->under, cells, padding);
-//  		}
-//  		if (f&OVER)
-//  		{
-//  			stack.push_back(n->over);  // ProximityCellsm(dude, n->over, cells, padding);
-//  		}
-//  	}
-//  	return cells;
-//  }
@@ -0,0 +1,254 @@
+//
+//      BSP
+//  (c) Stan Melax 1998-2007  bsd licence
+//  see file bsp.h
+//
+// this module provides portals and potentially visible sets
+//
+// Same idea as the old quake vis tools.  An empty leaf can only be seen from another through a chain
+// of portals, and only along lines that get through every portal in the chain.  Such a line crosses
+// from behind to in front of any plane that has the first portal on one side and the current one on
+// the other, so whatever's visible through the next portal is on the far side of all those planes.
+//
+
+
+#include "bsp.h"
+#include <future>
+#include <numeric>
+#include <thread>
+
+float visepsilon = PAPERWIDTH*10;  // slop when clipping portals, always in favor of keeping more
+float visminarea = PAPERWIDTH;     // smaller than this is a crack from roundoff, not an opening
+float visseparate = PAPERWIDTH*0.1f;  // how close to the wrong side a polygon can be and still count as separated
+int   visflowsteps = 256;   // portal chains followed out from each portal before settling for the rough bound on the rest
+
+static int  BitTest(const uint32_t *bits,int i) { return (bits[i>>5]>>(i&31))&1; }
+static void BitSet (uint32_t *bits,int i)       { bits[i>>5] |= 1u<<(i&31); }
+
+// Keeps the part of the polygon on or over the plane, returns 0 if nothing is left.
+static int KeepOver(Face &face,const float4 &plane)
+{
+	float4 p = plane + float4(0,0,0,visepsilon);
+	decltype(face.vertex) kept;
+	for(unsigned int i=0;i<face.vertex.size();i++) {
+		const float3 &a = face.vertex[i], &b = face.vertex[(i+1)%face.vertex.size()];
+		float da = dot(p,float4(a,1)), db = dot(p,float4(b,1));
+		if(da >= 0) kept.push_back(a);
+		if((da >= 0) != (db >= 0)) kept.push_back(a + (b-a)*(da/(da-db)));
+	}
+	face.vertex = std::move(kept);
+	return face.vertex.size() >= 3;
+}
+
+// Nearest and farthest signed distance of the polygon's vertices from the plane.
+static float2 Range(const Face &face,const float4 &plane)
+{
+	float2 r(FLT_MAX,-FLT_MAX);
+	for(auto &v : face.vertex) {
+		float d = dot(plane,float4(v,1));
+		r = float2(std::min(r.x,d),std::max(r.y,d));
+	}
+	return r;
+}
+
+// Pushes a face of leaf 'from's cell out through the tree, the pieces that land in empty leaves are portals.
+// Same as FaceEmbed() except coplanar goes to the side the face is facing, away from 'from'.
+static void PortalEmbed(BSPVis &vis,std::vector<std::vector<int>> &borders,BSPNode *node,Face &&face,int from)
+{
+	if(node->isleaf) {
+		int to = vis.leafindex[node];
+		if(to==from) return;
+		if(node->isleaf==UNDER)
+			borders[from].push_back(to);
+		else if(FaceArea(face) > visminarea)
+			vis.portals.push_back({std::move(face),from,to});
+		return;
+	}
+	int flag = FaceSplitTest(face, node->plane());
+	if(flag==COPLANAR)
+		flag = (dot(node->xyz(), face.xyz()) > 0) ? OVER : UNDER;
+	if(flag==SPLIT) {
+		PortalEmbed(vis,borders,node->over.get(), FaceClip(face, -node->plane()),from);
+		PortalEmbed(vis,borders,node->under.get(),FaceClip(std::move(face), node->plane()),from);
+		return;
+	}
+	PortalEmbed(vis,borders,(flag==OVER) ? node->over.get() : node->under.get(),std::move(face),from);
+}
+
+// Lines from source through pass stay on the far side of each plane through an edge of one and a vertex
+// of the other that has source entirely behind and pass entirely in front.  Clips target to all of those.
+// A plane only counts if it clearly separates the two, anything doubtful just doesnt get used.
+static int ClipToSeparators(const Face &source,const Face &pass,Face &target)
+{
+	for(int flip=0;flip<2;flip++) {
+		const Face &a = flip ? pass : source;
+		const Face &b = flip ? source : pass;
+		for(unsigned int i=0;i<a.vertex.size();i++) for(auto &w : b.vertex) {
+			const float3 &e0 = a.vertex[i], &e1 = a.vertex[(i+1)%a.vertex.size()];
+			float3 n = cross(e1-e0, w-e0);
+			if(length(n) < PAPERWIDTH) continue;
+			float4 plane(normalize(n), 0);
+			plane.w = -dot(plane.xyz(),e0);
+			float2 s = Range(source,plane);
+			if(s.y > visseparate) plane = -plane, s = -float2(s.y,s.x);
+			float2 p = Range(pass,plane);
+			if(s.y > visseparate || s.x > -visepsilon || p.x < -visseparate || p.y < visepsilon) continue;  // doesnt separate them
+			if(!KeepOver(target,plane)) return 0;
+		}
+	}
+	return 1;
+}
+
+// What's visible through each portal, from anywhere on it looking out its front.  Once a portal is done that
+// bounds anything seen through it on a longer chain, so later flows narrow to it instead of the rough mightsee.
+// That's the quake vis "portal done" reuse, without it the flow is exponential in the number of portals.
+struct VisFlow
+{
+	const BSPVis &vis;
+	const std::vector<std::vector<uint32_t>> &mightsee;  // per portal, from the flood fill
+	const std::vector<std::vector<uint32_t>> &portalvis; // per portal, good once done is set
+	const std::atomic<int> *done;
+	std::vector<uint32_t> visible;
+	std::vector<char> onpath;
+	int steps = visflowsteps;
+	VisFlow(const BSPVis &vis,const std::vector<std::vector<uint32_t>> &mightsee,const std::vector<std::vector<uint32_t>> &portalvis,const std::atomic<int> *done)
+		:vis(vis),mightsee(mightsee),portalvis(portalvis),done(done),visible(vis.rowwords,0),onpath(vis.leaves.size(),0){}
+};
+
+static void Flow(VisFlow &f,int leaf,const Face &source,const Face &pass,const std::vector<uint32_t> &might)
+{
+	f.onpath[leaf] = 1;
+	std::vector<uint32_t> narrowed(might.size());
+	for(int qi : f.vis.leafportals[leaf]) {
+		const BSPPortal &q = f.vis.portals[qi];
+		if(f.onpath[q.to] || !BitTest(might.data(),q.to)) continue;
+		const std::vector<uint32_t> &bound = f.done[qi].load(std::memory_order_acquire) ? f.portalvis[qi] : f.mightsee[qi];
+		uint32_t more = 0;
+		for(unsigned int w=0;w<might.size();w++)
+			more |= (narrowed[w] = might[w] & bound[w]) & ~f.visible[w];
+		if(!more && BitTest(f.visible.data(),q.to)) continue;  // nothing new that way
+		if(Range(source,q.face.plane()).x > visepsilon) continue;  // source is all in front of q, cant see out through it
+		Face target = q.face;
+		if(!KeepOver(target,source.plane()) || !KeepOver(target,pass.plane())) continue;
+		if(&source!=&pass && !ClipToSeparators(source,pass,target)) continue;
+		BitSet(f.visible.data(),q.to);
+		if(--f.steps < 0) {  // out of budget, take everything the chain so far might see
+			for(unsigned int w=0;w<narrowed.size();w++) f.visible[w] |= narrowed[w];
+			continue;
+		}
+		Flow(f,q.to,source,target,narrowed);
+	}
+	f.onpath[leaf] = 0;
+}
+
+// Rough first pass:  the leaves reachable through portals that are at least partly in front of p
+// and have p at least partly behind them, give or take visepsilon.  Bounds what the clipped flow has to look at.
+static std::vector<uint32_t> MightSee(const BSPVis &vis,int pi)
+{
+	const BSPPortal &p = vis.portals[pi];
+	std::vector<uint32_t> bits(vis.rowwords,0);
+	std::vector<int> stack(1,p.to);
+	BitSet(bits.data(),p.to);
+	while(stack.size()) {
+		int leaf = stack.back();
+		stack.pop_back();
+		for(int qi : vis.leafportals[leaf]) {
+			const BSPPortal &q = vis.portals[qi];
+			if(BitTest(bits.data(),q.to) || Range(q.face,p.face.plane()).y < -visepsilon || Range(p.face,q.face.plane()).x > visepsilon) continue;
+			BitSet(bits.data(),q.to);
+			stack.push_back(q.to);
+		}
+	}
+	return bits;
+}
+
+template<class F> static void ForAllCores(int count,F f)  // f(i) for i in 0..count-1, handed out one at a time
+{
+	std::atomic<int> next(0);
+	auto worker = [&]() { for(int i; (i=next++) < count;) f(i); };
+	std::vector<std::future<void>> tasks;
+	for(unsigned int t=1;t<std::thread::hardware_concurrency();t++)
+		tasks.push_back(std::async(std::launch::async,worker));
+	worker();
+	for(auto &t : tasks) t.get();
+}
+
+int BSPVis::Leaf(const float3 &p) const
+{
+	BSPNode *n = root;
+	while(n && !n->isleaf)
+		n = (dot(float4(p,1),n->plane()) > 0) ? n->over.get() : n->under.get();
+	return n ? leafindex.at(n) : -1;
+}
+
+BSPVis BSPMakeVis(BSPNode *root)
+{
+	BSPVis vis;
+	vis.root = root;
+	for(auto n : treetraverse(root)) if(n->isleaf) {
+		vis.leafindex[n] = (int)vis.leaves.size();
+		vis.leaves.push_back(n);
+	}
+	int count = (int)vis.leaves.size();
+	vis.rowwords = (count+31)/32;
+
+	std::vector<std::vector<int>> borders(count);  // solid leaves touching each empty leaf
+	for(int i=0;i<count;i++) if(vis.leaves[i]->isleaf==OVER) {
+		const WingMesh &cell = vis.leaves[i]->convex;
+		for(unsigned int k=0;k<cell.faces.size();k++) {
+			Face face;
+			face.plane() = cell.faces[k];
+			face.vertex  = cell.GenerateFaceVerts(k);
+			PortalEmbed(vis,borders,root,std::move(face),i);
+		}
+	}
+	vis.leafportals.resize(count);
+	for(unsigned int i=0;i<vis.portals.size();i++)
+		vis.leafportals[vis.portals[i].from].push_back(i);
+
+	std::vector<std::vector<uint32_t>> mightsee(vis.portals.size());
+	ForAllCores((int)vis.portals.size(),[&](int pi) { mightsee[pi] = MightSee(vis,pi); });
+
+	// Portals that might see the least go first, so theirs are done by the time the bigger ones flow through them.
+	std::vector<int> order(vis.portals.size());
+	std::iota(order.begin(),order.end(),0);
+	std::vector<int> mightcount(vis.portals.size(),0);
+	for(unsigned int pi=0;pi<vis.portals.size();pi++) for(uint32_t w : mightsee[pi]) for(;w;w&=w-1) mightcount[pi]++;
+	std::stable_sort(order.begin(),order.end(),[&mightcount](int a,int b) { return mightcount[a] < mightcount[b]; });
+	std::vector<std::vector<uint32_t>> portalvis(vis.portals.size());
+	std::unique_ptr<std::atomic<int>[]> done(new std::atomic<int>[vis.portals.size()]);
+	for(unsigned int pi=0;pi<vis.portals.size();pi++) done[pi] = 0;
+	ForAllCores((int)vis.portals.size(),[&](int k) {
+		int pi = order[k];
+		const BSPPortal &p = vis.portals[pi];
+		VisFlow f(vis,mightsee,portalvis,done.get());
+		BitSet(f.visible.data(),p.to);
+		f.onpath[p.from] = 1;
+		Flow(f,p.to,p.face,p.face,mightsee[pi]);
+		portalvis[pi] = std::move(f.visible);
+		done[pi].store(1,std::memory_order_release);
+	});
+
+	vis.pvs.assign(count*vis.rowwords,0);
+	for(int i=0;i<count;i++) {
+		uint32_t *row = vis.pvs.data() + i*vis.rowwords;
+		if(vis.leaves[i]->isleaf==UNDER) {
+			for(int j=0;j<count;j++) BitSet(row,j);  // from inside solid, anything goes
+			continue;
+		}
+		BitSet(row,i);
+		for(int pi : vis.leafportals[i])
+			for(int w=0;w<vis.rowwords;w++) row[w] |= portalvis[pi][w];
+	}
+	// Seeing is mutual, but the flow from each end doesnt always clip the same.  Then add in the solid
+	// leaves around each visible empty one, since those hold the faces that get drawn.
+	for(int i=0;i<count;i++) for(int j=0;j<count;j++) 
+		if(vis.leaves[i]->isleaf==OVER && BitTest(vis.pvs.data()+i*vis.rowwords,j))
+			BitSet(vis.pvs.data()+j*vis.rowwords,i);
+	for(int i=0;i<count;i++) if(vis.leaves[i]->isleaf==OVER) {
+		uint32_t *row = vis.pvs.data() + i*vis.rowwords;
+		for(int j=0;j<count;j++) if(vis.leaves[j]->isleaf==OVER && BitTest(row,j))
+			for(int b : borders[j]) BitSet(row,b);
+	}
+	return vis;
+}
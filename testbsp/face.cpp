@@ -9,6 +9,8 @@
 #include <assert.h>
 
 #include "bsp.h"
+#include <future>
+#include <algorithm>
 
 template<class T> inline T Pop(std::vector<T> & c) { auto val = std::move(c.back()); c.pop_back(); return val; }
 
@@ -21,6 +23,8 @@ float qsnap=0.5f;
 
 int currentmaterial = 0;
 float texscale=1.0f;
+extern int bspthreaddepth;  // see bsp.cpp
+extern int bspthreadfaces;
 
 
 void texplanar(Face & face)
@@ -241,26 +245,32 @@ void FaceSlice(Face & face,const float4 &clip) {
 
 Face FaceClip(const Face & face, const float4 & clip) { return FaceClip(Face(face), clip); }
 Face FaceClip(Face && face,const float4 &clip) {
-	assert(FaceSplitTest(face, clip) == SPLIT);
-	FaceSlice(face,clip);
-	std::vector<float3> tmp;
-	for(unsigned int i=0;i<face.vertex.size();i++){
-		if (PlaneTest(clip, face.vertex[i]) != OVER) {
-			tmp.push_back(face.vertex[i]);
-		}
-	}
-	face.vertex.clear();
-	for (unsigned int i = 0; i<tmp.size(); i++){
-		face.vertex.push_back(tmp[i]);
+	// Same polygon FaceSlice() then dropping the verts over the plane gives, but each vert gets classified once, 4 at a time.
+	static thread_local std::vector<float> dist;
+	static thread_local std::vector<float3> kept;
+	int n = (int)face.vertex.size();
+	dist.resize(n);
+	int flag = PlaneSplitTest(clip, face.vertex.data(), n, PAPERWIDTH, dist.data());
+	assert(flag == SPLIT);
+	auto side = [](float d) { return (d > PAPERWIDTH) ? OVER : ((d < -PAPERWIDTH) ? UNDER : COPLANAR); };
+	auto crosses = [&](int i, int i2) { return (side(dist[i]) | side(dist[i2])) == SPLIT; };
+	kept.clear();
+	if (crosses(n - 1, 0))  // FaceSlice() inserts this one at the front
+		kept.push_back(PlaneLineIntersection(clip, face.vertex[n - 1], face.vertex[0]));
+	for (int i = 0; i < n; i++)
+	{
+		if (side(dist[i]) != OVER)
+			kept.push_back(face.vertex[i]);
+		if (i + 1 < n && crosses(i, i + 1))
+			kept.push_back(PlaneLineIntersection(clip, face.vertex[i], face.vertex[i + 1]));
 	}
+	face.vertex.assign(kept.data(), kept.data() + kept.size());
 	return face;
 }
 
 int FaceSplitTest(const Face & face, const float4 &splitplane,float epsilon)
 {
-	int flag = COPLANAR;  // 0
-	for (const auto & v : face.vertex) flag |= PlaneTest(splitplane, v, epsilon);
-	return flag;
+	return PlaneSplitTest(splitplane, face.vertex.data(), face.vertex.size(), epsilon);
 }
 
 void  FaceSliceEdge(Face *face,int e0,BSPNode *n) {
@@ -273,7 +283,7 @@ void  FaceSliceEdge(Face *face,int e0,BSPNode *n) {
 }
 
 int edgesplitcount=0;
-static void FaceEdgeSplicer(Face & face,int vi0,BSPNode *n)
+static void FaceEdgeSplicer(Face & face,int vi0,BSPNode *n,int &splits)
 {
 	// the face's edge starting from vertex vi0 is sliced by any incident hypeplane in the bsp
 	if(n->isleaf) return;
@@ -282,7 +292,7 @@ static void FaceEdgeSplicer(Face & face,int vi0,BSPNode *n)
 	float3 v1 = face.vertex[vi1];
 	if (length(v0 - v1) <= QUANTIZEDCHECK)
 	{
-		edgesplitcount++;
+		splits++;
 	}
 	assert(length(v0-v1) > QUANTIZEDCHECK );
 	int f0 = PlaneTest(float4(n->xyz(), n->w), v0); 
@@ -291,25 +301,25 @@ static void FaceEdgeSplicer(Face & face,int vi0,BSPNode *n)
 	{
 		// have to pass down both sides, but we have to make sure we do all subsegments generated by the first side
 		int count = face.vertex.size();
-		FaceEdgeSplicer(face,vi0,n->under.get());
+		FaceEdgeSplicer(face,vi0,n->under.get(),splits);
 		int k=vi0 + (face.vertex.size()-count);
 		while(k>=vi0)
 		{
-			FaceEdgeSplicer(face,k,n->over.get());
+			FaceEdgeSplicer(face,k,n->over.get(),splits);
 			k--;
 		}
 	}
 	else if((f0|f1) == UNDER)
 	{
-		FaceEdgeSplicer(face,vi0,n->under.get());
+		FaceEdgeSplicer(face,vi0,n->under.get(),splits);
 	}
 	else if((f0|f1) == OVER)
 	{
-		FaceEdgeSplicer(face,vi0,n->over.get());
+		FaceEdgeSplicer(face,vi0,n->over.get(),splits);
 	}
 	else
 	{
-		edgesplitcount++;
+		splits++;
 		assert(length(v0-v1) > QUANTIZEDCHECK);
 		assert((f0|f1) == SPLIT);
 		float3 vmid = PlaneLineIntersection(*n,v0,v1);
@@ -320,14 +330,14 @@ static void FaceEdgeSplicer(Face & face,int vi0,BSPNode *n)
 		face.vertex.insert(face.vertex.begin() + vi0 + 1, vmid); //  Insert(face.vertex, vmid, vi0 + 1);
 		if(f0==UNDER)
 		{
-			FaceEdgeSplicer(face,vi0+1,n->over.get());
-			FaceEdgeSplicer(face,vi0  ,n->under.get());
+			FaceEdgeSplicer(face,vi0+1,n->over.get(),splits);
+			FaceEdgeSplicer(face,vi0  ,n->under.get(),splits);
 		}
 		else
 		{
 			assert(f0==OVER);
-			FaceEdgeSplicer(face,vi0+1,n->under.get());
-			FaceEdgeSplicer(face,vi0  ,n->over.get());
+			FaceEdgeSplicer(face,vi0+1,n->under.get(),splits);
+			FaceEdgeSplicer(face,vi0  ,n->over.get(),splits);
 		}
 	}
 	
@@ -336,18 +346,37 @@ static void FaceEdgeSplicer(Face & face,int vi0,BSPNode *n)
 
 int FaceSplitifyEdges(BSPNode *root)  // tests (possibly splits) all brep edges O(n lg(n))-ish 
 {
-	edgesplitcount=0;
+	// each face only ever changes itself, so the leaves can be spread over a few threads
+	std::vector<BSPNode*> nodes;
+	int facecount=0;
 	for (auto n : treetraverse(root))
 	{
 		if(!n) 
 			continue; // shouldn't happen
-		for (auto &face: n->brep)
+		if(n->brep.size())
+			nodes.push_back(n);
+		facecount += n->brep.size();
+	}
+	auto splitify = [&nodes,root](size_t begin,size_t end) {
+		int count=0;
+		for (size_t i=begin;i<end;i++)
 		{
-			int j=face.vertex.size();      // in reverse order since we may end up inserting into this array
-			while(j--)                         // for every edge of every brep face...
-				FaceEdgeSplicer(face,j,root);  // starting at root, pass the edge down the (relevant nodes of) tree 
+			for (auto &face: nodes[i]->brep)
+			{
+				int j=face.vertex.size();      // in reverse order since we may end up inserting into this array
+				while(j--)                         // for every edge of every brep face...
+					FaceEdgeSplicer(face,j,root,count);  // starting at root, pass the edge down the (relevant nodes of) tree 
+			}
 		}
-	}
+		return count;
+	};
+	int tasks = (bspthreaddepth && facecount >= bspthreadfaces) ? 1<<std::min(bspthreaddepth,4) : 1;
+	std::vector<std::future<int>> futures;
+	for(int t=1;t<tasks;t++)
+		futures.push_back(std::async(std::launch::async, splitify, nodes.size()*t/tasks, nodes.size()*(t+1)/tasks));
+	edgesplitcount = splitify(0, nodes.size()/tasks);
+	for(auto &f : futures)
+		edgesplitcount += f.get();
 	return edgesplitcount;
 }
 
@@ -418,6 +447,7 @@ void FaceEmbed(BSPNode *node, Face && face) {
 std::vector<Face> GenerateFacesReverse(const WingMesh &m)
 {
 	std::vector<Face> flist;
+	flist.reserve(m.faces.size());
 	for(unsigned int i=0;i<m.faces.size();i++)
 	{
 		Face f;
@@ -439,6 +469,7 @@ std::vector<Face> GenerateFacesReverse(const WingMesh &m)
 std::vector<Face> GenerateFaces(const WingMesh &m)
 {
 	std::vector<Face> flist;
+	flist.reserve(m.faces.size());
 	for(unsigned int i=0;i<m.faces.size();i++)
 	{
 		Face f;
@@ -457,13 +488,47 @@ std::vector<Face> GenerateFaces(const WingMesh &m)
 	return flist;
 }
 
+// Same result as FaceEmbed() of each face in turn:  pieces of one face always land in different leaves, 
+// so keeping the list in order as it gets divided up keeps each leaf's brep in the same order.
+// With that, the two children are independent and the top few levels can do them at the same time.
+// Below that it's cheaper to just send each face down by itself.
+static void FaceEmbed(BSPNode *node, std::vector<Face> && faces, int depth)
+{
+	if(node->isleaf || depth >= bspthreaddepth || (int)faces.size() < bspthreadfaces) {
+		for(auto &f : faces)
+			FaceEmbed(node, std::move(f));
+		return;
+	}
+	std::vector<Face> under, over;
+	for(auto &face : faces) {
+		int flag = FaceSplitTest(face, node->plane());
+		if(flag==COPLANAR) 
+			flag = (dot(node->xyz(), face.xyz()) > 0) ? UNDER : OVER;
+		if(flag==UNDER) 
+			under.push_back(std::move(face));
+		else if(flag==OVER) 
+			over.push_back(std::move(face));
+		else {
+			assert(flag==SPLIT);
+			over.push_back(FaceClip(face, -node->plane()));
+			under.push_back(FaceClip(std::move(face), node->plane()));
+		}
+	}
+	faces.clear();
+	auto task = std::async(std::launch::async, [&]() { FaceEmbed(node->under.get(), std::move(under), depth + 1); });
+	FaceEmbed(node->over.get(), std::move(over), depth + 1);
+	task.get();
+}
+
 static void GenerateFaces(BSPNode *root) 
 {
 	assert(root);
+	std::vector<Face> faces;
 	for (auto n : treetraverse(root))
 		if(n->isleaf==OVER) 
 			for (auto &f : GenerateFacesReverse(n->convex))
-				FaceEmbed(root, std::move(f));
+				faces.push_back(std::move(f));
+	FaceEmbed(root, std::move(faces), 0);
 }
 
 
@@ -482,7 +547,7 @@ static void ExtractMat(Face & face,const Face & src)
 	for(auto &v : face.vertex) 
 		interior += v * (1.0f/face.vertex.size());
 
-	if (!PolyHitCheck(src.vertex, interior + face.xyz(), interior - face.xyz())){
+	if (!PolyHitCheck(src.vertex.data(), src.vertex.size(), interior + face.xyz(), interior - face.xyz())){
 		return;
 	}
 	// src and face coincident
@@ -512,6 +577,33 @@ static void ExtractMat(BSPNode *n,const Face &poly) {
 	}
 }
 
+// As with FaceEmbed above, the top few levels send all the material sample faces down together.
+// Each node's brep sees them in the same order as it would one at a time, so the last match still wins.
+static void ExtractMat(BSPNode *n,const std::vector<const Face *> &polys,int depth) {
+	if(n->isleaf || depth >= bspthreaddepth || (int)polys.size() < bspthreadfaces) {
+		for(auto poly : polys)
+			ExtractMat(n,*poly);
+		return;
+	}
+	for(unsigned int i=0;i<n->brep.size();i++) {
+		for(auto poly : polys) 
+			ExtractMat(n->brep[i],*poly);		
+	}
+	std::vector<const Face *> under, over;
+	for(auto poly : polys) {
+		int flag = FaceSplitTest(*poly, n->plane());
+		if(flag==COPLANAR) 
+			flag = (dot(n->xyz(), poly->xyz())>0) ? UNDER : OVER;
+		if(flag & UNDER) 
+			under.push_back(poly);
+		if(flag & OVER) 
+			over.push_back(poly);
+	}
+	auto task = std::async(std::launch::async, [&]() { ExtractMat(n->under.get(), under, depth + 1); });
+	ExtractMat(n->over.get(), over, depth + 1);
+	task.get();
+}
+
 
 std::vector<Face> BSPRipBrep(BSPNode *root)
 {
@@ -578,8 +670,117 @@ void BSPMakeBrep(BSPNode *r, std::vector<Face> && faces)
 {
 	GenerateFaces(r);
 	FaceSplitifyEdges(r);
+	std::vector<const Face *> polys;
 	for(auto & f : faces) 
-		ExtractMat(r,f);
+		polys.push_back(&f);
+	ExtractMat(r,polys,0);
+}
+
+// Local brep regeneration for geomod.
+// Carving a hole in one room shouldn't mean redoing the brep for the whole level.
+// The merge hands us the leaves it changed.  Those that are solid, plus solid leaves touching any that are 
+// empty, get their faces ripped and rebuilt.  The new faces come 
+// from the empty cells next to them, and any piece that lands in a leaf we didn't rip is dropped since that 
+// leaf still has its own.  Leaves bordering the dirty ones get their edges spliced again, since the new 
+// geometry can leave T-junctions on them (splicing an already spliced face doesn't change it).
+// The rest of the tree's brep has to already be complete, eg from an earlier BSPMakeBrep().
+
+static int BoxesOverlap(const std::pair<float3,float3> &a,const std::pair<float3,float3> &b)
+{
+	return a.first.x<=b.second.x && b.first.x<=a.second.x && a.first.y<=b.second.y && b.first.y<=a.second.y && a.first.z<=b.second.z && b.first.z<=a.second.z;
+}
+
+static void LeavesTouching(BSPNode *n,const std::pair<float3,float3> &box,int side,std::vector<BSPNode*> &leaves)
+{
+	while(!n->isleaf)  // only go down the side(s) of each plane the box is on
+	{
+		float3 c = (box.first+box.second)*0.5f, h = (box.second-box.first)*0.5f;
+		float d = dot(n->xyz(),c) + n->w;
+		float r = dot(abs(n->xyz()),h);
+		if(d-r > 0) 
+			n = n->over.get();
+		else if(d+r < 0)
+			n = n->under.get();
+		else 
+		{
+			LeavesTouching(n->under.get(),box,side,leaves);
+			n = n->over.get();
+		}
+	}
+	if(n->isleaf==side && n->convex.verts.size() && BoxesOverlap(Extents(n->convex.verts),box))
+		leaves.push_back(n);
+}
+
+static void FaceEmbedDirty(BSPNode *node, Face && face, const std::vector<BSPNode*> &dirty)  // FaceEmbed() that only keeps pieces landing in the (sorted) dirty leaves
+{
+	while(!node->isleaf) {
+		int flag = FaceSplitTest(face, node->plane());
+		if(flag==COPLANAR) 
+			flag = (dot(node->xyz(), face.xyz()) > 0) ? UNDER : OVER;
+		if(flag==SPLIT) {
+			FaceEmbedDirty(node->over.get(), FaceClip(face, -node->plane()), dirty);
+			face = FaceClip(std::move(face), node->plane());
+			flag = UNDER;
+		}
+		node = (flag==UNDER) ? node->under.get() : node->over.get();
+	}
+	if(node->isleaf==UNDER && std::binary_search(dirty.begin(), dirty.end(), node)) 
+		node->brep.push_back(std::move(face));
+}
+
+std::pair<float3,float3> BSPMakeBrepLocal(BSPNode *r, std::vector<BSPTouched> touched)
+{
+	float3 pad(FUZZYWIDTH);
+	auto bounds = Extents(std::vector<float3>());  // of the dirty cells, this is what actually gets rebuilt
+	std::vector<BSPNode*> dirty, border, empty, found;
+	std::sort(touched.begin(), touched.end(), [](const BSPTouched &a, const BSPTouched &b) { return a.id < b.id; });
+	touched.erase(std::unique(touched.begin(), touched.end(), [](const BSPTouched &a, const BSPTouched &b) { return a.id == b.id; }), touched.end());
+	for(auto &t : touched) {
+		found.clear();  // a leaf still in the tree has the same cell, so it's among the ones its old extents touch
+		LeavesTouching(r, { t.cell.first-pad, t.cell.second+pad }, UNDER, found);
+		LeavesTouching(r, { t.cell.first-pad, t.cell.second+pad }, OVER, found);
+		auto it = std::find_if(found.begin(), found.end(), [&t](BSPNode *n) { return n->id == t.id; });
+		if(it == found.end())
+			continue;  // got merged away or deleted
+		BSPNode *n = *it;
+		if(n->isleaf==UNDER)
+			dirty.push_back(n);
+		else if(n->convex.verts.size()) {
+			auto b = Extents(n->convex.verts);
+			LeavesTouching(r, { b.first-pad, b.second+pad }, UNDER, dirty);
+		}
+	}
+	std::sort(dirty.begin(), dirty.end());
+	dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+	std::vector<std::vector<Face>> oldfaces(dirty.size());  // kept per leaf to sample materials from, a face doesn't change leaves
+	for(unsigned int i=0;i<dirty.size();i++) {
+		auto b = Extents(dirty[i]->convex.verts);
+		bounds.first  = min(bounds.first, b.first);
+		bounds.second = max(bounds.second, b.second);
+		LeavesTouching(r, { b.first-pad, b.second+pad }, OVER, empty);
+		LeavesTouching(r, { b.first-pad, b.second+pad }, UNDER, border);
+		oldfaces[i] = std::move(dirty[i]->brep);
+		dirty[i]->brep.clear();
+	}
+	for(auto leaves : { &empty, &border }) {  // neighbors of more than one dirty cell show up more than once
+		std::sort(leaves->begin(), leaves->end());
+		leaves->erase(std::unique(leaves->begin(), leaves->end()), leaves->end());
+	}
+	for(auto n : empty)
+		for(auto &f : GenerateFacesReverse(n->convex))
+			FaceEmbedDirty(r, std::move(f), dirty);
+	int splits=0;
+	for(auto n : border) 
+		for(auto &face : n->brep) {
+			int j=face.vertex.size();
+			while(j--)
+				FaceEdgeSplicer(face,j,r,splits);
+		}
+	for(unsigned int i=0;i<dirty.size();i++) 
+		for(auto &face : dirty[i]->brep) 
+			for(auto &src : oldfaces[i])
+				ExtractMat(face,src);
+	return bounds;
 }
 
 static void BSPClipFace(BSPNode *n,Face && face,const float3 &position,std::vector<Face> &under,std::vector<Face> &over)
@@ -595,7 +796,9 @@ static void BSPClipFace(BSPNode *n,Face && face,const float3 &position,std::vect
 		return;
 	}
 	float4 plane(n->xyz(), n->w + dot(position, n->xyz()));
-	int flag = FaceSplitTest(face, plane);
+	static thread_local std::vector<float> dist;  // only read below, before recursing
+	dist.resize(face.vertex.size());
+	int flag = PlaneSplitTest(plane, face.vertex.data(), face.vertex.size(), PAPERWIDTH, dist.data());
 	if(flag == UNDER) {
 		return BSPClipFace(n->under.get(),std::move(face),position,under,over);
 	}
@@ -616,10 +819,11 @@ static void BSPClipFace(BSPNode *n,Face && face,const float3 &position,std::vect
 	fover.ot   = funder.ot   = face.ot;
 	fover.matid= funder.matid= face.matid;
 	for(unsigned int i=0;i<face.vertex.size();i++){
+		unsigned int i1 = (i+1)%face.vertex.size();
 		float3& vi = face.vertex[i];
-		float3& vi1= face.vertex[(i+1)%face.vertex.size()];
-		int vf  = PlaneTest(float4(plane.xyz(), plane.w), vi);
-		int vf1 = PlaneTest(float4(plane.xyz(), plane.w), vi1);
+		float3& vi1= face.vertex[i1];
+		int vf  = (dist[i ] > PAPERWIDTH) ? OVER : ((dist[i ] < -PAPERWIDTH) ? UNDER : COPLANAR);
+		int vf1 = (dist[i1] > PAPERWIDTH) ? OVER : ((dist[i1] < -PAPERWIDTH) ? UNDER : COPLANAR);
 		if(vf==COPLANAR) 
 		{
 			funder.vertex.push_back(vi);
@@ -7,12 +7,15 @@
 // via merging spatial structures.
 // Use mouse drag and mouse wheel to 
 // orbit camera or move boolean operands.
+// Run with -check to just do the consistency checks.
 // 
 
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <set>
 
 // in project properties, add "../include" to the vc++ directories include path
 #include "linalg.h"   
@@ -120,11 +123,105 @@ void glDraw(BSPNode *root, const float3 &camera_position)
 float  Round(const float  x , const float p) { return roundf(x / p) * p; }
 float3 Round(const float3 &v, const float p) { return float3(v.x/p, v.y/p, v.z/p) * p; }
 
+// BSPIntersectLocal/BSPUnionLocal against redoing the whole brep.  The boxes cut through cells of the level,
+// so new faces come from cells the merge split and their neighbors need splicing.  The breps should match face for face.
+int BrepLocalCheck()
+{
+	auto faceset = [](BSPNode *r) {  // each face as its rounded vertices, starting from the least one, plus its material
+		std::multiset<std::vector<int>> s;
+		for (auto n : treetraverse(r)) for (auto &f : n->brep)
+		{
+			std::vector<int> v;
+			for (auto &p : f.vertex) for (int k = 0; k < 3; k++) v.push_back((int)roundf(p[k] * 1000));
+			size_t first = 0;
+			for (size_t i = 1; i < f.vertex.size(); i++)
+				if (std::lexicographical_compare(v.begin() + 3 * i, v.begin() + 3 * i + 3, v.begin() + 3 * first, v.begin() + 3 * first + 3)) first = i;
+			std::rotate(v.begin(), v.begin() + 3 * first, v.end());
+			v.push_back(f.matid);
+			s.insert(v);
+		}
+		return s;
+	};
+	auto box = [](float3 a, float3 b) { auto n = BSPCompile(WingMeshToFaces(WingMeshBox(a, b)), WingMeshCube(16.0f)); BSPMakeBrep(n.get(), {}); return n; };
+	auto full = NegateTree(box({ -4, -4, -2 }, { 4, 4, 2 }));
+	for (float x : { -2.0f, 1.0f })
+		full = BSPUnion(box({ x, -1, -2 }, { x + 0.5f, 1, 1 }), move(full));
+	BSPMakeBrep(full.get(), BSPRipBrep(full.get()));
+	auto local = BSPDup(full.get());
+	int differ = 0;
+	for (int k = 0; k < 4; k++)
+	{
+		float3 a(-2.5f + k, -1.5f + 0.5f*k, -1.0f), b = a + float3(1.25f, 1.0f, 2.0f);  // overlaps a pillar, the floor, or both
+		if (k % 2 == 0)
+		{
+			full  = BSPIntersect(NegateTree(box(a, b)), move(full));
+			local = BSPIntersectLocal(NegateTree(box(a, b)), move(local));
+		}
+		else
+		{
+			full  = BSPUnion(box(a, b), move(full));
+			local = BSPUnionLocal(box(a, b), move(local));
+		}
+		BSPMakeBrep(full.get(), BSPRipBrep(full.get()));
+		auto f = faceset(full.get()), l = faceset(local.get());
+		for (auto &v : f) differ += !l.count(v);
+		for (auto &v : l) differ += !f.count(v);
+	}
+	std::cout << "local brep regeneration " << (differ ? "differs from" : "matches") << " full BSPMakeBrep (" << differ << " faces)\n";
+	return differ;
+}
+
+// WingMeshCompactT's Crop, SplitTest and SupportPoint against the WingMesh versions BSPChooseSplit used to call.
+// Crops each shape down a chain of planes so later crops start from cells like the ones a compile produces.
+int CompactCropCheck()
+{
+	int differ = 0, crops = 0;
+	for (auto shape : { WingMeshBox({ -1, -1, -1 }, { 1, 1, 1 }), WingMeshCylinder(12, 1.0f, 2.0f), WingMeshDual(WingMeshBox({ -1, -1, -1 }, { 1, 1, 1 }), 0.85f) })
+	{
+		WingMesh wm = shape;
+		WingMeshCompact16 c16(shape);
+		WingMeshCompact32 c32(shape);
+		for (int i = 0; i < 24 && wm.verts.size(); i++, crops++)
+		{
+			float3 n = normalize(float3(sinf(i*2.3f + 0.4f), cosf(i*1.7f), sinf(i*0.9f + 1.0f)));
+			float4 slice(n, -dot(n, SupportPoint(&wm, n)) * 0.6f);  // keeps most of the cell
+			float4 probe(normalize(float3(cosf(i*1.3f), 0.5f, sinf(i*3.1f))), 0.1f);
+			wm  = WingMeshCrop(wm, slice);
+			c16 = WingMeshCrop(c16, slice);
+			c32 = WingMeshCrop(c32, slice);
+			float vol = WingMeshVolume(wm);
+			float tolerance = vol * PAPERWIDTH + 1e-6f;  // vertices kept within PAPERWIDTH of a cut leave faces not quite flat, so a different fan start moves the volume a bit
+			for (auto c : { c16.Expand(), c32.Expand() })
+			{
+				c.SanityCheck();
+				bool same = c.verts.size() == wm.verts.size() && c.edges.size() == wm.edges.size() && c.faces.size() == wm.faces.size()
+					&& (wm.faces.empty() || c.faces[0] == wm.faces[0]) && fabsf(c.CalcVolume() - vol) <= tolerance
+					&& c.SplitTest(probe) == wm.SplitTest(probe)
+					&& (wm.verts.empty() || fabsf(dot(SupportPoint(&c, probe.xyz()) - SupportPoint(&wm, probe.xyz()), probe.xyz())) < 1e-4f);
+				differ += !same;
+			}
+			differ += fabsf(WingMeshVolume(c16) - vol) > tolerance;
+			differ += c16.SplitTest(probe) != wm.SplitTest(probe) || c32.SplitTest(probe) != wm.SplitTest(probe);
+			differ += c16.verts.size() != c32.verts.size() || (c16.verts.size() && SupportPoint(&c16, probe.xyz()) != SupportPoint(&c32, probe.xyz()));
+		}
+	}
+	std::cout << "compact wingmesh crop " << (differ ? "differs from" : "matches") << " WingMeshCrop (" << differ << " mismatches in " << crops << " crops)\n";
+	return differ;
+}
+
 // int main(int argc, char *argv[])
 int APIENTRY WinMain(HINSTANCE hCurrentInst, HINSTANCE hPreviousInst,
 LPSTR lpszCmdLine, int nCmdShow)
 {
 	std::cout << "TestBSP\n";
+	if (strstr(lpszCmdLine, "-check"))  // no window, just the checks
+	{
+		int differ = CompactCropCheck() + BrepLocalCheck();
+		if (bspnodecount)
+			std::cout << bspnodecount << " bsp nodes still allocated after the checks\n";
+		BSPNodePoolRelease();
+		return differ || bspnodecount;
+	}
 	int drawmode = 0;  // drawing mode: draw bsp cells or draw brep
 
 	// create a couple boxes and subtract one from the other
@@ -4,52 +4,31 @@
 //  I didn't want to bloat this repo with data files, so please download the four mnist data files and place in this directory.
 //  look for names "train-images-idx3-ubyte".  Easy to find.   try the main site:    http://yann.lecun.com/exdb/mnist/  
 //  There are many copies on the internet including a handful of other github repos for example: https://github.com/wichtounet/mnist.git . 
+//  Trains a sample at a time by default,  -parallel or -hogwild for the threaded trainers,  -bench just times vmath and sgemm instead.
 //
 
+#define NOMINMAX             // before anything pulls in Windows.h, cnnfile.h does too,  else min and max are macros
+#define WIN32_LEAN_AND_MEAN
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <chrono>
+#include <functional>
 #include <cnn.h>
+#include <cnnquant.h>
+#include <cnnfuse.h>
+#include <cnnfile.h>
+#include <cnndata.h>
+#include <vmath.h>
 #include <geometric.h>
 #include <Windows.h>  // for messagebox if an error is thrown
 
 // the mnist dataset is the standard nn benchmark and extensively studied.  
 // A good test to ensure any cnn code is behaving as expected.
-// There's not much point writing a general purpose parser that properly 
-// decodes the other-byte-ordered header part to extract count,width,height 
-// for the idx{1,3} format when there are only 2 files on the planet using this format that even matter.
-// so i just seek to the start position, and read the well known data 28x28x60000 block in uchar format.
+// The idx files get mapped and streamed a batch at a time (cnndata.h) rather than read in whole.
 // 
-std::vector<std::vector<float>> mnist_read_images(std::string filename,int count)
-{
-	std::ifstream in(filename, std::istream::binary);
-	if (!in.is_open()) throw("unable to open mnist dataset, please download this if you haven't already");
-	in.seekg(16);
-	std::vector<unsigned char> buf(count * 28 * 28);
-	in.read((char*) buf.data(), buf.size());
-	auto buff = Transform(buf, [](unsigned char s) {return s / 255.0f;});
-	std::vector<std::vector<float>> images(count);
-	for (int i = 0;i < count;i++)
-		images[i] = std::vector<float>(buff.data() + i * 28 * 28, buff.data() + (i + 1) * 28 * 28);
-	return images;
-}
-std::vector<std::vector<float>> mnist_read_labels(std::string filename, int count)
-{
-	std::ifstream in(filename, std::istream::binary);
-	if (!in.is_open()) throw("unable to open mnist dataset, please download this if you haven't already");
-	in.seekg(8);
-	std::vector<unsigned char> buf(count );
-	in.read((char*)buf.data(), buf.size());
-	std::vector<std::vector<float>> labels(count);
-	for (int i = 0;i < count;i++)
-	{
-		labels[i] = std::vector<float>(10, 0.0f);
-		labels[i][buf[i]] = 1.0f;
-	}
-	return labels;
-}
-int minst_best(std::vector<float> &v) { assert(v.size() == 10); int best = 0; for (int j = 0;j < 10;j++) if (v[j]>v[best]) best = j; return best; }
+int minst_best(const std::vector<float> &v) { assert(v.size() == 10); int best = 0; for (int j = 0;j < 10;j++) if (v[j]>v[best]) best = j; return best; }
+int minst_best(const float *v) { int best = 0; for (int j = 0;j < 10;j++) if (v[j]>v[best]) best = j; return best; }
 
 class progress_report
 {
@@ -67,7 +46,95 @@ public:
     }
 };
 
-void mnist()
+enum TrainMode { SERIAL, PARALLEL, HOGWILD };  // per sample SGD,  mini-batches split across threads,  per sample on every thread at once
+
+// int8 copy of the trained network, calibrated on the first 1000 training images, against the float one on the test set
+void quantreport(CNN &cnn, const Dataset &train, const Dataset &test)
+{
+	typedef std::chrono::high_resolution_clock clock;
+	auto quantized = Quantize(cnn, DatasetStream(train, 1000).Next()->X, 1000);
+	CNN &q = quantized.cnn;
+	size_t fbytes = 0, qbytes = 0;
+	for (auto l : cnn.layers) fbytes += l->params() * sizeof(float);
+	for (auto l : q.layers) if (auto w = dynamic_cast<LInt8*>(l)) qbytes += w->bytes();
+
+	int correct[2] = { 0, 0 }, agree = 0;
+	float maxdiff = 0.0f;
+	double seconds[2] = { 0, 0 };
+	DatasetStream tests(test, 100);
+	while (auto b = tests.Next())
+	{
+		std::vector<float> outputs[2];
+		for (int m = 0; m < 2; m++)
+		{
+			auto t0 = clock::now();
+			outputs[m] = (m ? q : cnn).EvalBatch(b->X, b->n);
+			seconds[m] += std::chrono::duration<double>(clock::now() - t0).count();
+		}
+		for (int k = 0; k < b->n; k++)
+		{
+			int best[2] = { minst_best(CNN::sample(outputs[0], b->n, k)), minst_best(CNN::sample(outputs[1], b->n, k)) };
+			for (int m = 0; m < 2; m++)
+				correct[m] += (best[m] == minst_best(b->T.data() + k*10));
+			agree += (best[0] == best[1]);
+		}
+		for (unsigned int j = 0; j < outputs[0].size(); j++)
+			maxdiff = std::max(maxdiff, std::abs(outputs[0][j] - outputs[1][j]));
+	}
+	std::cout << "int8 (" << (simd_vnni() ? "vnni" : simd_name(simd_level())) << ")  fp32 " << correct[0] << " correct, int8 " << correct[1] << " correct,  "
+		<< agree << " of " << test.count << " agree,  max output difference " << maxdiff << "\n";
+	std::cout << "  conv/full weights " << fbytes << " bytes fp32, " << qbytes << " int8,  test set in " << seconds[0] << " vs " << seconds[1] << " seconds\n";
+}
+
+// fused copy of the trained network against the layer by layer one, should come out the same only with less going through memory
+void fusereport(CNN &cnn, const Dataset &test)
+{
+	typedef std::chrono::high_resolution_clock clock;
+	auto fused = Fuse(cnn);
+	CNN &f = fused.cnn;
+	size_t floats[2] = { 0, 0 };  // written and read back per image between layers
+	for (auto l : cnn.layers) floats[0] += l->outsize();
+	for (auto l : f.layers)   floats[1] += l->outsize();
+	int differ = 0;
+	double seconds[2] = { 0, 0 };
+	DatasetStream tests(test, 100);
+	while (auto b = tests.Next())
+	{
+		std::vector<float> outputs[2];
+		for (int m = 0; m < 2; m++)
+		{
+			auto t0 = clock::now();
+			outputs[m] = (m ? f : cnn).EvalBatch(b->X, b->n);
+			seconds[m] += std::chrono::duration<double>(clock::now() - t0).count();
+		}
+		for (unsigned int j = 0; j < outputs[0].size(); j++)
+			differ += (outputs[0][j] != outputs[1][j]);
+	}
+	std::cout << "fused  " << cnn.layers.size() << " layers into " << f.layers.size() << ",  " << differ << " outputs differ,  "
+		<< floats[0] << " vs " << floats[1] << " floats between layers per image,  test set in " << seconds[0] << " vs " << seconds[1] << " seconds\n";
+}
+
+// trained network out to a self describing model file and mapped back in, which should need no code to rebuild the layers and give the same outputs
+void filereport(CNN &cnn, const Dataset &test)
+{
+	typedef std::chrono::high_resolution_clock clock;
+	if (!CNNSave(cnn, "mnist.cnnf"))
+		throw "couldnt save mnist.cnnf";
+	auto t0 = clock::now();
+	auto mapped = CNNMap("mnist.cnnf");
+	double seconds = std::chrono::duration<double>(clock::now() - t0).count();
+	if (!mapped)
+		throw "couldnt map mnist.cnnf";
+	DatasetStream tests(test, 1000);
+	auto images = tests.Next();
+	auto a = cnn.EvalBatch(images->X, images->n), b = mapped->cnn.EvalBatch(images->X, images->n);
+	int differ = 0;
+	for (unsigned int j = 0; j < a.size(); j++)
+		differ += (a[j] != b[j]);
+	std::cout << "mnist.cnnf  " << mapped->mapping->size << " bytes, " << mapped->cnn.layers.size() << " layers mapped in " << seconds << " seconds,  " << differ << " outputs differ\n";
+}
+
+void mnist(TrainMode mode)
 {
 	std::cout << "mnist\n";
 	std::cout << "be patient this may take minutes.\n";
@@ -75,10 +142,13 @@ void mnist()
 	 std::cout << "Suggest you use 'Release' mode instead of 'Debug'.\n";
 #	endif
 	std::cout << "should get close to 99% correctness\n";
-	auto train_in = mnist_read_images("train-images-idx3-ubyte", 60000);
-	auto train_lb = mnist_read_labels("train-labels-idx1-ubyte", 60000);
-	auto test_in  = mnist_read_images("t10k-images-idx3-ubyte" , 10000);
-	auto test_lb  = mnist_read_labels("t10k-labels-idx1-ubyte" , 10000);
+	auto train = DatasetMap("train-images-idx3-ubyte", "train-labels-idx1-ubyte");
+	auto test  = DatasetMap("t10k-images-idx3-ubyte" , "t10k-labels-idx1-ubyte");
+	if (!train || !test) throw("unable to open mnist dataset, please download this if you haven't already");
+	// for PARALLEL, 8 samples a shard for every core but at least 32, the others go a sample at a time and just take their samples in batches
+	const int minibatch = 8 * std::max(4, (int)std::thread::hardware_concurrency());
+	DatasetStream tests(*test, 100), samples(*train, (mode == PARALLEL) ? minibatch : 1000);
+	std::default_random_engine rng;
 
 	// I just used a typical cnn setup here.
 	// Feel free to try other configurations
@@ -97,24 +167,37 @@ void mnist()
 	cnn.Init();
 
 
-	for (int e = 0; e < 20;e++) // each training epoch does an initial test followed by backprop on all 60K samples.
+	for (int e = 0; e < 20;e++) // each training epoch does an initial test followed by backprop on all 60K samples, in a new order each time.
 	{
-        auto p = progress_report("Evaluating", 10000);
-		int correct = 0;
-		for (int i = 0;i < 10000;i++)
+        auto p = progress_report("Evaluating", test->count);
+		int correct = 0, done = 0;  // scoring goes through EvalBatch, matrix-matrix instead of one image at a time
+		tests.Epoch();
+		while (auto b = tests.Next())
         {
-			correct += (minst_best(cnn.Eval(test_in[i])) == minst_best(test_lb[i]));
-            p.update(i);
+			auto outputs = cnn.EvalBatch(b->X, b->n);
+			for (int k = 0; k < b->n; k++)
+				correct += (minst_best(CNN::sample(outputs, b->n, k)) == minst_best(b->T.data() + k*10));
+            p.update((done += b->n) - 1);
         }
-		std::cout << correct << " of 10000 correct\n";
+		std::cout << correct << " of " << test->count << " correct\n";
 
-        p = progress_report("Training", 60000);
-		for (int i = 0;i < 60000;i++)
-        {
-			cnn.Train(train_in[i], train_lb[i]);
-            p.update(i);
-        }
+        p = progress_report("Training", train->count);
+		done = 0;
+		samples.Epoch(rng);
+		while (auto b = samples.Next())
+		{
+			if (mode == HOGWILD)
+				cnn.TrainHogwild(b->X, b->T, b->n);
+			else if (mode == PARALLEL)  // gradient gets averaged, so scale the step to match what minibatch single samples would take
+				cnn.TrainParallel(b->X, b->T, b->n, 0.01f * minibatch);
+			else for (int k = 0; k < b->n; k++)
+				cnn.Train(cnn.pass, b->X.data() + k*train->size, b->T.data() + k*10, 0.01f);
+			p.update((done += b->n) - 1);
+		}
 	}
+	quantreport(cnn, *train, *test);
+	fusereport(cnn, *test);
+	filereport(cnn, *test);
 }
 
 void xor()
@@ -153,7 +236,7 @@ void junk()
 	std::vector<float> in(25);
 	for (int i = 0; i < 25; i++)in[i] = (float)i;
 	std::vector<float> expected(18, 0.0f);
-	auto out = cl.forward(in);
+	auto out = cnn.Eval(in);
 	std::cout << "output \n";
 	for (auto y : out)
 		std::cout << y << " ";
@@ -167,10 +250,121 @@ void junk()
 	std::cout << "\n";
 }
 
+void gemmbench()
+{
+	// GFLOP/s of sgemm() at each simd level the cpu has, against the row at a time madd() loops the layers used before,
+	// on the shapes the mnist net multiplies.  Also how far each level's result is from the plain c++ reference.
+	typedef std::chrono::high_resolution_clock clock;
+	struct { const char *name; int m, n, k; } shapes[] = {
+		{ "conv1 16x576x25   ",  16, 576,   25 },
+		{ "conv2 64x16x144   ",  64,  16,  144 },
+		{ "full1 100x64x1024 ", 100,  64, 1024 },
+		{ "full2 100x10x64   ", 100,  10,   64 },
+		{ "square 512        ", 512, 512,  512 },
+	};
+	SIMD best = simd_level();
+	std::cout << "sgemm GFLOP/s           loops";
+	for (int level = SIMD_SCALAR; level <= best; level++)
+		std::cout << "  " << simd_name((SIMD)level);
+	std::cout << "   max diff from scalar\n";
+	for (auto &s : shapes)
+	{
+		std::vector<float> A(s.m*s.k), B(s.k*s.n), C(s.m*s.n), R(s.m*s.n);
+		std::default_random_engine rng;
+		for (auto &x : A) x = std::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
+		for (auto &x : B) x = std::uniform_real_distribution<float>(-1.0f, 1.0f)(rng);
+		auto gflops = [&](std::function<void()> f) {
+			int reps = std::max(1, 200000000 / (2 * s.m*s.n*s.k));
+			auto t0 = clock::now();
+			for (int r = 0; r < reps; r++) f();
+			return 2.0 * s.m*s.n*s.k*reps / std::chrono::duration<double>(clock::now() - t0).count() * 1e-9;
+		};
+		std::cout << s.name << "  " << gflops([&]() { for (int i = 0; i < s.m; i++) for (int p = 0; p < s.k; p++) madd(C.data() + i*s.n, B.data() + p*s.n, A[i*s.k + p], s.n); });
+		float diff = 0.0f;
+		for (int level = SIMD_SCALAR; level <= best; level++)
+		{
+			simd_level() = (SIMD)level;
+			std::cout << "  " << gflops([&]() { sgemm(false, false, s.m, s.n, s.k, 1.0f, A.data(), s.k, B.data(), s.n, 0.0f, C.data(), s.n); });
+			if (level == SIMD_SCALAR)
+				R = C;
+			for (unsigned int i = 0; i < C.size(); i++)
+				diff = std::max(diff, std::abs(C[i] - R[i]));
+		}
+		simd_level() = best;
+		std::cout << "   " << diff << "\n";
+	}
+	std::cout << "\n";
+}
+
+void vmathtest()
+{
+	// vexp, vtanh and vsigmoid in each vmath mode at each simd level against the std:: versions, over the whole range that
+	// doesnt over or underflow plus a fine sweep around 0.  Throws if anything is past vmath_maxerror().  Also Mfloat/s.
+	typedef std::chrono::high_resolution_clock clock;
+	std::vector<float> x, y;
+	for (float t = -87.0f; t < 88.0f; t += 0.000731f) x.push_back(t);
+	for (float t = -1.0f; t < 1.0f; t += 0.00001f) x.push_back(t);
+	y.resize(x.size());
+	int n = (int)x.size();
+	struct { const char *name; void (*f)(const float *, float *, int); float (*ref)(float); bool relative; } funcs[] = {
+		{ "exp    ", vexp,     [](float t) { return std::exp(t); },                 true  },
+		{ "tanh   ", vtanh,    [](float t) { return std::tanh(t); },                false },
+		{ "sigmoid", vsigmoid, [](float t) { return 1.0f / (1.0f + std::exp(-t)); }, false },
+	};
+	SIMD best = simd_level();
+	for (auto &f : funcs)
+	{
+		std::cout << "v" << f.name << "  Mfloat/s  std ";
+		vmath_mode() = VMATH_STD;
+		auto t0 = clock::now();
+		f.f(x.data(), y.data(), n);
+		std::cout << n / std::chrono::duration<double>(clock::now() - t0).count() * 1e-6;
+		for (VMATH mode : { VMATH_PRECISE, VMATH_FAST })
+		{
+			vmath_mode() = mode;
+			std::cout << "   " << vmath_name(mode);
+			float err = 0.0f;
+			for (int level = SIMD_SCALAR; level <= best; level++)
+			{
+				simd_level() = (SIMD)level;
+				t0 = clock::now();
+				f.f(x.data(), y.data(), n);
+				std::cout << " " << n / std::chrono::duration<double>(clock::now() - t0).count() * 1e-6;
+				for (int i = 0; i < n; i++)
+				{
+					float r = f.ref(x[i]);
+					err = std::max(err, std::abs(y[i] - r) / (f.relative ? r : 1.0f));
+				}
+			}
+			std::cout << " (max err " << err << ")";
+			if (!(err <= vmath_maxerror(mode)))
+				throw "vmath error is past its bound";
+		}
+		std::cout << "\n";
+	}
+	simd_level() = best;
+	vmath_mode() = VMATH_PRECISE;
+	std::cout << "\n";
+}
+
 int main(int argc, char *argv[]) try
 {
 	//xor();
-	mnist();
+	TrainMode mode = SERIAL;
+	bool bench = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		mode  = (arg == "-parallel") ? PARALLEL : (arg == "-hogwild") ? HOGWILD : (arg == "-serial") ? SERIAL : mode;
+		bench = bench || (arg == "-bench");
+	}
+	if (bench)  // just time the vectorized math and sgemm,  no training
+	{
+		vmathtest();
+		gemmbench();
+		return 0;
+	}
+	mnist(mode);
 
 	std::cout << "\n";
 	return 0;
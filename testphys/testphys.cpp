@@ -22,6 +22,7 @@ using namespace linalg::aliases;  // float3, int2, float3x3 etc
 #include "gjk.h"
 #include "wingmesh.h"
 #include "physics.h"
+#include "convexdecomp.h"
 
 
 
@@ -89,6 +90,20 @@ void rbdraw(const RigidBody *rb)
 
 Shape AsShape(const WingMesh &m) { return Shape(m.verts, m.GenerateTris()); }
 
+std::vector<Shape> JackShapes()  // the jack as one non-convex triangle mesh, let ConvexDecomposition() find the convex pieces
+{
+	std::vector<float3> verts;
+	std::vector<int3>   tris;
+	for (auto &bar : { WingMeshBox({ 1, 0.2f, 0.2f }), WingMeshBox({ 0.2f, 1, 0.2f }), WingMeshBox({ 0.2f, 0.2f, 1 }) })
+	{
+		int base = verts.size();
+		for (auto t : bar.GenerateTris())
+			tris.push_back(t + int3(base, base, base));
+		verts.insert(verts.end(), bar.verts.begin(), bar.verts.end());
+	}
+	return ConvexDecomposition(verts, tris);
+}
+
 
 int APIENTRY WinMain(HINSTANCE hCurrentInst, HINSTANCE hPreviousInst,LPSTR lpszCmdLine, int nCmdShow) // int main(int argc, char *argv[])
 {
@@ -103,7 +118,7 @@ int APIENTRY WinMain(HINSTANCE hCurrentInst, HINSTANCE hPreviousInst,LPSTR lpszC
 	rigidbodies.push_back( new RigidBody({ AsShape(WingMeshCube(0.25f)) }, seesaw->position_start + float3( 2.5f, 0, 0.4f)));
 	rigidbodies.push_back( new RigidBody({ AsShape(WingMeshCube(0.50f)) }, seesaw->position_start + float3(-2.5f, 0, 5.0f)));
 	rbscalemass(rigidbodies.back(), 4.0f);
-	rigidbodies.push_back(new RigidBody({ AsShape(WingMeshBox({1,0.2f,0.2f})),AsShape(WingMeshBox({0.2f,1,0.2f})),AsShape(WingMeshBox({0.2f,0.2f,1})) }, { -1.5f, 0.5f, 7.5f }));
+	rigidbodies.push_back(new RigidBody(JackShapes(), { -1.5f, 0.5f, 7.5f }));
 	for (float z = 5.5f; z < 14.0f; z += 3.0f)
 		rigidbodies.push_back(new RigidBody({ AsShape(WingMeshCube(0.5f)) }, { 0.0f, 0.0f, z }));
 	for (float z = 15.0f; z < 20.0f; z += 3.0f)
@@ -193,7 +193,7 @@ int APIENTRY WinMain(HINSTANCE hCurrentInst, HINSTANCE hPreviousInst,LPSTR lpszC
 				else
 					linears.push_back(ConstrainAlongDirection(NULL, v, &trackmodel, trackmodel.pose().inverse()*cp, plane.xyz(), -50, 50));
 			}
-			PhysicsUpdate(rigidbodies, linears, angulars, {});
+			PhysicsUpdate(rigidbodies, linears, angulars, std::vector<std::vector<float3> *>());  // no world geometry
 		}
 		else
 		{